@@ -0,0 +1,196 @@
+// stage_device.h
+//
+// Control interface for the at90usb based xyfly stage board over
+// libusb-1.0.  Commands are sent with asynchronous bulk transfers, up to
+// max_in_flight of them at once, and replies are handed to a callback on
+// the libusb event thread in the order the commands were sent.  State
+// telemetry from the interrupt endpoint goes to a callback of its own.
+// The protocol version is settled when the device is opened; packets are
+// always 32 bit on this side and narrowed for boards on version 1.
+
+#ifndef STAGE_STAGE_DEVICE_H
+#define STAGE_STAGE_DEVICE_H
+
+#include "stage/stage_protocol.h"
+
+#include <ros/ros.h>
+
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+struct libusb_context;
+struct libusb_device_handle;
+struct libusb_transfer;
+
+namespace stage
+{
+
+  class StageDevice
+  {
+  public:
+    typedef boost::function<void (const USBPacketInWrapper_t&)> StatusCallback;
+    // Samples come stamped with the time they were taken on the board,
+    // mapped onto ros::Time
+    typedef boost::function<void (const TelemetryPacketWrapper_t&, const ros::Time&)> TelemetryCallback;
+
+    // Round trip times in seconds, from submitting a command to receiving
+    // its reply, over the most recent commands
+    struct LatencyStats
+    {
+      size_t count;
+      double p50;
+      double p90;
+      double p99;
+      double max;
+    };
+
+    StageDevice(size_t max_in_flight = 4);
+    ~StageDevice();
+
+    bool open(const std::string& serial_number = "");
+    void close();
+    bool isOpen() const { return handle_ != NULL; }
+    // Version settled on by open(), 1 for boards that only know 16 bit
+    // positions
+    uint8_t getProtocolVersion() const { return protocol_version_; }
+
+    void setStatusCallback(const StatusCallback& callback);
+    void setTelemetryCallback(const TelemetryCallback& callback);
+
+    // All of these return false only if the device is not open.  When
+    // max_in_flight commands are outstanding a SET_STATE is held back,
+    // merged with any that directly follow it, and sent as soon as a reply
+    // comes in; a GET_STATE is dropped, since every reply carries the
+    // motor state anyway.
+    bool getState();
+    bool setState(uint8_t motor_update, const MotorStatus_t setpoint[MOTOR_NUM]);
+
+    // Firmware acceleration ramps, sent ahead of any later setState()
+    bool setAcceleration(uint8_t motor_update, const uint16_t acceleration[MOTOR_NUM]);
+
+    // Position move, tracked by the board until the motors stop.  With a
+    // nonzero move_id the board then sends a USB_CMD_MOVE_DONE packet of
+    // its own, which reaches the status callback like any reply, with
+    // MoveID and MoveStatus set.  Moves are never merged or dropped.
+    bool moveTo(uint8_t motor_update, const MotorStatus_t setpoint[MOTOR_NUM], uint8_t move_id);
+
+    // Coordinated move: the motors run in a straight line to their
+    // setpoint Positions and get there together, at the largest setpoint
+    // Frequency along the line.  Tracked and reported as moveTo() is.
+    // Needs protocol version 3; older boards ignore the command.
+    bool moveLine(uint8_t motor_update, const MotorStatus_t setpoint[MOTOR_NUM], uint8_t move_id);
+
+    // Homes the motors in motor_update: each seeks its limit switch at
+    // its frequency, backs off until the switch lets go, and takes its
+    // home position there.  Tracked and reported as moveTo() is; a motor
+    // that finds no switch aborts the move.  Needs protocol version 4.
+    bool home(uint8_t motor_update, const uint32_t frequency[MOTOR_NUM], uint8_t move_id);
+
+    // Encoder scale and step loss tolerance of the motors in motor_update,
+    // zeroing their encoder counts.  Needs protocol version 4.
+    bool setEncoders(uint8_t motor_update, const EncoderConfig_t config[MOTOR_NUM]);
+
+    // Trajectory streaming.  Segments are held on the host and sent as the
+    // board's segment buffer has room for them, so any number can be queued
+    // ahead.  A setState() drops segments that have not been sent yet, as
+    // the board drops the ones it holds; clearSegments() drops both and
+    // stops the motors the stream was moving.  The room on the board is
+    // learned from its replies, so keep calling getState() while segments
+    // are pending.
+    bool queueSegments(const std::vector<SegmentWrapper_t>& segments);
+    bool clearSegments();
+    size_t getSegmentsPending();
+
+    // Has the board sample its state every period segment ticks (1 ms
+    // each), or stop with 0.  Samples the host missed are counted from
+    // the gaps in their Sequence.
+    bool setTelemetryPeriod(uint16_t period);
+    size_t getTelemetryDropped(bool reset = false);
+
+    LatencyStats getLatencyStats(bool reset = false);
+
+  private:
+    struct OutSlot
+    {
+      StageDevice* device;
+      libusb_transfer* transfer;
+      uint32_t seq;
+    };
+
+    struct SentCommand
+    {
+      uint32_t seq;
+      uint8_t command_id;
+      uint8_t segment_count;
+      ros::WallTime stamp;
+    };
+
+    uint8_t negotiateProtocol();
+    USBPacketOutWrapper_t& queueCommand(uint8_t command_id, bool merge);
+    bool send(const void* packet, size_t size, uint8_t segment_count = 0);
+    void sendPending();
+    void recordLatency(double latency);
+
+    static void outCallback(libusb_transfer* transfer);
+    static void inCallback(libusb_transfer* transfer);
+    static void telemetryCallback(libusb_transfer* transfer);
+    void handleOut(OutSlot* slot);
+    void handleIn(libusb_transfer* transfer);
+    void handleTelemetry(libusb_transfer* transfer);
+    ros::Time telemetryStamp(const TelemetryPacketWrapper_t& packet);
+    void transferDone();
+    void eventLoop();
+
+    size_t max_in_flight_;
+
+    libusb_context* context_;
+    libusb_device_handle* handle_;
+    boost::thread event_thread_;
+    volatile bool stop_events_;
+    uint8_t protocol_version_;
+
+    // Guards everything below
+    boost::mutex mutex_;
+    boost::condition_variable transfers_done_;
+    bool closing_;
+    size_t active_transfers_;
+
+    std::vector<OutSlot> out_slots_;
+    std::vector<OutSlot*> free_out_slots_;
+    std::vector<libusb_transfer*> in_transfers_;
+    std::vector<libusb_transfer*> telemetry_transfers_;
+
+    std::deque<SentCommand> sent_;
+    uint32_t next_seq_;
+
+    // Commands waiting for a free slot, in order
+    std::deque<USBPacketOutWrapper_t> pending_;
+    std::deque<SegmentWrapper_t> pending_segments_;
+    // Room left in the board's segment buffer once everything in flight
+    // has been taken in
+    int segments_free_;
+
+    StatusCallback status_callback_;
+    TelemetryCallback telemetry_callback_;
+
+    // Board tick to ros::Time mapping, and sample bookkeeping
+    double telemetry_offset_;
+    uint32_t telemetry_last_tick_;
+    uint16_t telemetry_last_sequence_;
+    size_t telemetry_samples_;
+    size_t telemetry_dropped_;
+
+    std::vector<double> latencies_;
+    size_t latency_index_;
+    size_t latency_count_;
+  };
+
+}
+
+#endif
@@ -0,0 +1,222 @@
+// stage_protocol.h
+//
+// USB packet layout of the at90usb based xyfly stage board, mirroring the
+// definitions in usb_device/src/StageUSBDevice.h.  Both ends are little
+// endian, so the packed structs go over the wire as they are.
+//
+// Protocol version 2 carries 32 bit frequencies and positions, and
+// version 3 adds USB_CMD_MOVE_LINE on the same packets.  Version 4 adds
+// USB_CMD_HOME and USB_CMD_SET_ENCODER and appends the limit switch,
+// homing and encoder state to the replies, and version 5 appends the
+// count of segment ticks the board dropped.  Boards start out
+// on version 1, the original 16 bit packets (the *16_t structs),
+// until USB_CMD_PROTOCOL_VERSION moves them on; firmware from before the
+// command answers it with a state reply, which lacks PROTOCOL_MAGIC.
+
+#ifndef STAGE_STAGE_PROTOCOL_H
+#define STAGE_STAGE_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace stage
+{
+
+  /* USB device parameters */
+  const uint16_t USB_VENDOR_ID          = 0x0004;
+  const uint16_t USB_PRODUCT_ID         = 0x0002;
+  const uint8_t  USB_BULKOUT_EP_ADDRESS = 0x01;
+  const uint8_t  USB_BULKIN_EP_ADDRESS  = 0x82;
+  const uint8_t  USB_TELEMETRY_EP_ADDRESS = 0x83;
+  const int      USB_BUFFER_OUT_SIZE    = 64;
+  const int      USB_BUFFER_IN_SIZE     = 64;
+  const int      USB_TELEMETRY_SIZE     = 32;
+
+  /* USB Commands */
+  const uint8_t USB_CMD_GET_STATE    = 1;
+  const uint8_t USB_CMD_SET_STATE    = 2;
+  const uint8_t USB_CMD_STREAM_SEGMENTS = 3;
+  const uint8_t USB_CMD_STREAM_CLEAR    = 4;
+  const uint8_t USB_CMD_SET_ACCELERATION = 5;
+  const uint8_t USB_CMD_MOVE         = 6;
+  const uint8_t USB_CMD_SET_TELEMETRY = 7;
+  const uint8_t USB_CMD_PROTOCOL_VERSION = 8;
+  const uint8_t USB_CMD_MOVE_LINE    = 9;
+  const uint8_t USB_CMD_HOME         = 10;
+  const uint8_t USB_CMD_SET_ENCODER  = 11;
+  const uint8_t USB_CMD_MOVE_DONE    = 100;
+  const uint8_t USB_CMD_AVR_RESET    = 200;
+  const uint8_t USB_CMD_AVR_DFU_MODE = 201;
+
+  const int MOTOR_NUM = 3;
+  const uint16_t MOTOR_FREQUENCY_MAX = 50000;
+
+  /* Trajectory streaming */
+  const int SEGMENT_BUFFER_SIZE = 64;
+  const int SEGMENT_PACKET_NUM  = 2;
+  const int SEGMENT16_PACKET_NUM = 4;
+  const int SEGMENT_TICK_FREQ   = 1000;
+
+  /* Position moves */
+  const uint8_t MOVE_STATUS_IDLE    = 0;
+  const uint8_t MOVE_STATUS_MOVING  = 1;
+  const uint8_t MOVE_STATUS_DONE    = 2;
+  const uint8_t MOVE_STATUS_ABORTED = 3;
+
+  /* Limit switches and encoders */
+  const int ENCODER_NUM = 2;
+
+  /* Protocol versions */
+  const uint8_t  PROTOCOL_VERSION_MAX = 5;
+  const uint16_t PROTOCOL_MAGIC       = 0xFFFF;
+
+#pragma pack(push, 1)
+  struct MotorStatus_t
+  {
+    uint32_t   Frequency;
+    int32_t    Position;
+  };
+
+  // Steps motor moves per Counts encoder counts; Counts 0 turns the
+  // encoder off.  Tolerance is the step error that counts as step loss,
+  // 0 for the firmware's default.
+  struct EncoderConfig_t
+  {
+    int16_t    Steps;
+    uint16_t   Counts;
+    uint16_t   Tolerance;
+  };
+
+  struct USBPacketOutWrapper_t
+  {
+    uint8_t       CommandID;
+    uint8_t       MotorUpdate;
+    union
+    {
+      MotorStatus_t Setpoint[MOTOR_NUM];
+      // USB_CMD_SET_ACCELERATION: step frequency change per segment tick,
+      // 0 for no ramp
+      uint16_t      Acceleration[MOTOR_NUM];
+      // USB_CMD_SET_TELEMETRY: segment ticks between samples, 0 for off
+      uint16_t      TelemetryPeriod;
+      // USB_CMD_PROTOCOL_VERSION: highest version the host knows
+      uint8_t       ProtocolVersion;
+      // USB_CMD_SET_ENCODER
+      EncoderConfig_t Encoder[MOTOR_NUM];
+    };
+    // USB_CMD_MOVE, USB_CMD_MOVE_LINE, USB_CMD_HOME: nonzero to have the
+    // board send USB_CMD_MOVE_DONE
+    uint8_t       MoveID;
+  };
+
+  // Setpoints of the motors in MotorUpdate, applied as by SET_STATE and
+  // held for Duration ticks (0 holds until the next segment is queued)
+  struct SegmentWrapper_t
+  {
+    uint8_t       MotorUpdate;
+    uint16_t      Duration;
+    MotorStatus_t Setpoint[MOTOR_NUM];
+  };
+
+  struct USBPacketSegmentsWrapper_t
+  {
+    uint8_t          CommandID;
+    uint8_t          SegmentCount;
+    SegmentWrapper_t Segment[SEGMENT_PACKET_NUM];
+  };
+
+  struct USBPacketInWrapper_t
+  {
+    uint8_t       CommandID;
+    MotorStatus_t MotorStatus[MOTOR_NUM];
+    uint8_t       SegmentsFree;
+    uint8_t       SegmentsAccepted;
+    uint8_t       MoveID;
+    uint8_t       MoveStatus;
+    // Version 4 on; bit masks by motor
+    uint8_t       LimitStatus;
+    uint8_t       Homed;
+    uint8_t       StepLoss;
+    int32_t       EncoderCount[MOTOR_NUM];
+    // Version 5 on: segment ticks the board was too busy to run, since
+    // power up, wrapping
+    uint16_t      TicksDropped;
+  };
+
+  // Replies end before LimitStatus on versions 2 and 3
+  const size_t USBPACKETIN_V2_SIZE = offsetof(USBPacketInWrapper_t, LimitStatus);
+
+  // Reply to USB_CMD_PROTOCOL_VERSION, in the same form whatever the version
+  struct USBPacketVersionWrapper_t
+  {
+    uint8_t       CommandID;
+    uint16_t      Magic;
+    uint8_t       ProtocolVersion;
+    uint8_t       ProtocolVersionMax;
+  };
+
+  // Sent on the telemetry endpoint every TelemetryPeriod ticks.  Sequence
+  // counts samples taken, so a gap means the host missed some.
+  struct TelemetryPacketWrapper_t
+  {
+    uint16_t      Sequence;
+    uint32_t      Tick;
+    MotorStatus_t MotorStatus[MOTOR_NUM];
+  };
+
+  /* Protocol version 1 */
+  struct MotorStatus16_t
+  {
+    uint16_t   Frequency;
+    uint16_t   Position;
+  };
+
+  struct USBPacketOut16Wrapper_t
+  {
+    uint8_t       CommandID;
+    uint8_t       MotorUpdate;
+    union
+    {
+      MotorStatus16_t Setpoint[MOTOR_NUM];
+      uint16_t      Acceleration[MOTOR_NUM];
+      uint16_t      TelemetryPeriod;
+      uint8_t       ProtocolVersion;
+    };
+    uint8_t       MoveID;
+  };
+
+  struct Segment16Wrapper_t
+  {
+    uint8_t       MotorUpdate;
+    uint16_t      Duration;
+    MotorStatus16_t Setpoint[MOTOR_NUM];
+  };
+
+  struct USBPacketSegments16Wrapper_t
+  {
+    uint8_t          CommandID;
+    uint8_t          SegmentCount;
+    Segment16Wrapper_t Segment[SEGMENT16_PACKET_NUM];
+  };
+
+  struct USBPacketIn16Wrapper_t
+  {
+    uint8_t       CommandID;
+    MotorStatus16_t MotorStatus[MOTOR_NUM];
+    uint8_t       SegmentsFree;
+    uint8_t       SegmentsAccepted;
+    uint8_t       MoveID;
+    uint8_t       MoveStatus;
+  };
+
+  struct TelemetryPacket16Wrapper_t
+  {
+    uint16_t      Sequence;
+    uint32_t      Tick;
+    MotorStatus16_t MotorStatus[MOTOR_NUM];
+  };
+#pragma pack(pop)
+
+}
+
+#endif
@@ -8,7 +8,9 @@ from stage.srv import *
 class StageCommunicator():
     def __init__(self):
         print "Opening XYFly stage device..."
-        self.dev = StageDevice.StageDevice()
+        # Microsteps per full step the drivers are set to
+        microsteps = rospy.get_param('~microsteps', 1)
+        self.dev = StageDevice.StageDevice(microsteps=microsteps)
         self.dev.print_values()
         self.response = Velocity_StateResponse()
         self.min_velocity = 1
@@ -4,23 +4,68 @@ import roslib; roslib.load_manifest('stage')
 import rospy
 import StageDevice
 import threading
+import time
 from stage.msg import Velocity, StateStamped
 
 class StageUSB():
     def __init__(self):
         self.lock = threading.Lock()
         print "Opening XYFly stage device..."
-        self.dev = StageDevice.StageDevice()
+        # Microsteps per full step the drivers are set to
+        microsteps = rospy.get_param('~microsteps', 1)
+        self.dev = StageDevice.StageDevice(microsteps=microsteps)
         self.dev.print_values()
+        # Firmware acceleration ramps in mm/s^2, 0 to leave them off
+        acceleration = rospy.get_param('~acceleration', 0)
+        if acceleration > 0:
+            self.dev.set_acceleration(acceleration, acceleration)
+        # Samples/s of state telemetry, 0 to poll the state instead
+        self.telemetry_rate = rospy.get_param('~telemetry_rate', 0)
+        if self.telemetry_rate > 0:
+            self.dev.set_telemetry_rate(self.telemetry_rate)
+        # Homing at start up in mm/s, 0 to leave the positions as they are
+        home_velocity = rospy.get_param('~home_velocity', 0)
+        # Encoder counts per mm of x and y travel, 0 for no encoders
+        encoder_counts_per_mm = rospy.get_param('~encoder_counts_per_mm', 0)
+        # Position error in mm that counts as lost steps, 0 for the
+        # firmware's default
+        step_loss_tolerance = rospy.get_param('~step_loss_tolerance', 0)
+        self.step_loss = 0
+        if (home_velocity > 0 or encoder_counts_per_mm > 0) and self.dev.protocol_version < 4:
+            rospy.logwarn("Stage firmware has no homing or encoder support")
+        else:
+            if encoder_counts_per_mm > 0 or step_loss_tolerance > 0:
+                self.dev.set_encoders(encoder_counts_per_mm, step_loss_tolerance)
+            if home_velocity > 0:
+                print "Homing the stage..."
+                status = self.dev.home(home_velocity, wait=True)[0]
+                if status != self.dev.MOVE_STATUS_DONE:
+                    rospy.logerr("Stage homing failed, limit switch not found")
 
     def update_velocity(self,x_velocity,y_velocity):
         self.dev.update_velocity(x_velocity,y_velocity)
+        self.check_step_loss()
 
     def return_state(self):
         x,y,theta,x_velocity,y_velocity,theta_velocity = self.dev.return_state()
+        self.check_step_loss()
         return x,y,theta,x_velocity,y_velocity,theta_velocity
 
+    def check_step_loss(self):
+        # Flags only ever clear on homing or setting up the encoders again
+        step_loss = self.dev.get_input_status()[2]
+        lost = step_loss & ~self.step_loss
+        self.step_loss = step_loss
+        if lost:
+            axes = [name for axis, name in enumerate(('x','y','theta')) if lost & (1<<axis)]
+            rospy.logwarn("Stage lost steps on %s, home it again" % ' '.join(axes))
+
+    def read_telemetry(self):
+        return self.dev.read_telemetry()
+
     def close(self):
+        if self.telemetry_rate > 0:
+            self.dev.set_telemetry_rate(0)
         self.dev.close()
         print "XYFly stage device closed."
 
@@ -32,7 +77,10 @@ class StageTalker(threading.Thread):
 
     def talker(self):
         x,y,theta,x_velocity,y_velocity,theta_velocity = stage_usb.return_state()
-        self.state_values.header.stamp = rospy.Time.now()
+        self.publish(rospy.Time.now(),x,y,theta,x_velocity,y_velocity,theta_velocity)
+
+    def publish(self,stamp,x,y,theta,x_velocity,y_velocity,theta_velocity):
+        self.state_values.header.stamp = stamp
         self.state_values.x = x
         self.state_values.y = y
         self.state_values.theta = theta
@@ -43,6 +91,13 @@ class StageTalker(threading.Thread):
 
     def run(self):
         while not rospy.is_shutdown():
+            if stage_usb.telemetry_rate > 0:
+                # Telemetry has an endpoint of its own, so no need to wait
+                # on the lock for commands
+                sample = stage_usb.read_telemetry()
+                if sample is not None:
+                    self.publish(rospy.Time.from_sec(sample[0]),*sample[2:])
+                continue
             stage_usb.lock.acquire()
             self.talker()
             stage_usb.lock.release()
@@ -53,6 +108,16 @@ class StageListener(threading.Thread):
         threading.Thread.__init__(self)
         self.vel_sub = rospy.Subscriber("stage/command_velocity", Velocity, self.velocity_callback)
         self.min_velocity = 1
+        # Velocity commands/s sent to the device, the latest one received
+        # each time; 0 sends every one as it comes
+        self.command_rate = rospy.get_param('~command_rate', 50)
+        # Seconds between coalescing reports, 0 for none
+        self.report_period = rospy.get_param('~latency_report_period', 10.0)
+        self.pending_lock = threading.Lock()
+        self.pending = None
+        self.received = 0
+        self.sent = 0
+        self.delays = []
 
     def velocity_callback(self,data):
         x_velocity = data.x_velocity
@@ -61,13 +126,54 @@ class StageListener(threading.Thread):
             x_velocity = 0
         if abs(y_velocity) < self.min_velocity:
             y_velocity = 0
+        # A newer velocity replaces one still waiting to be sent
+        self.pending_lock.acquire()
+        self.pending = (x_velocity,y_velocity,time.time())
+        self.received += 1
+        self.pending_lock.release()
+        if self.command_rate <= 0:
+            self.flush()
+
+    def flush(self):
+        self.pending_lock.acquire()
+        pending = self.pending
+        self.pending = None
+        self.pending_lock.release()
+        if pending is None:
+            return
+        x_velocity,y_velocity,received = pending
         stage_usb.lock.acquire()
+        # Queueing delay from when the command came in until it goes out
+        delay = time.time() - received
         stage_usb.update_velocity(x_velocity,y_velocity)
         stage_usb.lock.release()
+        self.pending_lock.acquire()
+        self.sent += 1
+        self.delays.append(delay)
+        self.pending_lock.release()
+
+    def report(self):
+        self.pending_lock.acquire()
+        received,sent,delays = self.received,self.sent,sorted(self.delays)
+        self.received = 0
+        self.sent = 0
+        self.delays = []
+        self.pending_lock.release()
+        if sent > 0:
+            rospy.loginfo("Stage velocity commands: %d received, %d sent (%.1f:1), queueing delay p50 %.2f ms, p99 %.2f ms, max %.2f ms" %
+                          (received,sent,float(received)/sent,delays[len(delays)//2]*1000,
+                           delays[min(int(len(delays)*0.99),len(delays)-1)]*1000,delays[-1]*1000))
 
     def run(self):
+        rate = rospy.Rate(self.command_rate if self.command_rate > 0 else 100)
+        next_report = time.time() + self.report_period
         while not rospy.is_shutdown():
-            rospy.sleep(0.01)
+            if self.command_rate > 0:
+                self.flush()
+            if (self.report_period > 0) and (time.time() >= next_report):
+                self.report()
+                next_report += self.report_period
+            rate.sleep()
 
 if __name__ == '__main__':
     rospy.init_node('StageCommunicator', anonymous=True)
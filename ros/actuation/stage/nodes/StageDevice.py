@@ -9,41 +9,192 @@
 # users. This required adding and rules file to udev/rules.d and adding a
 # group.
 #
+# Set STAGE_DEVICE_SIM=1 in the environment to run against the firmware
+# simulator in USBDeviceSim instead of a physical board.
+#
 #    who when        what
 #    --- ----        ----
 #    pjp 08/19/09    version 1.0
 # ---------------------------------------------------------------------------
 from __future__ import division
-import USBDevice
+import os
+if os.environ.get('STAGE_DEVICE_SIM', '0') not in ('', '0'):
+    import USBDeviceSim as USBDevice
+else:
+    import USBDevice
 import ctypes
 import time
 
 # XYFly stage device parameters
 _motor_num = 3
+_segment_buffer_size = 64
+_segment_packet_num = 2
+_segment16_packet_num = 4
+_segment_tick_freq = 1000
+_protocol_version_max = 4
+_protocol_magic = 0xFFFF
 
-# Input/Output Structures
+# Input/Output Structures, protocol version 2 with 32 bit frequencies and
+# positions; the *16_t ones further down are version 1
 class MotorState_t(ctypes.LittleEndianStructure):
     _pack_ = 1
-    _fields_ =[('Frequency', ctypes.c_uint16),
-               ('Position', ctypes.c_uint16)]
+    _fields_ =[('Frequency', ctypes.c_uint32),
+               ('Position', ctypes.c_int32)]
 
 class USBPacketOut_t(ctypes.LittleEndianStructure):
     _pack_ = 1
     _fields_ =[('MotorUpdate', ctypes.c_uint8),
                ('SetPoint', MotorState_t * _motor_num)]
 
+class USBPacketMove_t(ctypes.LittleEndianStructure):
+    _pack_ = 1
+    _fields_ =[('MotorUpdate', ctypes.c_uint8),
+               ('SetPoint', MotorState_t * _motor_num),
+               ('MoveID', ctypes.c_uint8)]
+
+class Segment_t(ctypes.LittleEndianStructure):
+    _pack_ = 1
+    _fields_ =[('MotorUpdate', ctypes.c_uint8),
+               ('Duration', ctypes.c_uint16),
+               ('SetPoint', MotorState_t * _motor_num)]
+
+class USBPacketAcceleration_t(ctypes.LittleEndianStructure):
+    _pack_ = 1
+    _fields_ =[('MotorUpdate', ctypes.c_uint8),
+               ('Acceleration', ctypes.c_uint16 * _motor_num)]
+
+class USBPacketTelemetry_t(ctypes.LittleEndianStructure):
+    _pack_ = 1
+    _fields_ =[('MotorUpdate', ctypes.c_uint8),
+               ('TelemetryPeriod', ctypes.c_uint16)]
+
+class USBPacketSegments_t(ctypes.LittleEndianStructure):
+    _pack_ = 1
+    _fields_ =[('SegmentCount', ctypes.c_uint8),
+               ('Segment', Segment_t * _segment_packet_num)]
+
 class USBPacketIn_t(ctypes.LittleEndianStructure):
     _pack_ = 1
-    _fields_ =[('MotorState', MotorState_t * _motor_num)]
+    _fields_ =[('MotorState', MotorState_t * _motor_num),
+               ('SegmentsFree', ctypes.c_uint8),
+               ('SegmentsAccepted', ctypes.c_uint8),
+               ('MoveID', ctypes.c_uint8),
+               ('MoveStatus', ctypes.c_uint8)]
+
+class EncoderConfig_t(ctypes.LittleEndianStructure):
+    _pack_ = 1
+    _fields_ =[('Steps', ctypes.c_int16),
+               ('Counts', ctypes.c_uint16),
+               ('Tolerance', ctypes.c_uint16)]
+
+class USBPacketEncoder_t(ctypes.LittleEndianStructure):
+    _pack_ = 1
+    _fields_ =[('MotorUpdate', ctypes.c_uint8),
+               ('Encoder', EncoderConfig_t * _motor_num)]
+
+# Version 4 replies go on to the limit switch, homing and encoder state
+class USBPacketInInputs_t(ctypes.LittleEndianStructure):
+    _pack_ = 1
+    _fields_ =[('MotorState', MotorState_t * _motor_num),
+               ('SegmentsFree', ctypes.c_uint8),
+               ('SegmentsAccepted', ctypes.c_uint8),
+               ('MoveID', ctypes.c_uint8),
+               ('MoveStatus', ctypes.c_uint8),
+               ('LimitStatus', ctypes.c_uint8),
+               ('Homed', ctypes.c_uint8),
+               ('StepLoss', ctypes.c_uint8),
+               ('EncoderCount', ctypes.c_int32 * _motor_num)]
+
+class TelemetryPacket_t(ctypes.LittleEndianStructure):
+    _pack_ = 1
+    _fields_ =[('Sequence', ctypes.c_uint16),
+               ('Tick', ctypes.c_uint32),
+               ('MotorState', MotorState_t * _motor_num)]
+
+class USBPacketVersion_t(ctypes.LittleEndianStructure):
+    _pack_ = 1
+    _fields_ =[('MotorUpdate', ctypes.c_uint8),
+               ('ProtocolVersion', ctypes.c_uint8)]
+
+class USBPacketVersionIn_t(ctypes.LittleEndianStructure):
+    _pack_ = 1
+    _fields_ =[('Magic', ctypes.c_uint16),
+               ('ProtocolVersion', ctypes.c_uint8),
+               ('ProtocolVersionMax', ctypes.c_uint8)]
+
+class MotorState16_t(ctypes.LittleEndianStructure):
+    _pack_ = 1
+    _fields_ =[('Frequency', ctypes.c_uint16),
+               ('Position', ctypes.c_uint16)]
+
+class USBPacketOut16_t(ctypes.LittleEndianStructure):
+    _pack_ = 1
+    _fields_ =[('MotorUpdate', ctypes.c_uint8),
+               ('SetPoint', MotorState16_t * _motor_num)]
+
+class USBPacketMove16_t(ctypes.LittleEndianStructure):
+    _pack_ = 1
+    _fields_ =[('MotorUpdate', ctypes.c_uint8),
+               ('SetPoint', MotorState16_t * _motor_num),
+               ('MoveID', ctypes.c_uint8)]
+
+class Segment16_t(ctypes.LittleEndianStructure):
+    _pack_ = 1
+    _fields_ =[('MotorUpdate', ctypes.c_uint8),
+               ('Duration', ctypes.c_uint16),
+               ('SetPoint', MotorState16_t * _motor_num)]
+
+class USBPacketSegments16_t(ctypes.LittleEndianStructure):
+    _pack_ = 1
+    _fields_ =[('SegmentCount', ctypes.c_uint8),
+               ('Segment', Segment16_t * _segment16_packet_num)]
+
+class USBPacketIn16_t(ctypes.LittleEndianStructure):
+    _pack_ = 1
+    _fields_ =[('MotorState', MotorState16_t * _motor_num),
+               ('SegmentsFree', ctypes.c_uint8),
+               ('SegmentsAccepted', ctypes.c_uint8),
+               ('MoveID', ctypes.c_uint8),
+               ('MoveStatus', ctypes.c_uint8)]
+
+class TelemetryPacket16_t(ctypes.LittleEndianStructure):
+    _pack_ = 1
+    _fields_ =[('Sequence', ctypes.c_uint16),
+               ('Tick', ctypes.c_uint32),
+               ('MotorState', MotorState16_t * _motor_num)]
+
+# Packet structures by protocol version
+_packet_types = {
+    1: {'USBPacketOut_t': USBPacketOut16_t,
+        'USBPacketMove_t': USBPacketMove16_t,
+        'Segment_t': Segment16_t,
+        'USBPacketSegments_t': USBPacketSegments16_t,
+        'USBPacketIn_t': USBPacketIn16_t,
+        'TelemetryPacket_t': TelemetryPacket16_t,
+        'segment_packet_num': _segment16_packet_num},
+    2: {'USBPacketOut_t': USBPacketOut_t,
+        'USBPacketMove_t': USBPacketMove_t,
+        'Segment_t': Segment_t,
+        'USBPacketSegments_t': USBPacketSegments_t,
+        'USBPacketIn_t': USBPacketIn_t,
+        'TelemetryPacket_t': TelemetryPacket_t,
+        'segment_packet_num': _segment_packet_num},
+    }
+# Version 3 only adds USB_CMD_MOVE_LINE, and version 4 USB_CMD_HOME,
+# USB_CMD_SET_ENCODER and the longer replies
+_packet_types[3] = _packet_types[2]
+_packet_types[4] = dict(_packet_types[2])
+_packet_types[4]['USBPacketIn_t'] = USBPacketInInputs_t
 
 class StageDevice(USBDevice.USB_Device):
-    def __init__(self, serial_number=None):
+    def __init__(self, serial_number=None, microsteps=1):
 
         # USB device parameters
         self.vendor_id = 0x0004
         self.product_id = 0x0002
         self.bulkout_ep_address = 0x01
         self.bulkin_ep_address = 0x82
+        self.telemetry_ep_address = 0x83
         self.buffer_out_size = 64
         self.buffer_in_size = 64
         self.serial_number = serial_number
@@ -60,9 +211,35 @@ class StageDevice(USBDevice.USB_Device):
         # USB Command IDs
         self.USB_CMD_GET_STATE = ctypes.c_uint8(1)
         self.USB_CMD_SET_STATE = ctypes.c_uint8(2)
+        self.USB_CMD_STREAM_SEGMENTS = ctypes.c_uint8(3)
+        self.USB_CMD_STREAM_CLEAR = ctypes.c_uint8(4)
+        self.USB_CMD_SET_ACCELERATION = ctypes.c_uint8(5)
+        self.USB_CMD_MOVE = ctypes.c_uint8(6)
+        self.USB_CMD_SET_TELEMETRY = ctypes.c_uint8(7)
+        self.USB_CMD_PROTOCOL_VERSION = ctypes.c_uint8(8)
+        self.USB_CMD_MOVE_LINE = ctypes.c_uint8(9)
+        self.USB_CMD_HOME = ctypes.c_uint8(10)
+        self.USB_CMD_SET_ENCODER = ctypes.c_uint8(11)
+        self.USB_CMD_MOVE_DONE = ctypes.c_uint8(100)
+
+        # Move status, as reported by the device
+        self.MOVE_STATUS_IDLE = 0
+        self.MOVE_STATUS_MOVING = 1
+        self.MOVE_STATUS_DONE = 2
+        self.MOVE_STATUS_ABORTED = 3
+        self.move_id = 0
+
+        # Board tick to host clock offset, see read_telemetry
+        self.telemetry_offset = None
+        self.telemetry_tick = 0
+        self.telemetry_drift = 1e-4
 
-        self.USBPacketOut = USBPacketOut_t()
-        self.USBPacketIn = USBPacketIn_t()
+        # Settle on a protocol version, then use its packet structures
+        self.protocol_version = self._negotiate_protocol()
+        self.packet_types = _packet_types[self.protocol_version]
+
+        self.USBPacketOut = self.packet_types['USBPacketOut_t']()
+        self.USBPacketIn = self.packet_types['USBPacketIn_t']()
         # self.Motor = []
         # for MotorN in range(_motor_num):
         #     self.Motor.append({'Frequency'        : 0,
@@ -75,11 +252,15 @@ class StageDevice(USBDevice.USB_Device):
 
         # Parameters
         self.frequency_max = 30000
+        self.frequency_max_ramped = 50000   # MOTOR_*_FREQUENCY_MAX
         self.position_min = 0
-        self.position_max = 44000
+        self.position_max = 44000*microsteps
+        if self.protocol_version < 2:
+            # 16 bit positions
+            self.position_max = min(self.position_max, 0xffff)
 
-        self.steps_per_mm = 5000/25.4   # 5000 steps per inch
-                                        # 25.4 mm per inch
+        self.steps_per_mm = 5000*microsteps/25.4    # 5000 full steps per inch
+                                                    # 25.4 mm per inch
         self.steps_per_radian = 200     # Change to actual number!
         self.axis_x = 0
         self.axis_y = 1
@@ -125,6 +306,274 @@ class StageDevice(USBDevice.USB_Device):
         x,y,theta,x_velocity,y_velocity,theta_velocity = self.return_state()
         return x,y,theta,x_velocity,y_velocity,theta_velocity
 
+    def stream_velocity(self, segments):
+        """
+        Queues velocity segments in the device's trajectory buffer.  The
+        device runs them back to back off its own clock and stops when it
+        runs out, so a trajectory streamed ahead is unaffected by USB and
+        host latency.
+
+        Arguments:
+            segments = list of (duration, x_velocity, y_velocity), duration
+                       in seconds (0 holds until the next segment) and
+                       velocities in mm/s
+
+        Return: number of segments queued, which is less than
+        len(segments) once the buffer is full, then the state as from
+        get_state().
+        """
+        segment_list = []
+        for duration, x_velocity, y_velocity in segments:
+            segment = self.packet_types['Segment_t']()
+            segment.MotorUpdate = (1<<self.axis_x) | (1<<self.axis_y)
+            segment.Duration = int(min(max(round(duration*_segment_tick_freq), 0), 0xffff))
+            if (duration > 0) and (segment.Duration == 0):
+                segment.Duration = 1
+            for axis, velocity in ((self.axis_x, x_velocity), (self.axis_y, y_velocity)):
+                freq, pos = self._velocity_to_setpoint(velocity)
+                segment.SetPoint[axis].Frequency = int(freq)
+                segment.SetPoint[axis].Position = int(pos)
+            segment_list.append(segment)
+
+        segment_packet_num = self.packet_types['segment_packet_num']
+        n = 0
+        while n < len(segment_list):
+            packet_list = segment_list[n:n+segment_packet_num]
+            accepted = self._stream_segments(packet_list)
+            n += accepted
+            if accepted < len(packet_list):
+                break
+        x,y,theta,x_velocity,y_velocity,theta_velocity = self.return_state()
+        return n,x,y,theta,x_velocity,y_velocity,theta_velocity
+
+    def clear_stream(self):
+        """
+        Drops the segments queued by stream_velocity and stops the motors
+        they were moving.
+        """
+        outdata = [self.USB_CMD_STREAM_CLEAR]
+        intypes = [ctypes.c_uint8, self.packet_types['USBPacketIn_t']]
+        val_list = self.usb_cmd(outdata,intypes)
+        cmd_id = val_list[0]
+        self._check_cmd_id(self.USB_CMD_STREAM_CLEAR,cmd_id)
+        self.USBPacketIn = val_list[1]
+        x,y,theta,x_velocity,y_velocity,theta_velocity = self.return_state()
+        return x,y,theta,x_velocity,y_velocity,theta_velocity
+
+    def get_segments_free(self):
+        """
+        Room left in the trajectory buffer as of the last command.
+        """
+        return self.USBPacketIn.SegmentsFree
+
+    def set_acceleration(self, x_acceleration, y_acceleration):
+        """
+        Sets the firmware acceleration ramps of the x and y motors, in
+        mm/s^2; 0 turns a ramp off so the motor jumps straight to each
+        commanded velocity.  Ramped motors do not stall on large velocity
+        steps, so with both ramps on the velocity limit is raised from
+        frequency_max to the firmware's maximum step frequency.
+        """
+        packet = USBPacketAcceleration_t()
+        packet.MotorUpdate = (1<<self.axis_x) | (1<<self.axis_y)
+        for axis, acceleration in ((self.axis_x, x_acceleration), (self.axis_y, y_acceleration)):
+            packet.Acceleration[axis] = self._acceleration_to_ticks(acceleration)
+        outdata = [self.USB_CMD_SET_ACCELERATION, packet]
+        intypes = [ctypes.c_uint8, self.packet_types['USBPacketIn_t']]
+        val_list = self.usb_cmd(outdata,intypes)
+        cmd_id = val_list[0]
+        self._check_cmd_id(self.USB_CMD_SET_ACCELERATION,cmd_id)
+        self.USBPacketIn = val_list[1]
+
+        if packet.Acceleration[self.axis_x] and packet.Acceleration[self.axis_y]:
+            self.frequency_max = self.frequency_max_ramped
+        else:
+            self.frequency_max = 30000
+
+    def move_to(self, x, y, velocity, wait=False):
+        """
+        Moves to the position (x, y) in mm at velocity mm/s.  The device
+        runs the move to the exact step, following the acceleration ramps
+        if they are set, and tracks it until the motors stop.
+
+        Keywords:
+            wait = block until the device reports the move finished
+
+        Return: the move status (MOVE_STATUS_DONE, or MOVE_STATUS_MOVING if
+        not waiting) then the state as from get_state().
+        """
+        freq = int(min(abs(self._mm_to_steps(velocity)), self.frequency_max))
+        return self._move(self.USB_CMD_MOVE, x, y, freq, freq, wait)
+
+    def move_line(self, x, y, velocity, wait=False):
+        """
+        Moves to the position (x, y) in mm in a straight line at velocity
+        mm/s along it, with both axes getting there together.  Devices
+        from before protocol version 3 run it as a move_to() with the
+        velocity shared out between the axes, which only keeps to the
+        line without acceleration ramps.
+
+        Keywords and return value as for move_to().
+        """
+        freq = int(min(abs(self._mm_to_steps(velocity)), self.frequency_max))
+        if self.protocol_version >= 3:
+            return self._move(self.USB_CMD_MOVE_LINE, x, y, freq, freq, wait)
+        dx = abs(self._mm_to_steps(x) - self.USBPacketIn.MotorState[self.axis_x].Position)
+        dy = abs(self._mm_to_steps(y) - self.USBPacketIn.MotorState[self.axis_y].Position)
+        length = (dx*dx + dy*dy)**0.5
+        x_freq = y_freq = freq
+        if length > 0:
+            x_freq = max(int(freq*dx/length), 1)
+            y_freq = max(int(freq*dy/length), 1)
+        return self._move(self.USB_CMD_MOVE, x, y, x_freq, y_freq, wait)
+
+    def home(self, velocity, wait=False):
+        """
+        Homes x and y: each seeks its limit switch at velocity mm/s, backs
+        off slowly until the switch lets go, and takes its home position
+        there.  Needs protocol version 4.  An axis that finds no switch
+        aborts the move.
+
+        Keywords and return value as for move_to().
+        """
+        if self.protocol_version < 4:
+            raise IOError, 'device firmware has no homing support'
+        freq = int(min(max(abs(self._mm_to_steps(velocity)), 1), self.frequency_max))
+        packet = self.packet_types['USBPacketMove_t']()
+        packet.MotorUpdate = (1<<self.axis_x) | (1<<self.axis_y)
+        packet.SetPoint[self.axis_x].Frequency = freq
+        packet.SetPoint[self.axis_y].Frequency = freq
+        return self._send_move(self.USB_CMD_HOME, packet, wait)
+
+    def set_encoders(self, counts_per_mm, tolerance=0):
+        """
+        Turns on the x and y encoders at counts_per_mm counts per mm of
+        travel, or off with 0, and zeroes their counts.  The device flags
+        step loss on an axis once its steps and encoder disagree by more
+        than tolerance mm (0 for the firmware's default), or once a homed
+        axis meets its limit switch that far from home.  Needs protocol
+        version 4.
+        """
+        if self.protocol_version < 4:
+            raise IOError, 'device firmware has no encoder support'
+        packet = USBPacketEncoder_t()
+        packet.MotorUpdate = (1<<self.axis_x) | (1<<self.axis_y) | (1<<self.axis_theta)
+        for axis in range(_motor_num):
+            packet.Encoder[axis].Tolerance = int(min(round(self._mm_to_steps(tolerance)), 0xffff))
+        if counts_per_mm > 0:
+            # Steps per count as the closest ratio that fits the packet
+            ratio = self.steps_per_mm/counts_per_mm
+            counts = int(max(min(32767/ratio, 0xffff), 1))
+            for axis in (self.axis_x, self.axis_y):
+                packet.Encoder[axis].Counts = counts
+                packet.Encoder[axis].Steps = int(min(round(ratio*counts), 32767))
+        outdata = [self.USB_CMD_SET_ENCODER, packet]
+        intypes = [ctypes.c_uint8, self.packet_types['USBPacketIn_t']]
+        val_list = self.usb_cmd(outdata,intypes)
+        cmd_id = val_list[0]
+        self._check_cmd_id(self.USB_CMD_SET_ENCODER,cmd_id)
+        self.USBPacketIn = val_list[1]
+
+    def get_input_status(self):
+        """
+        Limit switch and homing state as of the last command, as bit
+        masks by axis: (limits pressed, homed, step loss).  All 0 before
+        protocol version 4.
+        """
+        if self.protocol_version < 4:
+            return 0, 0, 0
+        return self.USBPacketIn.LimitStatus, self.USBPacketIn.Homed, self.USBPacketIn.StepLoss
+
+    def _move(self, command_id, x, y, x_freq, y_freq, wait):
+        packet = self.packet_types['USBPacketMove_t']()
+        packet.MotorUpdate = (1<<self.axis_x) | (1<<self.axis_y)
+        for axis, position, freq in ((self.axis_x, x, x_freq), (self.axis_y, y, y_freq)):
+            pos = int(round(self._mm_to_steps(position)))
+            packet.SetPoint[axis].Frequency = freq
+            packet.SetPoint[axis].Position = min(max(pos, self.position_min), self.position_max)
+        return self._send_move(command_id, packet, wait)
+
+    def _send_move(self, command_id, packet, wait):
+        # Only ask for a notification when reading it, otherwise it would
+        # be taken for the reply to the next command
+        if wait:
+            self.move_id = (self.move_id % 255) + 1
+            packet.MoveID = self.move_id
+        outdata = [command_id, packet]
+        intypes = [ctypes.c_uint8, self.packet_types['USBPacketIn_t']]
+        val_list = self.usb_cmd(outdata,intypes)
+        cmd_id = val_list[0]
+        self._check_cmd_id(command_id,cmd_id)
+        self.USBPacketIn = val_list[1]
+
+        while wait:
+            val_list = self.usb_read(intypes)
+            if val_list is None:
+                continue
+            cmd_id = val_list[0]
+            self._check_cmd_id(self.USB_CMD_MOVE_DONE,cmd_id)
+            self.USBPacketIn = val_list[1]
+            wait = (self.USBPacketIn.MoveID != packet.MoveID)
+        x,y,theta,x_velocity,y_velocity,theta_velocity = self.return_state()
+        return self.USBPacketIn.MoveStatus,x,y,theta,x_velocity,y_velocity,theta_velocity
+
+    def get_move_status(self):
+        """
+        Status of the last move as of the last command, one of the
+        MOVE_STATUS_* values.
+        """
+        return self.USBPacketIn.MoveStatus
+
+    def set_telemetry_rate(self, rate):
+        """
+        Has the device sample its state rate times a second, up to 1000,
+        and send the samples on its telemetry endpoint for read_telemetry.
+        A rate of 0 stops them.
+        """
+        packet = USBPacketTelemetry_t()
+        if rate > 0:
+            period = int(round(_segment_tick_freq/rate))
+            packet.TelemetryPeriod = min(max(period, 1), 0xffff)
+        outdata = [self.USB_CMD_SET_TELEMETRY, packet]
+        intypes = [ctypes.c_uint8, self.packet_types['USBPacketIn_t']]
+        val_list = self.usb_cmd(outdata,intypes)
+        cmd_id = val_list[0]
+        self._check_cmd_id(self.USB_CMD_SET_TELEMETRY,cmd_id)
+        self.USBPacketIn = val_list[1]
+
+    def read_telemetry(self, timeout=200):
+        """
+        Waits up to timeout ms for the next telemetry sample.  This only
+        uses the telemetry endpoint, so it can run in a thread of its own
+        while commands go out in another.
+
+        Return: None on timeout, otherwise the time the sample was taken on
+        the time.time() clock, its sequence number (gaps are samples that
+        were missed), then the state as from get_state().
+        """
+        val_list = self.usb_interrupt_read(self.telemetry_ep_address,[self.packet_types['TelemetryPacket_t']],timeout)
+        if val_list is None:
+            return None
+        packet = val_list[0]
+
+        # Transfer delays only ever add to the offset, so keep the smallest
+        # one seen, letting it creep up only as fast as the clocks drift
+        board_time = packet.Tick/_segment_tick_freq
+        offset = time.time() - board_time
+        if (self.telemetry_offset is None) or (packet.Tick < self.telemetry_tick):
+            self.telemetry_offset = offset
+        else:
+            elapsed = (packet.Tick - self.telemetry_tick)/_segment_tick_freq
+            self.telemetry_offset = min(offset, self.telemetry_offset + elapsed*self.telemetry_drift)
+        self.telemetry_tick = packet.Tick
+
+        state = []
+        for axis in (self.axis_x, self.axis_y, self.axis_theta):
+            state.append(self._steps_to_mm(packet.MotorState[axis].Position))
+        for axis in (self.axis_x, self.axis_y, self.axis_theta):
+            state.append(self._steps_to_mm(packet.MotorState[axis].Frequency))
+        return tuple([self.telemetry_offset + board_time, packet.Sequence] + state)
+
     def get_state(self):
         self._get_motor_state()
         x,y,theta,x_velocity,y_velocity,theta_velocity = self.return_state()
@@ -139,6 +588,30 @@ class StageDevice(USBDevice.USB_Device):
         theta =  self._steps_to_mm(self.USBPacketIn.MotorState[self.axis_theta].Position)
         return x,y,theta,x_velocity,y_velocity,theta_velocity
 
+    def _velocity_to_setpoint(self,velocity):
+        """
+        Velocity control by running toward the far end of the axis at the
+        requested step frequency, as in update_velocity.
+        """
+        vel_steps = self._mm_to_steps(velocity)
+        if vel_steps < 0:
+            pos_steps = self.position_min
+            vel_steps = abs(vel_steps)
+        else:
+            pos_steps = self.position_max
+        if vel_steps > self.frequency_max:
+            vel_steps = self.frequency_max
+        return vel_steps, pos_steps
+
+    def _acceleration_to_ticks(self,acceleration):
+        """
+        mm/s^2 to the firmware's units, step frequency change per 1 ms tick.
+        """
+        if acceleration <= 0:
+            return 0
+        ticks = int(round(self._mm_to_steps(acceleration)/_segment_tick_freq))
+        return min(max(ticks, 1), 0xffff)
+
     def _mm_to_steps(self,quantity_mm):
         return quantity_mm*self.steps_per_mm
 
@@ -153,7 +626,7 @@ class StageDevice(USBDevice.USB_Device):
 
     def _get_motor_state(self):
         outdata = [self.USB_CMD_GET_STATE]
-        intypes = [ctypes.c_uint8, USBPacketIn_t]
+        intypes = [ctypes.c_uint8, self.packet_types['USBPacketIn_t']]
         val_list = self.usb_cmd(outdata,intypes)
         cmd_id = val_list[0]
         self._check_cmd_id(self.USB_CMD_GET_STATE,cmd_id)
@@ -162,12 +635,25 @@ class StageDevice(USBDevice.USB_Device):
     def _set_motor_state(self):
         self.USBPacketOut.MotorUpdate = ctypes.c_uint8(7)
         outdata = [self.USB_CMD_SET_STATE, self.USBPacketOut]
-        intypes = [ctypes.c_uint8, USBPacketIn_t]
+        intypes = [ctypes.c_uint8, self.packet_types['USBPacketIn_t']]
         val_list = self.usb_cmd(outdata,intypes)
         cmd_id = val_list[0]
         self._check_cmd_id(self.USB_CMD_SET_STATE,cmd_id)
         self.USBPacketIn = val_list[1]
 
+    def _stream_segments(self,segment_list):
+        packet = self.packet_types['USBPacketSegments_t']()
+        packet.SegmentCount = len(segment_list)
+        for i, segment in enumerate(segment_list):
+            packet.Segment[i] = segment
+        outdata = [self.USB_CMD_STREAM_SEGMENTS, packet]
+        intypes = [ctypes.c_uint8, self.packet_types['USBPacketIn_t']]
+        val_list = self.usb_cmd(outdata,intypes)
+        cmd_id = val_list[0]
+        self._check_cmd_id(self.USB_CMD_STREAM_SEGMENTS,cmd_id)
+        self.USBPacketIn = val_list[1]
+        return self.USBPacketIn.SegmentsAccepted
+
     def _print_motor_state(self):
         print '*'*20
         print 'Frequency X = ', self.USBPacketIn.MotorState[self.axis_x].Frequency
@@ -178,6 +664,24 @@ class StageDevice(USBDevice.USB_Device):
         print 'Position Theta = ', self.USBPacketIn.MotorState[self.axis_theta].Position
         print '*'*20
 
+    def _negotiate_protocol(self):
+        """
+        Asks the device for the newest protocol version both ends know.
+        Firmware from before versions answers with a plain state reply,
+        which never carries the magic, and stays on version 1.
+        """
+        packet = USBPacketVersion_t()
+        packet.ProtocolVersion = _protocol_version_max
+        outdata = [self.USB_CMD_PROTOCOL_VERSION, packet]
+        intypes = [ctypes.c_uint8, USBPacketVersionIn_t]
+        val_list = self.usb_cmd(outdata,intypes)
+        cmd_id = val_list[0]
+        self._check_cmd_id(self.USB_CMD_PROTOCOL_VERSION,cmd_id)
+        reply = val_list[1]
+        if reply.Magic != _protocol_magic:
+            return 1
+        return min(max(reply.ProtocolVersion, 1), _protocol_version_max)
+
     def _check_cmd_id(self,expected_id,received_id):
         """
         Compares expected and received command ids.
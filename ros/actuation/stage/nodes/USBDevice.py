@@ -268,6 +268,52 @@ class USB_Device:
         val_list = self.__read_from_buffer(intypes)
         return val_list
 
+    def usb_read(self,intypes,timeout=200):
+        """
+        Reads a packet the device sends without being asked, waiting up to
+        timeout ms for it.
+
+        Return: list of values as from usb_cmd, or None on timeout.
+        """
+        try:
+            numbytes = usb.bulk_read(
+                    self.libusb_handle,
+                    self.bulkin_ep_address,
+                    self.input_buffer,
+                    timeout
+                    )
+            debug_print('usb R bytes read: %d'%(numbytes,), comma=False)
+        except usb.USBNoDataAvailableError:
+            return None
+        val_list = self.__read_from_buffer(intypes)
+        return val_list
+
+    def usb_interrupt_read(self,endpoint,intypes,timeout=200):
+        """
+        Reads a packet from an interrupt IN endpoint, into a buffer of its
+        own so it can run alongside usb_cmd in another thread.
+
+        Return: list of values of the given types, or None on timeout.
+        """
+        N = 0
+        for ctypes_type in intypes:
+            N += ctypes.sizeof(ctypes_type)
+        buf = ctypes.create_string_buffer(N)
+        try:
+            numbytes = usb.interrupt_read(self.libusb_handle,endpoint,buf,timeout)
+            debug_print('usb IR bytes read: %d'%(numbytes,), comma=False)
+        except usb.USBNoDataAvailableError:
+            return None
+        pos = 0
+        val_list = []
+        for ctypes_type in intypes:
+            val = ctypes_type()
+            sz = ctypes.sizeof(val)
+            ctypes.memmove(ctypes.byref(val),ctypes.byref(buf,pos),sz)
+            pos += sz
+            val_list.append(val)
+        return val_list
+
     def get_serial_number(self):
         """
         Get serial number of device.
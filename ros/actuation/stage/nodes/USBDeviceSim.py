@@ -0,0 +1,877 @@
+"""
+-----------------------------------------------------------------------
+USBDeviceSim
+
+Software stand-in for USBDevice.USB_Device that emulates the
+StageUSBDevice firmware instead of talking to an at90usb board.
+
+Purpose: Lets StageDevice and the nodes built on it run without
+hardware, e.g. to load-test command rates and control loops.  Select it
+by setting STAGE_DEVICE_SIM=1 in the environment before StageDevice is
+imported.
+
+The simulator packs commands into the same 64 byte buffer as the real
+device and decodes them as USBPacketOutWrapper_t, or its 16 bit version
+1 form until USB_CMD_PROTOCOL_VERSION moves it on.  SET_STATE goes
+through the firmware's Motor_Update logic, so the returned Frequency is
+quantized to what the timers can actually produce, and positions step
+toward their setpoints at that frequency in real time, following the
+firmware's acceleration ramps once they are set.  Segments
+streamed with USB_CMD_STREAM_SEGMENTS are buffered and run back to back
+on the simulated clock, as the firmware's tick interrupt does.  Moves
+sent with USB_CMD_MOVE are tracked until their motors stop and, given a
+nonzero MoveID, reported with a USB_CMD_MOVE_DONE packet that usb_read
+picks up.  USB_CMD_MOVE_LINE moves run the lead motor as a move and
+step the others from it by the firmware's Bresenham rule.  Each motor
+has a limit switch just below where the board starts, which USB_CMD_HOME
+seeks and backs off as the firmware does and which stops any other
+move running into it; USB_CMD_SET_ENCODER turns on ideal encoders on x
+and y that count exactly with the steps.  Replies are encoded as
+USBPacketInWrapper_t.  State telemetry
+is sampled on the simulated tick as USB_CMD_SET_TELEMETRY asks and read
+with usb_interrupt_read.
+
+Set STAGE_DEVICE_SIM_LATENCY to a round trip time in seconds to make
+each usb_cmd take at least that long.
+
+------------------------------------------------------------------------
+"""
+from __future__ import division
+import collections
+import ctypes
+import math
+import os
+import struct
+import threading
+import time
+
+# USB Command IDs, as in StageUSBDevice.h
+USB_CMD_GET_STATE = 1
+USB_CMD_SET_STATE = 2
+USB_CMD_STREAM_SEGMENTS = 3
+USB_CMD_STREAM_CLEAR = 4
+USB_CMD_SET_ACCELERATION = 5
+USB_CMD_MOVE = 6
+USB_CMD_SET_TELEMETRY = 7
+USB_CMD_PROTOCOL_VERSION = 8
+USB_CMD_MOVE_LINE = 9
+USB_CMD_HOME = 10
+USB_CMD_SET_ENCODER = 11
+USB_CMD_MOVE_DONE = 100
+USB_CMD_AVR_RESET = 200
+USB_CMD_AVR_DFU_MODE = 201
+
+# Firmware constants
+F_CLOCK = 16000000
+MOTOR_NUM = 3
+MOTOR_POSITION_HOME = [1000, 1000, 1234]
+MOTOR_FREQUENCY_MAX = [50000, 50000, 50000]
+MOTOR_TIMER = [1, 3, 2]
+TIMER_SCALE_FACTOR = 4
+TIMER_TOP_MAX = {0: 255, 1: 65535, 2: 255, 3: 65535}
+PRESCALER_ARRAY16 = [1, 8, 64, 256, 1024]
+PRESCALER_ARRAY8 = [1, 8, 32, 64, 128]
+SEGMENT_BUFFER_SIZE = 64
+SEGMENT_PACKET_NUM = 2
+SEGMENT16_PACKET_NUM = 4
+SEGMENT_TICK_FREQ = 1000
+MOVE_STATUS_IDLE = 0
+MOVE_STATUS_MOVING = 1
+MOVE_STATUS_DONE = 2
+MOVE_STATUS_ABORTED = 3
+HOME_TRAVEL_MAX = 2000000
+HOME_BACKOFF_MAX = 20000
+HOME_BACKOFF_DIVIDER = 8
+ENCODER_NUM = 2
+STEP_LOSS_TOLERANCE = 64
+PROTOCOL_VERSION_MAX = 4
+PROTOCOL_MAGIC = 0xFFFF
+
+# Wire formats of the packets that read the same in every protocol version
+PACKET_ACCELERATION_FORMAT = '<BB' + 'H'*MOTOR_NUM
+PACKET_TELEMETRY_FORMAT = '<BBH'
+PACKET_VERSION_FORMAT = '<BBB'
+PACKET_VERSION_IN_FORMAT = '<BHBB'
+PACKET_ENCODER_FORMAT = '<BB' + 'hHH'*MOTOR_NUM
+
+
+def wire_formats(status_format, segment_packet_num):
+    """
+    Wire formats of USBPacketOutWrapper_t, USBPacketInWrapper_t and the
+    other packets carrying motor status, given the format of one
+    MotorStatus_t.
+    """
+    segment_format = 'BH' + status_format*MOTOR_NUM
+    formats = {}
+    formats['out'] = '<BB' + status_format*MOTOR_NUM
+    formats['move'] = formats['out'] + 'B'
+    formats['segments'] = '<BB' + segment_format*segment_packet_num
+    formats['segment_packet_num'] = segment_packet_num
+    formats['in'] = '<B' + status_format*MOTOR_NUM + 'BBBB'
+    formats['telemetry'] = '<HI' + status_format*MOTOR_NUM
+    formats['inputs'] = False
+    return formats
+
+# Version 1 has 16 bit frequencies and positions, version 2 32 bit ones,
+# version 3 only adds USB_CMD_MOVE_LINE, and version 4 appends the limit
+# switch, homing and encoder state to the replies
+WIRE_FORMATS = {1: wire_formats('HH', SEGMENT16_PACKET_NUM),
+                2: wire_formats('Ii', SEGMENT_PACKET_NUM)}
+WIRE_FORMATS[3] = WIRE_FORMATS[2]
+WIRE_FORMATS[4] = dict(WIRE_FORMATS[2])
+WIRE_FORMATS[4]['in'] += 'BBB' + 'i'*MOTOR_NUM
+WIRE_FORMATS[4]['inputs'] = True
+
+
+def quantize_frequency(timer_n, freq):
+    """
+    Returns the step frequency timer_n actually runs at when asked for
+    freq, following Motor_Update: the smallest prescaler whose TOP value
+    fits in the timer, then integer division back to a frequency.
+    """
+    top_max = TIMER_TOP_MAX[timer_n]
+    if timer_n == 2:
+        prescalers = PRESCALER_ARRAY8
+    else:
+        prescalers = PRESCALER_ARRAY16
+
+    prescaler = 1
+    top = F_CLOCK//(TIMER_SCALE_FACTOR*freq)
+    prescaler_n = 0
+    while (top > top_max) and (prescaler_n < len(prescalers) - 1):
+        prescaler_n += 1
+        prescaler = prescalers[prescaler_n]
+        top = F_CLOCK//(freq*TIMER_SCALE_FACTOR*prescaler)
+        if (prescaler_n == len(prescalers) - 1) and (top > top_max):
+            top = top_max
+    top = top & 0xffff
+    return (F_CLOCK//(top*TIMER_SCALE_FACTOR*prescaler)) & 0xffff
+
+
+def line_follower(line, motor_n):
+    return (line is not None) and (motor_n in line[3])
+
+
+class SimMotor:
+    def __init__(self, motor_n):
+        self.timer_n = MOTOR_TIMER[motor_n]
+        self.frequency_max = MOTOR_FREQUENCY_MAX[motor_n]
+        self.position_home = MOTOR_POSITION_HOME[motor_n]
+        self.reset()
+
+    def reset(self):
+        # The switch, pressed at or below limit_position, starts out just
+        # below the travel and moves with the positions when homing resets
+        # them
+        self.limit_position = -1
+        self.frequency = 0
+        self.position = self.position_home
+        self.position_setpoint = self.position_home
+        self.direction = 1
+        self.running = False
+        self.phase = 0.0
+        self.frequency_target = 0
+        self.direction_target = 1
+        self.acceleration = 0
+        self.ramp_frequency = 0
+        self.tick_phase = 0.0
+
+    def halt(self):
+        # Timer_Off, as Line_Start stops the motors where they are
+        self.frequency = 0
+        self.frequency_target = 0
+        self.ramp_frequency = 0
+        self.running = False
+
+    def stop(self):
+        self.frequency_target = 0
+        if not self.acceleration:
+            self.frequency = 0
+            self.running = False
+
+    def set_point(self, frequency, position):
+        if self.acceleration and (frequency == 0):
+            # Ramp down to a stop, still bounded by the old setpoint
+            self.frequency_target = 0
+            return
+        self.frequency_target = min(frequency, self.frequency_max)
+        self.position_setpoint = position
+        if self.position_setpoint > self.position:
+            self.direction_target = 1
+        elif self.position_setpoint < self.position:
+            self.direction_target = -1
+        else:
+            self.frequency_target = 0
+
+        if self.acceleration:
+            # Left to ramp() on the tick
+            return
+        self.direction = self.direction_target
+        self._update(self.frequency_target)
+        # Restarting the timer starts a fresh step period
+        self.phase = 0.0
+
+    def set_acceleration(self, acceleration):
+        if acceleration and not self.acceleration:
+            self.ramp_frequency = self.frequency
+        elif not acceleration and self.acceleration:
+            self.direction = self.direction_target
+            self._update(self.frequency_target)
+        self.acceleration = acceleration
+
+    def _update(self, frequency):
+        # Motor_Update
+        if frequency == 0:
+            self.frequency = 0
+            self.running = False
+        else:
+            self.frequency = quantize_frequency(self.timer_n, frequency)
+            self.running = True
+
+    def ramp(self):
+        """
+        One segment tick of the firmware's Motor_Ramp.
+        """
+        if not self.running:
+            self.ramp_frequency = 0
+        remaining = abs(self.position_setpoint - self.position)
+        accel = self.acceleration
+        freq = self.ramp_frequency
+        direction = self.direction
+        if freq == 0:
+            direction = self.direction_target
+
+        if (remaining == 0) or (self.frequency_target == 0) or (direction != self.direction_target):
+            target = 0
+        else:
+            target = self.frequency_target
+            if (freq > 0) and (target > accel) and (remaining <= freq*freq//(2*SEGMENT_TICK_FREQ*accel)):
+                target = accel
+
+        if freq < target:
+            freq = min(freq + accel, target)
+        elif freq > target:
+            freq = max(freq - accel, target)
+
+        if (freq != self.ramp_frequency) or (direction != self.direction):
+            self.ramp_frequency = freq
+            self.direction = direction
+            self._update(freq)
+
+    def advance(self, dt):
+        if not self.acceleration:
+            self._step(dt)
+            return
+        tick = 1/SEGMENT_TICK_FREQ
+        while dt > 0:
+            h = min(dt, tick - self.tick_phase)
+            self._step(h)
+            dt -= h
+            self.tick_phase += h
+            if self.tick_phase >= tick - 1e-9:
+                self.tick_phase = 0.0
+                self.ramp()
+
+    def _step(self, dt):
+        if not self.running:
+            return
+        self.phase += self.frequency*dt
+        steps = int(self.phase)
+        self.phase -= steps
+        remaining = abs(self.position_setpoint - self.position)
+        if (steps >= remaining) and (self.direction*(self.position_setpoint - self.position) >= 0):
+            self.position = self.position_setpoint
+            self.frequency = 0
+            self.running = False
+        else:
+            self.position = self.position + self.direction*steps
+
+
+class USB_Device:
+
+    """
+    Simulated at90usb stage board with the USBDevice.USB_Device interface.
+    """
+
+    def __init__(self,
+                 usb_vendor_id,
+                 usb_product_id,
+                 usb_bulkout_ep_address,
+                 usb_bulkin_ep_address,
+                 usb_buffer_out_size,
+                 usb_buffer_in_size,
+                 usb_serial_number=None):
+
+        self.vendor_id = usb_vendor_id
+        self.product_id = usb_product_id
+        self.buffer_out_size = usb_buffer_out_size
+        self.buffer_in_size = usb_buffer_in_size
+        if usb_serial_number == None:
+            self.serial_number = 'SIM'
+        else:
+            self.serial_number = usb_serial_number
+
+        self.output_buffer = ctypes.create_string_buffer(usb_buffer_out_size)
+        self.input_buffer = ctypes.create_string_buffer(usb_buffer_in_size)
+        self.output_buffer_pos = 0
+        self.input_buffer_pos = 0
+
+        self.latency = float(os.environ.get('STAGE_DEVICE_SIM_LATENCY', 0))
+
+        # Motors keep stepping between commands, so all access to them
+        # goes through advance() under this lock
+        self.sim_lock = threading.Lock()
+        self.motors = [SimMotor(motor_n) for motor_n in range(MOTOR_NUM)]
+        self.sim_time = time.time()
+        self.sim_start = self.sim_time
+        self._clear_segments()
+        self._clear_move()
+        self.sim_line = None
+        self._clear_inputs()
+        self.sim_telemetry_period = 0
+        self.sim_telemetry_next = 0
+        self.sim_telemetry_sequence = 0
+        self._set_protocol(1)
+
+    def close(self):
+        return
+
+    # -------------------------------------------------------------------------
+    # Firmware emulation
+
+    def _advance(self, now=None):
+        if now is None:
+            now = time.time()
+        now = max(now, self.sim_time)
+        # Step up to each segment boundary that falls in this interval
+        while self.segment_running and not self.segment_hold and self.segment_end <= now:
+            self._advance_motors(self.segment_end - self.sim_time)
+            self.sim_time = self.segment_end
+            self._next_segment()
+        self._advance_motors(now - self.sim_time)
+        self.sim_time = now
+
+    def _advance_motors(self, dt):
+        for motor in self.motors:
+            motor.advance(dt)
+        self._follow_line()
+        self._check_limits()
+
+    def _set_protocol(self, version):
+        self.sim_protocol_version = version
+        self.sim_formats = WIRE_FORMATS[version]
+
+    def _wire_status(self):
+        """
+        Motor frequencies and positions as the current protocol version
+        carries them; version 1 positions wrap at 16 bits.
+        """
+        status = []
+        for motor in self.motors:
+            if self.sim_protocol_version == 1:
+                status.extend([min(motor.frequency, 0xffff), motor.position & 0xffff])
+            else:
+                status.extend([motor.frequency, motor.position])
+        return status
+
+    def _clear_segments(self):
+        self.segments = collections.deque()
+        self.segment_running = False
+        self.segment_hold = False
+        self.segment_end = 0.0
+        self.segment_mask = 0
+
+    def _next_segment(self):
+        if not self.segments:
+            # Ran dry
+            self._stop_segments()
+            return
+        motor_update, duration, setpoints = self.segments.popleft()
+        for motor_n in range(MOTOR_NUM):
+            if motor_update & (1<<motor_n):
+                self.motors[motor_n].set_point(*setpoints[motor_n])
+        self.segment_mask |= motor_update
+        self.segment_running = True
+        self.segment_hold = (duration == 0)
+        self.segment_end = self.sim_time + duration/SEGMENT_TICK_FREQ
+
+    def _queue_segments(self):
+        fields = struct.unpack_from(self.sim_formats['segments'], self.output_buffer.raw)
+        segment_count = min(fields[1], self.sim_formats['segment_packet_num'])
+        segment_len = 2 + 2*MOTOR_NUM
+        accepted = 0
+        while (accepted < segment_count) and (len(self.segments) < SEGMENT_BUFFER_SIZE):
+            segment = fields[2 + accepted*segment_len:2 + (accepted + 1)*segment_len]
+            setpoints = [(segment[2 + 2*motor_n], segment[3 + 2*motor_n]) for motor_n in range(MOTOR_NUM)]
+            self.segments.append((segment[0], segment[1], setpoints))
+            accepted += 1
+        if (not self.segment_running or self.segment_hold) and self.segments:
+            self._next_segment()
+        return accepted
+
+    def _start_line(self, motor_update, setpoints):
+        # Line_Start
+        deltas = [0]*MOTOR_NUM
+        steps = 0
+        lead = 0
+        speed = 0
+        length = 0
+        for motor_n in range(MOTOR_NUM):
+            if motor_update & (1<<motor_n):
+                motor = self.motors[motor_n]
+                motor.halt()
+                frequency, position = setpoints[motor_n]
+                deltas[motor_n] = position - motor.position
+                length += deltas[motor_n]**2
+                if abs(deltas[motor_n]) > steps:
+                    steps = abs(deltas[motor_n])
+                    lead = motor_n
+                speed = max(speed, frequency)
+                motor.position_setpoint = position
+        if (steps == 0) or (speed == 0):
+            return
+        followers = {}
+        for motor_n in range(MOTOR_NUM):
+            if (motor_update & (1<<motor_n)) and (motor_n != lead) and deltas[motor_n]:
+                followers[motor_n] = (self.motors[motor_n].position, deltas[motor_n])
+        lead_motor = self.motors[lead]
+        lead_start = lead_motor.position
+        lead_motor.set_point(max(int(speed*(steps/math.sqrt(length)) + 0.5), 1), setpoints[lead][1])
+        if followers:
+            self.sim_line = (lead, lead_start, steps, followers)
+
+    def _follow_line(self):
+        # Line_Step and Line_Tick: after k lead steps a follower has taken
+        # (steps/2 + k*delta)/steps of its own
+        if self.sim_line is None:
+            return
+        lead, lead_start, steps, followers = self.sim_line
+        lead_motor = self.motors[lead]
+        done = abs(lead_motor.position - lead_start)
+        stopped = not lead_motor.running and ((lead_motor.position == lead_motor.position_setpoint) or
+                                              (lead_motor.frequency_target == 0))
+        for motor_n, (start, delta) in followers.items():
+            motor = self.motors[motor_n]
+            taken = (steps//2 + done*abs(delta))//steps
+            motor.position = start + (taken if delta > 0 else -taken)
+            motor.frequency = 0 if stopped else lead_motor.frequency*abs(delta)//steps
+        if stopped:
+            self.sim_line = None
+
+    def _abort_line(self):
+        # Line_Abort
+        if self.sim_line is not None:
+            lead, lead_start, steps, followers = self.sim_line
+            for motor_n in followers:
+                self.motors[motor_n].frequency = 0
+            self.sim_line = None
+            self.motors[lead].stop()
+
+    def _clear_inputs(self):
+        # Input_Init
+        self.sim_home_phase = [None]*MOTOR_NUM
+        self.sim_home_frequency = [0]*MOTOR_NUM
+        self.sim_homed = 0
+        self.sim_step_loss = 0
+        self.sim_limit_hit = 0
+        self.sim_encoder = [None]*MOTOR_NUM
+        self.sim_tolerance = [STEP_LOSS_TOLERANCE]*MOTOR_NUM
+
+    def _limit_status(self):
+        status = 0
+        for motor_n, motor in enumerate(self.motors):
+            if motor.position <= motor.limit_position:
+                status |= (1<<motor_n)
+        return status
+
+    def _home_move(self, motor_n, distance, frequency):
+        motor = self.motors[motor_n]
+        motor.set_point(frequency, motor.position + distance)
+
+    def _start_home(self, motor_update, setpoints):
+        # Home_Start
+        for motor_n in range(MOTOR_NUM):
+            if motor_update & (1<<motor_n):
+                self.sim_home_frequency[motor_n] = max(setpoints[motor_n][0], 1)
+                self.sim_homed &= ~(1<<motor_n)
+                if self.motors[motor_n].position <= self.motors[motor_n].limit_position:
+                    self.sim_home_phase[motor_n] = 'found'
+                else:
+                    self.sim_home_phase[motor_n] = 'seek'
+                    self._home_move(motor_n, -HOME_TRAVEL_MAX, self.sim_home_frequency[motor_n])
+        self.sim_limit_hit = 0
+        self._check_limits()
+
+    def _abort_home(self):
+        # Home_Abort
+        for motor_n in range(MOTOR_NUM):
+            if self.sim_home_phase[motor_n] is not None:
+                self.sim_home_phase[motor_n] = None
+                self.motors[motor_n].stop()
+
+    def _check_limits(self):
+        # Limit_Change, Home_Check and the Motor_Update guard, with the
+        # step that reaches a switch taken as the one that presses it
+        for motor_n, motor in enumerate(self.motors):
+            phase = self.sim_home_phase[motor_n]
+            pressed = motor.position <= motor.limit_position
+            moving_neg = motor.running and (motor.direction < 0)
+            if line_follower(self.sim_line, motor_n):
+                moving_neg = moving_neg or (motor.position_setpoint < motor.position)
+            if phase == 'seek':
+                if pressed:
+                    motor.halt()
+                    motor.position = motor.limit_position
+                    phase = 'found'
+                elif not motor.running:
+                    phase = 'failed'
+            if phase == 'found':
+                phase = 'backoff'
+                self._home_move(motor_n, HOME_BACKOFF_MAX,
+                                max(self.sim_home_frequency[motor_n]//HOME_BACKOFF_DIVIDER, 1))
+            elif phase == 'backoff':
+                if not pressed:
+                    # Let go: this is home
+                    motor.halt()
+                    motor.limit_position += motor.position_home - motor.position
+                    motor.position = motor.position_home
+                    motor.position_setpoint = motor.position_home
+                    phase = None
+                    self.sim_homed |= (1<<motor_n)
+                    self.sim_step_loss &= ~(1<<motor_n)
+                    self._zero_encoder(motor_n)
+                elif not motor.running:
+                    phase = 'failed'
+            elif (phase is None) and pressed and moving_neg:
+                # Limit_Stop
+                if line_follower(self.sim_line, motor_n) or ((self.sim_line is not None) and (self.sim_line[0] == motor_n)):
+                    lead, lead_start, steps, followers = self.sim_line
+                    for follower_n in followers:
+                        self.motors[follower_n].frequency = 0
+                    self.motors[lead].halt()
+                    self.sim_line = None
+                motor.halt()
+                motor.position = max(motor.position, motor.limit_position)
+                error = motor.position - motor.position_home
+                if (self.sim_homed & (1<<motor_n)) and (abs(error) > self.sim_tolerance[motor_n]):
+                    self.sim_step_loss |= (1<<motor_n)
+                self.sim_limit_hit |= (1<<motor_n)
+            if phase == 'failed':
+                phase = None
+                if self.sim_move_mask & (1<<motor_n):
+                    self._abort_move()
+            self.sim_home_phase[motor_n] = phase
+
+    def _configure_encoders(self, motor_update):
+        # Encoder_Configure
+        config = struct.unpack_from(PACKET_ENCODER_FORMAT, self.output_buffer.raw)[2:]
+        for motor_n in range(MOTOR_NUM):
+            if motor_update & (1<<motor_n):
+                steps, counts, tolerance = config[3*motor_n:3*motor_n + 3]
+                self.sim_tolerance[motor_n] = tolerance or STEP_LOSS_TOLERANCE
+                self.sim_step_loss &= ~(1<<motor_n)
+                self.sim_encoder[motor_n] = None
+                if (motor_n < ENCODER_NUM) and counts and steps:
+                    self.sim_encoder[motor_n] = (steps, counts, 0)
+                    self._zero_encoder(motor_n)
+
+    def _zero_encoder(self, motor_n):
+        # Encoder_Zero
+        if self.sim_encoder[motor_n] is not None:
+            steps, counts, origin = self.sim_encoder[motor_n]
+            self.sim_encoder[motor_n] = (steps, counts, self.motors[motor_n].position)
+
+    def _encoder_counts(self):
+        # Ideal encoders, counting exactly with the steps
+        counts = []
+        for motor_n in range(MOTOR_NUM):
+            if self.sim_encoder[motor_n] is None:
+                counts.append(0)
+            else:
+                steps, encoder_counts, origin = self.sim_encoder[motor_n]
+                counts.append(int((self.motors[motor_n].position - origin)*encoder_counts/steps))
+        return counts
+
+    def _clear_move(self):
+        self.sim_move_id = 0
+        self.sim_move_status = MOVE_STATUS_IDLE
+        self.sim_move_mask = 0
+        self.sim_move_notifications = collections.deque()
+
+    def _abort_move(self):
+        if self.sim_move_status == MOVE_STATUS_MOVING:
+            self.sim_move_status = MOVE_STATUS_ABORTED
+            self._notify_move()
+
+    def _notify_move(self):
+        if self.sim_move_id != 0:
+            self.sim_move_notifications.append((self.sim_move_id, self.sim_move_status))
+
+    def _check_move(self):
+        # Move_Check
+        if self.sim_move_status != MOVE_STATUS_MOVING:
+            return
+        if self.sim_limit_hit & self.sim_move_mask:
+            # A limit switch cut it short, so stop the rest of it too
+            for motor_n in range(MOTOR_NUM):
+                if self.sim_move_mask & (1<<motor_n):
+                    self.motors[motor_n].stop()
+            self.sim_move_status = MOVE_STATUS_ABORTED
+            self._notify_move()
+            return
+        for motor_n in range(MOTOR_NUM):
+            if (self.sim_move_mask & (1<<motor_n)) and (self.sim_home_phase[motor_n] is not None):
+                return
+        if self.sim_line is not None:
+            for motor_n in self.sim_line[3]:
+                if self.sim_move_mask & (1<<motor_n):
+                    return
+        for motor_n in range(MOTOR_NUM):
+            if self.sim_move_mask & (1<<motor_n):
+                motor = self.motors[motor_n]
+                if motor.frequency != 0:
+                    return
+                if (motor.position != motor.position_setpoint) and (motor.frequency_target != 0):
+                    return
+        self.sim_move_status = MOVE_STATUS_DONE
+        self._notify_move()
+
+    def _pack_status(self, command_id, accepted, move_id, move_status):
+        status = self._wire_status()
+        segments_free = SEGMENT_BUFFER_SIZE - len(self.segments)
+        ctypes.memset(self.input_buffer, 0, self.buffer_in_size)
+        fields = status + [segments_free, accepted, move_id, move_status]
+        if self.sim_formats['inputs']:
+            fields += [self._limit_status(), self.sim_homed, self.sim_step_loss] + self._encoder_counts()
+        struct.pack_into(self.sim_formats['in'], self.input_buffer, 0, command_id, *fields)
+
+    def _stop_segments(self):
+        for motor_n in range(MOTOR_NUM):
+            if self.segment_mask & (1<<motor_n):
+                self.motors[motor_n].stop()
+        self._clear_segments()
+
+    def _process_packet(self):
+        fields = struct.unpack_from(self.sim_formats['out'], self.output_buffer.raw)
+        command_id = fields[0]
+        motor_update = fields[1]
+        accepted = 0
+
+        self.sim_lock.acquire()
+        try:
+            self._advance()
+            if command_id in (USB_CMD_SET_STATE, USB_CMD_STREAM_SEGMENTS, USB_CMD_STREAM_CLEAR, USB_CMD_MOVE,
+                              USB_CMD_MOVE_LINE, USB_CMD_HOME):
+                self._abort_move()
+                self._abort_line()
+                self._abort_home()
+            if command_id in (USB_CMD_SET_STATE, USB_CMD_MOVE, USB_CMD_MOVE_LINE, USB_CMD_HOME):
+                self._stop_segments()
+                setpoints = [(fields[2 + 2*motor_n], fields[3 + 2*motor_n]) for motor_n in range(MOTOR_NUM)]
+                if command_id in (USB_CMD_MOVE, USB_CMD_MOVE_LINE):
+                    self.sim_limit_hit = 0
+                if command_id == USB_CMD_MOVE_LINE:
+                    self._start_line(motor_update, setpoints)
+                elif command_id == USB_CMD_HOME:
+                    self._start_home(motor_update, setpoints)
+                else:
+                    for motor_n in range(MOTOR_NUM):
+                        if motor_update & (1<<motor_n):
+                            self.motors[motor_n].set_point(*setpoints[motor_n])
+                self._check_limits()
+                if command_id in (USB_CMD_MOVE, USB_CMD_MOVE_LINE, USB_CMD_HOME):
+                    self.sim_move_id = struct.unpack_from(self.sim_formats['move'], self.output_buffer.raw)[-1]
+                    self.sim_move_mask = motor_update
+                    self.sim_move_status = MOVE_STATUS_MOVING
+            elif command_id == USB_CMD_STREAM_SEGMENTS:
+                accepted = self._queue_segments()
+            elif command_id == USB_CMD_STREAM_CLEAR:
+                self._stop_segments()
+            elif command_id == USB_CMD_SET_ENCODER:
+                self._configure_encoders(motor_update)
+            elif command_id == USB_CMD_SET_ACCELERATION:
+                acceleration = struct.unpack_from(PACKET_ACCELERATION_FORMAT, self.output_buffer.raw)[2:]
+                for motor_n in range(MOTOR_NUM):
+                    if motor_update & (1<<motor_n):
+                        self.motors[motor_n].set_acceleration(acceleration[motor_n])
+            elif command_id == USB_CMD_SET_TELEMETRY:
+                self.sim_telemetry_period = struct.unpack_from(PACKET_TELEMETRY_FORMAT, self.output_buffer.raw)[2]
+                self.sim_telemetry_next = self._tick() + self.sim_telemetry_period
+            elif command_id == USB_CMD_PROTOCOL_VERSION:
+                requested = struct.unpack_from(PACKET_VERSION_FORMAT, self.output_buffer.raw)[2]
+                self._set_protocol(min(max(requested, 1), PROTOCOL_VERSION_MAX))
+            elif command_id in (USB_CMD_AVR_RESET, USB_CMD_AVR_DFU_MODE):
+                self._clear_segments()
+                self._clear_move()
+                self.sim_line = None
+                self._clear_inputs()
+                self._set_protocol(1)
+                for motor in self.motors:
+                    motor.reset()
+
+            self._check_move()
+            if command_id == USB_CMD_PROTOCOL_VERSION:
+                # Same form in every version
+                ctypes.memset(self.input_buffer, 0, self.buffer_in_size)
+                struct.pack_into(PACKET_VERSION_IN_FORMAT, self.input_buffer, 0, command_id,
+                                 PROTOCOL_MAGIC, self.sim_protocol_version, PROTOCOL_VERSION_MAX)
+            else:
+                self._pack_status(command_id, accepted, self.sim_move_id, self.sim_move_status)
+        finally:
+            self.sim_lock.release()
+
+    def _tick(self):
+        return int((time.time() - self.sim_start)*SEGMENT_TICK_FREQ)
+
+    def _poll_telemetry(self):
+        """
+        Takes the latest telemetry sample due, counting any the host was
+        too slow for in the sequence as the firmware does.  Returns None
+        if none is due.
+        """
+        self.sim_lock.acquire()
+        try:
+            period = self.sim_telemetry_period
+            tick = self._tick()
+            if (period == 0) or (tick < self.sim_telemetry_next):
+                return None
+            missed = (tick - self.sim_telemetry_next)//period
+            sample_tick = self.sim_telemetry_next + missed*period
+            self.sim_telemetry_next = sample_tick + period
+            self.sim_telemetry_sequence = (self.sim_telemetry_sequence + missed + 1) & 0xffff
+            self._advance(self.sim_start + sample_tick/SEGMENT_TICK_FREQ)
+            status = self._wire_status()
+            return struct.pack(self.sim_formats['telemetry'], self.sim_telemetry_sequence, sample_tick & 0xffffffff, *status)
+        finally:
+            self.sim_lock.release()
+
+    def _poll_notification(self):
+        """
+        Packs the oldest pending move notification, as the firmware sends
+        one between commands.  Returns False if there is none.
+        """
+        self.sim_lock.acquire()
+        try:
+            self._advance()
+            self._check_move()
+            if not self.sim_move_notifications:
+                return False
+            move_id, move_status = self.sim_move_notifications.popleft()
+            self._pack_status(USB_CMD_MOVE_DONE, 0, move_id, move_status)
+            return True
+        finally:
+            self.sim_lock.release()
+
+    # -------------------------------------------------------------------------
+    # Methods for low level USB communication
+
+    def __send_and_receive(self):
+        start = time.time()
+        self._process_packet()
+        wait = self.latency - (time.time() - start)
+        if wait > 0:
+            time.sleep(wait)
+
+    def __write_to_buffer(self,outdata):
+        N = 0
+        for d in outdata:
+            N += ctypes.sizeof(d)
+
+        if N > self.buffer_out_size:
+            raise ValueError, 'data array larger than max length'
+
+        ctypes.memset(self.output_buffer, 0, self.buffer_out_size)
+        self.output_buffer_pos = 0
+        for d in outdata:
+            sz = ctypes.sizeof(d)
+            ctypes.memmove(ctypes.byref(self.output_buffer,self.output_buffer_pos),ctypes.byref(d),sz)
+            self.output_buffer_pos += sz
+
+    def __read_from_buffer(self,input_types):
+        self.input_buffer_pos = 0
+        val_list = []
+        for ctypes_type in input_types:
+            val = ctypes_type()
+            sz = ctypes.sizeof(val)
+            if self.input_buffer_pos + sz > self.buffer_in_size:
+                raise ValueError, 'input_buffer_pos + sz greater than USB_BUFFER_IN_SIZE'
+            ctypes.memmove(ctypes.byref(val),ctypes.byref(self.input_buffer,self.input_buffer_pos),sz)
+            self.input_buffer_pos += sz
+            val_list.append(val)
+        return val_list
+
+    def usb_cmd(self,outdata,intypes):
+        """
+        Generic usb command.
+        """
+        self.__write_to_buffer(outdata)
+        self.__send_and_receive()
+        val_list = self.__read_from_buffer(intypes)
+        return val_list
+
+    def usb_read(self,intypes,timeout=200):
+        """
+        Waits up to timeout ms for a packet the device sends unprompted.
+        Returns None if none came.
+        """
+        end = time.time() + timeout/1000
+        while not self._poll_notification():
+            if time.time() >= end:
+                return None
+            time.sleep(0.001)
+        val_list = self.__read_from_buffer(intypes)
+        return val_list
+
+    def usb_interrupt_read(self,endpoint,intypes,timeout=200):
+        """
+        Waits up to timeout ms for the next telemetry sample.  Returns None
+        if none came.
+        """
+        end = time.time() + timeout/1000
+        sample = self._poll_telemetry()
+        while sample is None:
+            if time.time() >= end:
+                return None
+            time.sleep(0.0005)
+            sample = self._poll_telemetry()
+        buf = ctypes.create_string_buffer(sample, len(sample))
+        pos = 0
+        val_list = []
+        for ctypes_type in intypes:
+            val = ctypes_type()
+            sz = ctypes.sizeof(val)
+            ctypes.memmove(ctypes.byref(val),ctypes.byref(buf,pos),sz)
+            pos += sz
+            val_list.append(val)
+        return val_list
+
+    def get_serial_number(self):
+        return self.serial_number
+
+    def get_manufacturer(self):
+        return 'Simulated'
+
+    def get_product(self):
+        return 'StageUSBDevice simulator'
+
+    def get_vendor_id(self):
+        return self.vendor_id
+
+    def get_product_id(self):
+        return self.product_id
+
+    def enter_dfu_mode(self):
+        self.usb_cmd([ctypes.c_uint8(USB_CMD_AVR_DFU_MODE)],[])
+
+    def reset_device(self):
+        self.usb_cmd([ctypes.c_uint8(USB_CMD_AVR_RESET)],[])
+
+    def print_values(self):
+        print
+        print ' device information'
+        print ' '+ '-'*35
+        print '   manufacturer:', self.get_manufacturer()
+        print '   product:', self.get_product()
+        print '   vendor ID:', hex(self.get_vendor_id())
+        print '   product ID:', hex(self.get_product_id())
+        print '   serial number:',self.get_serial_number()
@@ -0,0 +1,137 @@
+// stage_benchmark.cpp
+//
+// Measures how many commands a second the stage board turns around,
+// with one and then more commands in flight.  The commands are MOVEs
+// for no motors, which the board answers without moving anything, but
+// which do end any move or trajectory stream in progress, so run this
+// with the stage idle.
+
+#include "stage/stage_device.h"
+
+#include <ros/ros.h>
+
+#include <boost/bind.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace stage
+{
+
+  class StageBenchmark
+  {
+  public:
+    StageBenchmark()
+      : replies_(0)
+    {
+    }
+
+    // Sends count commands through a StageDevice allowing max_in_flight
+    // of them at once, and reports the throughput and round trip times
+    bool run(const std::string& serial_number, size_t max_in_flight, size_t count)
+    {
+      StageDevice device(max_in_flight);
+      device.setStatusCallback(boost::bind(&StageBenchmark::statusCallback, this, _1));
+      if (!device.open(serial_number))
+        {
+          return false;
+        }
+
+      MotorStatus_t setpoint[MOTOR_NUM];
+      memset(setpoint, 0, sizeof(setpoint));
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        replies_ = 0;
+      }
+
+      ros::WallTime start = ros::WallTime::now();
+      for (size_t i = 0; i < count; ++i)
+        {
+          device.moveTo(0, setpoint, 0);
+        }
+
+      bool complete = true;
+      {
+        // Far longer than even one command at a time should take
+        boost::system_time timeout = boost::get_system_time() + boost::posix_time::milliseconds(10000 + 10*count);
+        boost::mutex::scoped_lock lock(mutex_);
+        while (replies_ < count && complete)
+          {
+            complete = replies_done_.timed_wait(lock, timeout);
+          }
+        complete = (replies_ >= count);
+      }
+      double elapsed = (ros::WallTime::now() - start).toSec();
+
+      StageDevice::LatencyStats stats = device.getLatencyStats(true);
+      device.close();
+
+      if (!complete)
+        {
+          ROS_ERROR("max_in_flight %u: only %u of %u replies came back", (unsigned int)max_in_flight,
+                    (unsigned int)replies_, (unsigned int)count);
+          return false;
+        }
+      ROS_INFO("max_in_flight %u: %u commands in %.3f s, %.0f commands/s, latency p50 %.2f ms, p99 %.2f ms, max %.2f ms",
+               (unsigned int)max_in_flight, (unsigned int)count, elapsed, count/elapsed,
+               stats.p50*1000, stats.p99*1000, stats.max*1000);
+      return true;
+    }
+
+  private:
+    void statusCallback(const USBPacketInWrapper_t& packet)
+    {
+      if (packet.CommandID == USB_CMD_MOVE)
+        {
+          boost::mutex::scoped_lock lock(mutex_);
+          ++replies_;
+          replies_done_.notify_all();
+        }
+    }
+
+    boost::mutex mutex_;
+    boost::condition_variable replies_done_;
+    size_t replies_;
+  };
+
+}
+
+int main(int argc, char** argv)
+{
+  ros::init(argc, argv, "stage_benchmark", ros::init_options::AnonymousName);
+  ros::NodeHandle private_nh("~");
+
+  std::string serial_number;
+  int count;
+  int max_in_flight;
+  private_nh.param("serial_number", serial_number, std::string(""));
+  private_nh.param("count", count, 5000);
+  // 0 runs 1, 2, 4 and 8 in turn
+  private_nh.param("max_in_flight", max_in_flight, 0);
+
+  std::vector<size_t> depths;
+  if (max_in_flight > 0)
+    {
+      depths.push_back(max_in_flight);
+    }
+  else
+    {
+      for (size_t depth = 1; depth <= 8; depth *= 2)
+        {
+          depths.push_back(depth);
+        }
+    }
+
+  stage::StageBenchmark benchmark;
+  for (size_t i = 0; i < depths.size(); ++i)
+    {
+      if (!benchmark.run(serial_number, depths[i], std::max(count, 1)))
+        {
+          return 1;
+        }
+    }
+  return 0;
+}
@@ -0,0 +1,372 @@
+// stage_communicator.cpp
+//
+// Drop-in replacement for StageCommunicator_Threads.py built on
+// StageDevice: turns stage/command_velocity into SET_STATE commands and
+// stage/command_position into MOVE_LINE (or, on older boards, MOVE)
+// commands, and publishes
+// MagnetStageState from every reply the board sends back, or from the
+// board's state telemetry when ~telemetry_rate is set.
+
+#include "stage/stage_device.h"
+
+#include <ros/ros.h>
+#include <stage/Velocity.h>
+#include <stage/Position.h>
+#include <stage/StateStamped.h>
+
+#include <boost/bind.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <cmath>
+#include <cstring>
+
+namespace stage
+{
+
+  class StageCommunicator
+  {
+  public:
+    StageCommunicator()
+      : private_nh_("~")
+    {
+      int max_in_flight;
+      double state_period;
+      double latency_report_period;
+      private_nh_.param("serial_number", serial_number_, std::string(""));
+      private_nh_.param("max_in_flight", max_in_flight, 4);
+      private_nh_.param("state_period", state_period, 0.25);
+      private_nh_.param("latency_report_period", latency_report_period, 10.0);
+      private_nh_.param("min_velocity", min_velocity_, 1.0);
+      private_nh_.param("acceleration", acceleration_, 0.0);
+      private_nh_.param("telemetry_rate", telemetry_rate_, 0.0);
+      // Homing at start up in mm/s, 0 to leave the positions as they are
+      private_nh_.param("home_velocity", home_velocity_, 0.0);
+      // Encoder counts per mm of x and y travel, 0 for no encoders
+      private_nh_.param("encoder_counts_per_mm", encoder_counts_per_mm_, 0.0);
+      // Position error in mm that counts as lost steps, 0 for the
+      // firmware's default
+      private_nh_.param("step_loss_tolerance", step_loss_tolerance_, 0.0);
+      // Microsteps per full step the drivers are set to
+      private_nh_.param("microsteps", microsteps_, 1);
+      microsteps_ = std::max(microsteps_, 1);
+
+      // Same conversion and limits as StageDevice.py.  The firmware ramps
+      // keep the steppers from stalling at full speed.
+      frequency_max_ = (acceleration_ > 0.0) ? MOTOR_FREQUENCY_MAX : 30000;
+      position_min_ = 0;
+      position_max_ = 44000*microsteps_;
+      steps_per_mm_ = 5000*microsteps_/25.4;
+      move_id_ = 0;
+      step_loss_ = 0;
+      ticks_dropped_ = 0;
+      for (int motor_n = 0; motor_n < MOTOR_NUM; ++motor_n)
+        {
+          position_[motor_n] = 0;
+        }
+
+      device_.reset(new StageDevice(max_in_flight));
+      device_->setStatusCallback(boost::bind(&StageCommunicator::statusCallback, this, _1));
+      device_->setTelemetryCallback(boost::bind(&StageCommunicator::telemetryCallback, this, _1, _2));
+
+      state_pub_ = nh_.advertise<StateStamped>("MagnetStageState", 10);
+      move_done_pub_ = nh_.advertise<StateStamped>("stage/move_done", 10);
+      velocity_sub_ = nh_.subscribe("stage/command_velocity", 10, &StageCommunicator::velocityCallback, this);
+      position_sub_ = nh_.subscribe("stage/command_position", 10, &StageCommunicator::positionCallback, this);
+      state_timer_ = nh_.createWallTimer(ros::WallDuration(state_period), &StageCommunicator::stateTimerCallback, this);
+      if (latency_report_period > 0.0)
+        {
+          latency_timer_ = nh_.createWallTimer(ros::WallDuration(latency_report_period), &StageCommunicator::latencyTimerCallback, this);
+        }
+    }
+
+    bool open()
+    {
+      ROS_INFO("Opening XYFly stage device...");
+      if (!device_->open(serial_number_))
+        {
+          return false;
+        }
+
+      // Version 1 boards count steps in 16 bits
+      if (device_->getProtocolVersion() < 2 && position_max_ > 65535)
+        {
+          ROS_WARN("Stage firmware only has 16 bit positions, travel limited to %.1f mm", 65535/steps_per_mm_);
+          position_max_ = 65535;
+        }
+
+      if (acceleration_ > 0.0)
+        {
+          // mm/s^2 to step frequency change per segment tick
+          double ticks = acceleration_*steps_per_mm_/SEGMENT_TICK_FREQ;
+          uint16_t accel = (uint16_t)std::min(std::max(ticks + 0.5, 1.0), 65535.0);
+          uint16_t acceleration[MOTOR_NUM] = {accel, accel, 0};
+          device_->setAcceleration(3, acceleration);
+        }
+
+      if (telemetry_rate_ > 0.0)
+        {
+          // Whole segment ticks, at most one sample per tick
+          double period = SEGMENT_TICK_FREQ/telemetry_rate_;
+          device_->setTelemetryPeriod((uint16_t)std::min(std::max(period + 0.5, 1.0), 65535.0));
+        }
+
+      if ((encoder_counts_per_mm_ > 0.0 || home_velocity_ > 0.0) && device_->getProtocolVersion() < 4)
+        {
+          ROS_WARN("Stage firmware has no homing or encoder support");
+          return true;
+        }
+
+      if (encoder_counts_per_mm_ > 0.0 || step_loss_tolerance_ > 0.0)
+        {
+          EncoderConfig_t config[MOTOR_NUM];
+          memset(config, 0, sizeof(config));
+          if (encoder_counts_per_mm_ > 0.0)
+            {
+              // Steps per count as the closest ratio that fits the packet
+              double ratio = steps_per_mm_/encoder_counts_per_mm_;
+              uint16_t counts = (uint16_t)std::max(std::min(32767/ratio, 65535.0), 1.0);
+              config[0].Counts = config[1].Counts = counts;
+              config[0].Steps = config[1].Steps = (int16_t)std::min(floor(ratio*counts + 0.5), 32767.0);
+            }
+          config[0].Tolerance = config[1].Tolerance = config[2].Tolerance =
+            (uint16_t)std::min(floor(step_loss_tolerance_*steps_per_mm_ + 0.5), 65535.0);
+          device_->setEncoders(7, config);
+        }
+
+      if (home_velocity_ > 0.0)
+        {
+          uint32_t frequency = (uint32_t)std::min(std::max(home_velocity_*steps_per_mm_, 1.0), (double)frequency_max_);
+          uint32_t frequencies[MOTOR_NUM] = {frequency, frequency, 0};
+          ROS_INFO("Homing the stage...");
+          move_id_ = (move_id_ == 255) ? 1 : move_id_ + 1;
+          device_->home(3, frequencies, move_id_);
+        }
+      return true;
+    }
+
+    void close()
+    {
+      if (telemetry_rate_ > 0.0)
+        {
+          device_->setTelemetryPeriod(0);
+        }
+      device_->close();
+      ROS_INFO("XYFly stage device closed.");
+    }
+
+  private:
+    void velocityCallback(const VelocityConstPtr& vel)
+    {
+      MotorStatus_t setpoint[MOTOR_NUM] = {{0, 0}, {0, 0}, {0, 0}};
+      velocityToSetpoint(vel->x_velocity, setpoint[0]);
+      velocityToSetpoint(vel->y_velocity, setpoint[1]);
+      device_->setState(7, setpoint);
+    }
+
+    // The board runs the move itself, in a straight line at the requested
+    // velocity, and reports back on stage/move_done once the motors have
+    // stopped at the target
+    void positionCallback(const PositionConstPtr& pos)
+    {
+      uint32_t frequency = (uint32_t)std::min(std::max(fabs(pos->velocity), min_velocity_)*steps_per_mm_,
+                                              (double)frequency_max_);
+      MotorStatus_t setpoint[MOTOR_NUM] = {{0, 0}, {0, 0}, {0, 0}};
+      positionToSetpoint(pos->x, frequency, setpoint[0]);
+      positionToSetpoint(pos->y, frequency, setpoint[1]);
+
+      move_id_ = (move_id_ == 255) ? 1 : move_id_ + 1;
+      if (device_->getProtocolVersion() >= 3)
+        {
+          device_->moveLine(3, setpoint, move_id_);
+          return;
+        }
+
+      // Older boards run each axis on its own, so share the velocity out
+      // for both to get there at once, from where they were last seen
+      double dx, dy;
+      {
+        boost::mutex::scoped_lock lock(position_mutex_);
+        dx = setpoint[0].Position - position_[0];
+        dy = setpoint[1].Position - position_[1];
+      }
+      double length = sqrt(dx*dx + dy*dy);
+      if (length > 0.0)
+        {
+          setpoint[0].Frequency = (uint32_t)std::max(frequency*fabs(dx)/length, 1.0);
+          setpoint[1].Frequency = (uint32_t)std::max(frequency*fabs(dy)/length, 1.0);
+        }
+      device_->moveTo(3, setpoint, move_id_);
+    }
+
+    void positionToSetpoint(double position, uint32_t frequency, MotorStatus_t& setpoint)
+    {
+      double steps = floor(position*steps_per_mm_ + 0.5);
+      setpoint.Position = (int32_t)std::min(std::max(steps, (double)position_min_), (double)position_max_);
+      setpoint.Frequency = frequency;
+    }
+
+    // Velocity control by running toward the far end of the axis at the
+    // requested step frequency
+    void velocityToSetpoint(double velocity, MotorStatus_t& setpoint)
+    {
+      if (fabs(velocity) < min_velocity_)
+        {
+          velocity = 0;
+        }
+
+      double steps = velocity*steps_per_mm_;
+      if (steps < 0)
+        {
+          setpoint.Position = position_min_;
+          steps = -steps;
+        }
+      else
+        {
+          setpoint.Position = position_max_;
+        }
+      setpoint.Frequency = (uint32_t)std::min(steps, (double)frequency_max_);
+    }
+
+    StateStamped packetToState(const MotorStatus_t motor_status[MOTOR_NUM], const ros::Time& stamp)
+    {
+      {
+        boost::mutex::scoped_lock lock(position_mutex_);
+        for (int motor_n = 0; motor_n < MOTOR_NUM; ++motor_n)
+          {
+            position_[motor_n] = motor_status[motor_n].Position;
+          }
+      }
+
+      StateStamped state;
+      state.header.stamp = stamp;
+      state.x = motor_status[0].Position/steps_per_mm_;
+      state.y = motor_status[1].Position/steps_per_mm_;
+      state.theta = motor_status[2].Position/steps_per_mm_;
+      state.x_velocity = motor_status[0].Frequency/steps_per_mm_;
+      state.y_velocity = motor_status[1].Frequency/steps_per_mm_;
+      state.theta_velocity = motor_status[2].Frequency/steps_per_mm_;
+      return state;
+    }
+
+    void statusCallback(const USBPacketInWrapper_t& packet)
+    {
+      StateStamped state = packetToState(packet.MotorStatus, ros::Time::now());
+      // Telemetry carries the state with better time stamps
+      if (telemetry_rate_ <= 0.0)
+        {
+          state_pub_.publish(state);
+        }
+
+      // Flags only ever clear on homing or setting up the encoders again
+      uint8_t step_loss = packet.StepLoss & ~step_loss_;
+      step_loss_ = packet.StepLoss;
+      if (step_loss)
+        {
+          ROS_WARN("Stage lost steps on%s%s%s, home it again", (step_loss & 1) ? " x" : "",
+                   (step_loss & 2) ? " y" : "", (step_loss & 4) ? " theta" : "");
+        }
+
+      // Overrun ticks stretch the ramps and segments, so say when there are
+      // new ones.  Boards before version 5 always report none.
+      uint16_t ticks_dropped = packet.TicksDropped - ticks_dropped_;
+      ticks_dropped_ = packet.TicksDropped;
+      if (ticks_dropped)
+        {
+          ROS_WARN("Stage dropped %u segment ticks", (unsigned int)ticks_dropped);
+        }
+
+      // A move cut short by a later command or a limit switch is not done
+      if (packet.CommandID == USB_CMD_MOVE_DONE)
+        {
+          if (packet.MoveStatus == MOVE_STATUS_DONE)
+            {
+              move_done_pub_.publish(state);
+            }
+          else
+            {
+              ROS_DEBUG("Stage move %d aborted", packet.MoveID);
+            }
+        }
+    }
+
+    void telemetryCallback(const TelemetryPacketWrapper_t& packet, const ros::Time& stamp)
+    {
+      state_pub_.publish(packetToState(packet.MotorStatus, stamp));
+    }
+
+    void stateTimerCallback(const ros::WallTimerEvent&)
+    {
+      // Telemetry keeps the state coming, but streaming still needs the
+      // replies to learn the room on the board
+      if (telemetry_rate_ <= 0.0 || device_->getSegmentsPending() > 0)
+        {
+          device_->getState();
+        }
+    }
+
+    void latencyTimerCallback(const ros::WallTimerEvent&)
+    {
+      StageDevice::LatencyStats stats = device_->getLatencyStats(true);
+      if (stats.count > 0)
+        {
+          ROS_INFO("Stage command latency over %u commands: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms",
+                   (unsigned int)stats.count, stats.p50*1000, stats.p90*1000, stats.p99*1000, stats.max*1000);
+        }
+      size_t dropped = device_->getTelemetryDropped(true);
+      if (dropped > 0)
+        {
+          ROS_INFO("Stage telemetry dropped %u samples", (unsigned int)dropped);
+        }
+    }
+
+    ros::NodeHandle nh_;
+    ros::NodeHandle private_nh_;
+    ros::Publisher state_pub_;
+    ros::Publisher move_done_pub_;
+    ros::Subscriber velocity_sub_;
+    ros::Subscriber position_sub_;
+    ros::WallTimer state_timer_;
+    ros::WallTimer latency_timer_;
+
+    boost::shared_ptr<StageDevice> device_;
+    std::string serial_number_;
+
+    double min_velocity_;
+    double acceleration_;
+    double telemetry_rate_;
+    double home_velocity_;
+    double encoder_counts_per_mm_;
+    double step_loss_tolerance_;
+    int microsteps_;
+    int frequency_max_;
+    int position_min_;
+    int position_max_;
+    double steps_per_mm_;
+    uint8_t move_id_;
+    // Step loss flags last reported, from the USB event thread
+    uint8_t step_loss_;
+    // Dropped tick count last reported, from the USB event thread
+    uint16_t ticks_dropped_;
+
+    // Last reported motor positions, from the USB event thread
+    boost::mutex position_mutex_;
+    int32_t position_[MOTOR_NUM];
+  };
+
+}
+
+int main(int argc, char** argv)
+{
+  ros::init(argc, argv, "StageCommunicator", ros::init_options::AnonymousName);
+
+  stage::StageCommunicator communicator;
+  if (!communicator.open())
+    {
+      return 1;
+    }
+
+  ros::spin();
+
+  communicator.close();
+  return 0;
+}
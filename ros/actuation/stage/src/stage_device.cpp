@@ -0,0 +1,954 @@
+// stage_device.cpp
+//
+// Control interface for the at90usb based xyfly stage board over
+// libusb-1.0.
+
+#include "stage/stage_device.h"
+
+#include <libusb-1.0/libusb.h>
+
+#include <boost/bind.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+// Number of recent round trips kept for the latency percentiles
+#define LATENCY_HISTORY 1024
+#define OUT_TIMEOUT_MS 1000
+// Interrupt reads kept posted, so a sample can be taken in while the
+// callback for the last one runs
+#define TELEMETRY_TRANSFERS 2
+// Fastest the board and host clocks are expected to drift apart
+#define TELEMETRY_CLOCK_DRIFT 1e-4
+#define NEGOTIATE_TIMEOUT_MS 200
+// Packets read while looking for the version reply, in case a move
+// notification from an earlier session is still waiting
+#define NEGOTIATE_READS 4
+
+namespace stage
+{
+
+  StageDevice::StageDevice(size_t max_in_flight)
+    : max_in_flight_(std::max(max_in_flight, (size_t)1))
+    , context_(NULL)
+    , handle_(NULL)
+    , stop_events_(false)
+    , protocol_version_(1)
+    , closing_(false)
+    , active_transfers_(0)
+    , next_seq_(0)
+    , segments_free_(SEGMENT_BUFFER_SIZE)
+    , telemetry_offset_(0.0)
+    , telemetry_last_tick_(0)
+    , telemetry_last_sequence_(0)
+    , telemetry_samples_(0)
+    , telemetry_dropped_(0)
+    , latencies_(LATENCY_HISTORY)
+    , latency_index_(0)
+    , latency_count_(0)
+  {
+  }
+
+  StageDevice::~StageDevice()
+  {
+    close();
+  }
+
+  bool StageDevice::open(const std::string& serial_number)
+  {
+    close();
+
+    if (libusb_init(&context_) != 0)
+      {
+        ROS_ERROR("Could not initialize libusb");
+        context_ = NULL;
+        return false;
+      }
+
+    libusb_device** devices;
+    ssize_t device_count = libusb_get_device_list(context_, &devices);
+    for (ssize_t i = 0; i < device_count && handle_ == NULL; ++i)
+      {
+        libusb_device_descriptor descriptor;
+        if (libusb_get_device_descriptor(devices[i], &descriptor) != 0
+            || descriptor.idVendor != USB_VENDOR_ID
+            || descriptor.idProduct != USB_PRODUCT_ID)
+          {
+            continue;
+          }
+
+        libusb_device_handle* handle;
+        if (libusb_open(devices[i], &handle) != 0)
+          {
+            continue;
+          }
+
+        if (!serial_number.empty())
+          {
+            unsigned char serial[256];
+            int length = libusb_get_string_descriptor_ascii(handle, descriptor.iSerialNumber, serial, sizeof(serial));
+            if (length < 0 || serial_number != std::string((char*)serial, length))
+              {
+                libusb_close(handle);
+                continue;
+              }
+          }
+
+        handle_ = handle;
+      }
+    if (device_count >= 0)
+      {
+        libusb_free_device_list(devices, 1);
+      }
+
+    if (handle_ == NULL)
+      {
+        if (serial_number.empty())
+          {
+            ROS_ERROR("Cannot find stage device");
+          }
+        else
+          {
+            ROS_ERROR("Cannot find stage device w/ serial number %s", serial_number.c_str());
+          }
+        libusb_exit(context_);
+        context_ = NULL;
+        return false;
+      }
+
+    if (libusb_kernel_driver_active(handle_, 0) == 1)
+      {
+        libusb_detach_kernel_driver(handle_, 0);
+      }
+    if (libusb_set_configuration(handle_, 1) != 0 || libusb_claim_interface(handle_, 0) != 0)
+      {
+        ROS_ERROR("Cannot claim stage device interface");
+        libusb_close(handle_);
+        handle_ = NULL;
+        libusb_exit(context_);
+        context_ = NULL;
+        return false;
+      }
+    libusb_clear_halt(handle_, USB_BULKOUT_EP_ADDRESS);
+    libusb_clear_halt(handle_, USB_BULKIN_EP_ADDRESS);
+
+    // Settled before any transfer is posted, so every packet after this
+    // one is in the agreed format
+    protocol_version_ = negotiateProtocol();
+    ROS_INFO("Stage protocol version %d", protocol_version_);
+
+    closing_ = false;
+    active_transfers_ = 0;
+    sent_.clear();
+    pending_.clear();
+    pending_segments_.clear();
+    segments_free_ = SEGMENT_BUFFER_SIZE;
+
+    out_slots_.resize(max_in_flight_);
+    free_out_slots_.clear();
+    for (size_t i = 0; i < max_in_flight_; ++i)
+      {
+        OutSlot& slot = out_slots_[i];
+        slot.device = this;
+        slot.transfer = libusb_alloc_transfer(0);
+        unsigned char* buffer = new unsigned char[USB_BUFFER_OUT_SIZE];
+        libusb_fill_bulk_transfer(slot.transfer, handle_, USB_BULKOUT_EP_ADDRESS, buffer, USB_BUFFER_OUT_SIZE,
+                                  &StageDevice::outCallback, &slot, OUT_TIMEOUT_MS);
+        free_out_slots_.push_back(&slot);
+      }
+
+    // Keep a read posted for every command that can be in flight, so a reply
+    // never waits on the host to ask for it
+    in_transfers_.resize(max_in_flight_);
+    for (size_t i = 0; i < max_in_flight_; ++i)
+      {
+        libusb_transfer* transfer = libusb_alloc_transfer(0);
+        unsigned char* buffer = new unsigned char[USB_BUFFER_IN_SIZE];
+        libusb_fill_bulk_transfer(transfer, handle_, USB_BULKIN_EP_ADDRESS, buffer, USB_BUFFER_IN_SIZE,
+                                  &StageDevice::inCallback, this, 0);
+        in_transfers_[i] = transfer;
+        if (libusb_submit_transfer(transfer) == 0)
+          {
+            ++active_transfers_;
+          }
+      }
+
+    telemetry_samples_ = 0;
+    telemetry_dropped_ = 0;
+    telemetry_transfers_.resize(TELEMETRY_TRANSFERS);
+    for (size_t i = 0; i < TELEMETRY_TRANSFERS; ++i)
+      {
+        libusb_transfer* transfer = libusb_alloc_transfer(0);
+        unsigned char* buffer = new unsigned char[USB_TELEMETRY_SIZE];
+        libusb_fill_interrupt_transfer(transfer, handle_, USB_TELEMETRY_EP_ADDRESS, buffer, USB_TELEMETRY_SIZE,
+                                       &StageDevice::telemetryCallback, this, 0);
+        telemetry_transfers_[i] = transfer;
+        if (libusb_submit_transfer(transfer) == 0)
+          {
+            ++active_transfers_;
+          }
+      }
+
+    stop_events_ = false;
+    event_thread_ = boost::thread(boost::bind(&StageDevice::eventLoop, this));
+
+    return true;
+  }
+
+  void StageDevice::close()
+  {
+    if (handle_ == NULL)
+      {
+        return;
+      }
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      closing_ = true;
+      for (size_t i = 0; i < in_transfers_.size(); ++i)
+        {
+          libusb_cancel_transfer(in_transfers_[i]);
+        }
+      for (size_t i = 0; i < telemetry_transfers_.size(); ++i)
+        {
+          libusb_cancel_transfer(telemetry_transfers_[i]);
+        }
+      for (size_t i = 0; i < out_slots_.size(); ++i)
+        {
+          libusb_cancel_transfer(out_slots_[i].transfer);
+        }
+      // The event thread is still running, and finishes off the cancellations
+      while (active_transfers_ > 0)
+        {
+          transfers_done_.wait(lock);
+        }
+    }
+
+    stop_events_ = true;
+    event_thread_.join();
+
+    for (size_t i = 0; i < in_transfers_.size(); ++i)
+      {
+        delete[] in_transfers_[i]->buffer;
+        libusb_free_transfer(in_transfers_[i]);
+      }
+    in_transfers_.clear();
+    for (size_t i = 0; i < telemetry_transfers_.size(); ++i)
+      {
+        delete[] telemetry_transfers_[i]->buffer;
+        libusb_free_transfer(telemetry_transfers_[i]);
+      }
+    telemetry_transfers_.clear();
+    for (size_t i = 0; i < out_slots_.size(); ++i)
+      {
+        delete[] out_slots_[i].transfer->buffer;
+        libusb_free_transfer(out_slots_[i].transfer);
+      }
+    out_slots_.clear();
+    free_out_slots_.clear();
+
+    libusb_release_interface(handle_, 0);
+    libusb_close(handle_);
+    handle_ = NULL;
+    libusb_exit(context_);
+    context_ = NULL;
+  }
+
+  uint8_t StageDevice::negotiateProtocol()
+  {
+    unsigned char buffer[USB_BUFFER_IN_SIZE];
+    int transferred = 0;
+
+    // The request reads the same in both versions
+    USBPacketOutWrapper_t packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.CommandID = USB_CMD_PROTOCOL_VERSION;
+    packet.ProtocolVersion = PROTOCOL_VERSION_MAX;
+    memset(buffer, 0, sizeof(buffer));
+    memcpy(buffer, &packet, sizeof(packet));
+    if (libusb_bulk_transfer(handle_, USB_BULKOUT_EP_ADDRESS, buffer, USB_BUFFER_OUT_SIZE,
+                             &transferred, NEGOTIATE_TIMEOUT_MS) != 0)
+      {
+        ROS_WARN("Cannot send stage protocol version, assuming version 1");
+        return 1;
+      }
+
+    for (int i = 0; i < NEGOTIATE_READS; ++i)
+      {
+        if (libusb_bulk_transfer(handle_, USB_BULKIN_EP_ADDRESS, buffer, USB_BUFFER_IN_SIZE,
+                                 &transferred, NEGOTIATE_TIMEOUT_MS) != 0)
+          {
+            break;
+          }
+        USBPacketVersionWrapper_t reply;
+        if (transferred < (int)sizeof(reply) || buffer[0] != USB_CMD_PROTOCOL_VERSION)
+          {
+            continue;
+          }
+        memcpy(&reply, buffer, sizeof(reply));
+        // Older firmware answers with a state reply, whose 16 bit frequency
+        // never reaches the magic
+        if (reply.Magic != PROTOCOL_MAGIC)
+          {
+            return 1;
+          }
+        return std::min(std::max(reply.ProtocolVersion, (uint8_t)1), PROTOCOL_VERSION_MAX);
+      }
+
+    ROS_WARN("No stage protocol version reply, assuming version 1");
+    return 1;
+  }
+
+  void StageDevice::setStatusCallback(const StatusCallback& callback)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    status_callback_ = callback;
+  }
+
+  void StageDevice::setTelemetryCallback(const TelemetryCallback& callback)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    telemetry_callback_ = callback;
+  }
+
+  bool StageDevice::getState()
+  {
+    if (handle_ == NULL)
+      {
+        return false;
+      }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    if (!sent_.empty() || !pending_.empty())
+      {
+        return true;
+      }
+
+    USBPacketOutWrapper_t packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.CommandID = USB_CMD_GET_STATE;
+    send(&packet, sizeof(packet));
+    return true;
+  }
+
+  bool StageDevice::setState(uint8_t motor_update, const MotorStatus_t setpoint[MOTOR_NUM])
+  {
+    if (handle_ == NULL)
+      {
+        return false;
+      }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    USBPacketOutWrapper_t& packet = queueCommand(USB_CMD_SET_STATE, true);
+    // A newer setpoint replaces an older one for the same motor
+    for (int motor_n = 0; motor_n < MOTOR_NUM; ++motor_n)
+      {
+        if (motor_update & (1<<motor_n))
+          {
+            packet.Setpoint[motor_n] = setpoint[motor_n];
+          }
+      }
+    packet.MotorUpdate |= motor_update;
+    pending_segments_.clear();
+
+    sendPending();
+    return true;
+  }
+
+  bool StageDevice::moveTo(uint8_t motor_update, const MotorStatus_t setpoint[MOTOR_NUM], uint8_t move_id)
+  {
+    if (handle_ == NULL)
+      {
+        return false;
+      }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    USBPacketOutWrapper_t& packet = queueCommand(USB_CMD_MOVE, false);
+    for (int motor_n = 0; motor_n < MOTOR_NUM; ++motor_n)
+      {
+        if (motor_update & (1<<motor_n))
+          {
+            packet.Setpoint[motor_n] = setpoint[motor_n];
+          }
+      }
+    packet.MotorUpdate = motor_update;
+    packet.MoveID = move_id;
+    pending_segments_.clear();
+
+    sendPending();
+    return true;
+  }
+
+  bool StageDevice::moveLine(uint8_t motor_update, const MotorStatus_t setpoint[MOTOR_NUM], uint8_t move_id)
+  {
+    if (handle_ == NULL)
+      {
+        return false;
+      }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    USBPacketOutWrapper_t& packet = queueCommand(USB_CMD_MOVE_LINE, false);
+    for (int motor_n = 0; motor_n < MOTOR_NUM; ++motor_n)
+      {
+        if (motor_update & (1<<motor_n))
+          {
+            packet.Setpoint[motor_n] = setpoint[motor_n];
+          }
+      }
+    packet.MotorUpdate = motor_update;
+    packet.MoveID = move_id;
+    pending_segments_.clear();
+
+    sendPending();
+    return true;
+  }
+
+  bool StageDevice::home(uint8_t motor_update, const uint32_t frequency[MOTOR_NUM], uint8_t move_id)
+  {
+    if (handle_ == NULL)
+      {
+        return false;
+      }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    USBPacketOutWrapper_t& packet = queueCommand(USB_CMD_HOME, false);
+    for (int motor_n = 0; motor_n < MOTOR_NUM; ++motor_n)
+      {
+        if (motor_update & (1<<motor_n))
+          {
+            packet.Setpoint[motor_n].Frequency = frequency[motor_n];
+          }
+      }
+    packet.MotorUpdate = motor_update;
+    packet.MoveID = move_id;
+    pending_segments_.clear();
+
+    sendPending();
+    return true;
+  }
+
+  bool StageDevice::setEncoders(uint8_t motor_update, const EncoderConfig_t config[MOTOR_NUM])
+  {
+    if (handle_ == NULL)
+      {
+        return false;
+      }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    USBPacketOutWrapper_t& packet = queueCommand(USB_CMD_SET_ENCODER, false);
+    for (int motor_n = 0; motor_n < MOTOR_NUM; ++motor_n)
+      {
+        if (motor_update & (1<<motor_n))
+          {
+            packet.Encoder[motor_n] = config[motor_n];
+          }
+      }
+    packet.MotorUpdate = motor_update;
+
+    sendPending();
+    return true;
+  }
+
+  bool StageDevice::setAcceleration(uint8_t motor_update, const uint16_t acceleration[MOTOR_NUM])
+  {
+    if (handle_ == NULL)
+      {
+        return false;
+      }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    USBPacketOutWrapper_t& packet = queueCommand(USB_CMD_SET_ACCELERATION, true);
+    for (int motor_n = 0; motor_n < MOTOR_NUM; ++motor_n)
+      {
+        if (motor_update & (1<<motor_n))
+          {
+            packet.Acceleration[motor_n] = acceleration[motor_n];
+          }
+      }
+    packet.MotorUpdate |= motor_update;
+
+    sendPending();
+    return true;
+  }
+
+  bool StageDevice::queueSegments(const std::vector<SegmentWrapper_t>& segments)
+  {
+    if (handle_ == NULL)
+      {
+        return false;
+      }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    pending_segments_.insert(pending_segments_.end(), segments.begin(), segments.end());
+    sendPending();
+    return true;
+  }
+
+  bool StageDevice::clearSegments()
+  {
+    if (handle_ == NULL)
+      {
+        return false;
+      }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    pending_segments_.clear();
+    queueCommand(USB_CMD_STREAM_CLEAR, true);
+    sendPending();
+    return true;
+  }
+
+  size_t StageDevice::getSegmentsPending()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return pending_segments_.size();
+  }
+
+  bool StageDevice::setTelemetryPeriod(uint16_t period)
+  {
+    if (handle_ == NULL)
+      {
+        return false;
+      }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    queueCommand(USB_CMD_SET_TELEMETRY, true).TelemetryPeriod = period;
+    sendPending();
+    return true;
+  }
+
+  size_t StageDevice::getTelemetryDropped(bool reset)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    size_t dropped = telemetry_dropped_;
+    if (reset)
+      {
+        telemetry_dropped_ = 0;
+      }
+    return dropped;
+  }
+
+  USBPacketOutWrapper_t& StageDevice::queueCommand(uint8_t command_id, bool merge)
+  {
+    // Only the last command waiting can take in a new one, so the board
+    // still sees them in the order they were given
+    if (!merge || pending_.empty() || pending_.back().CommandID != command_id)
+      {
+        USBPacketOutWrapper_t packet;
+        memset(&packet, 0, sizeof(packet));
+        packet.CommandID = command_id;
+        pending_.push_back(packet);
+      }
+    return pending_.back();
+  }
+
+  // Version 1 packets carry 16 bit frequencies and unsigned 16 bit positions
+  static void narrowStatus(MotorStatus16_t& narrow, const MotorStatus_t& status)
+  {
+    narrow.Frequency = (uint16_t)std::min(status.Frequency, (uint32_t)0xFFFF);
+    narrow.Position = (uint16_t)std::min(std::max(status.Position, 0), 0xFFFF);
+  }
+
+  static void widenStatus(MotorStatus_t& status, const MotorStatus16_t& narrow)
+  {
+    status.Frequency = narrow.Frequency;
+    status.Position = narrow.Position;
+  }
+
+  static void narrowCommand(USBPacketOut16Wrapper_t& narrow, const USBPacketOutWrapper_t& packet)
+  {
+    memset(&narrow, 0, sizeof(narrow));
+    narrow.CommandID = packet.CommandID;
+    narrow.MotorUpdate = packet.MotorUpdate;
+    if (packet.CommandID == USB_CMD_SET_STATE || packet.CommandID == USB_CMD_MOVE ||
+        packet.CommandID == USB_CMD_MOVE_LINE)
+      {
+        for (int motor_n = 0; motor_n < MOTOR_NUM; ++motor_n)
+          {
+            narrowStatus(narrow.Setpoint[motor_n], packet.Setpoint[motor_n]);
+          }
+        narrow.MoveID = packet.MoveID;
+      }
+    else
+      {
+        // Acceleration, TelemetryPeriod and ProtocolVersion are the same
+        // in both versions
+        memcpy(narrow.Acceleration, packet.Acceleration, sizeof(narrow.Acceleration));
+      }
+  }
+
+  static void narrowSegment(Segment16Wrapper_t& narrow, const SegmentWrapper_t& segment)
+  {
+    narrow.MotorUpdate = segment.MotorUpdate;
+    narrow.Duration = segment.Duration;
+    for (int motor_n = 0; motor_n < MOTOR_NUM; ++motor_n)
+      {
+        narrowStatus(narrow.Setpoint[motor_n], segment.Setpoint[motor_n]);
+      }
+  }
+
+  static bool clearsSegments(uint8_t command_id)
+  {
+    return command_id == USB_CMD_SET_STATE || command_id == USB_CMD_MOVE || command_id == USB_CMD_MOVE_LINE ||
+      command_id == USB_CMD_HOME || command_id == USB_CMD_STREAM_CLEAR;
+  }
+
+  void StageDevice::sendPending()
+  {
+    // Commands go ahead of segments queued after them
+    while (!pending_.empty())
+      {
+        const USBPacketOutWrapper_t& packet = pending_.front();
+        bool sent;
+        if (protocol_version_ == 1)
+          {
+            USBPacketOut16Wrapper_t narrow;
+            narrowCommand(narrow, packet);
+            sent = send(&narrow, sizeof(narrow));
+          }
+        else
+          {
+            sent = send(&packet, sizeof(packet));
+          }
+        if (!sent)
+          {
+            return;
+          }
+        if (clearsSegments(packet.CommandID))
+          {
+            segments_free_ = SEGMENT_BUFFER_SIZE;
+          }
+        pending_.pop_front();
+      }
+
+    while (!pending_segments_.empty() && segments_free_ > 0)
+      {
+        size_t packet_num = (protocol_version_ == 1) ? SEGMENT16_PACKET_NUM : SEGMENT_PACKET_NUM;
+        uint8_t count = std::min(std::min(pending_segments_.size(), packet_num), (size_t)segments_free_);
+        bool sent;
+        if (protocol_version_ == 1)
+          {
+            USBPacketSegments16Wrapper_t packet;
+            memset(&packet, 0, sizeof(packet));
+            packet.CommandID = USB_CMD_STREAM_SEGMENTS;
+            packet.SegmentCount = count;
+            for (uint8_t i = 0; i < count; ++i)
+              {
+                narrowSegment(packet.Segment[i], pending_segments_[i]);
+              }
+            sent = send(&packet, sizeof(packet), count);
+          }
+        else
+          {
+            USBPacketSegmentsWrapper_t packet;
+            memset(&packet, 0, sizeof(packet));
+            packet.CommandID = USB_CMD_STREAM_SEGMENTS;
+            packet.SegmentCount = count;
+            std::copy(pending_segments_.begin(), pending_segments_.begin() + count, packet.Segment);
+            sent = send(&packet, sizeof(packet), count);
+          }
+        if (!sent)
+          {
+            return;
+          }
+        pending_segments_.erase(pending_segments_.begin(), pending_segments_.begin() + count);
+        segments_free_ -= count;
+      }
+  }
+
+  bool StageDevice::send(const void* packet, size_t size, uint8_t segment_count)
+  {
+    if (closing_ || sent_.size() >= max_in_flight_ || free_out_slots_.empty())
+      {
+        return false;
+      }
+
+    OutSlot* slot = free_out_slots_.back();
+    memset(slot->transfer->buffer, 0, USB_BUFFER_OUT_SIZE);
+    memcpy(slot->transfer->buffer, packet, size);
+    slot->seq = next_seq_++;
+
+    int error = libusb_submit_transfer(slot->transfer);
+    if (error != 0)
+      {
+        ROS_ERROR("Error sending stage command: %s", libusb_error_name(error));
+        return false;
+      }
+    free_out_slots_.pop_back();
+    ++active_transfers_;
+
+    SentCommand sent;
+    sent.seq = slot->seq;
+    sent.command_id = *(const uint8_t*)packet;
+    sent.segment_count = segment_count;
+    sent.stamp = ros::WallTime::now();
+    sent_.push_back(sent);
+
+    return true;
+  }
+
+  void StageDevice::outCallback(libusb_transfer* transfer)
+  {
+    OutSlot* slot = (OutSlot*)transfer->user_data;
+    slot->device->handleOut(slot);
+  }
+
+  void StageDevice::inCallback(libusb_transfer* transfer)
+  {
+    ((StageDevice*)transfer->user_data)->handleIn(transfer);
+  }
+
+  void StageDevice::telemetryCallback(libusb_transfer* transfer)
+  {
+    ((StageDevice*)transfer->user_data)->handleTelemetry(transfer);
+  }
+
+  void StageDevice::handleOut(OutSlot* slot)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    free_out_slots_.push_back(slot);
+
+    if (slot->transfer->status != LIBUSB_TRANSFER_COMPLETED)
+      {
+        // No reply is coming for this one
+        for (std::deque<SentCommand>::iterator it = sent_.begin(); it != sent_.end(); ++it)
+          {
+            if (it->seq == slot->seq)
+              {
+                sent_.erase(it);
+                break;
+              }
+          }
+        if (!closing_)
+          {
+            ROS_ERROR("Error sending stage command: transfer status %d", slot->transfer->status);
+          }
+      }
+
+    transferDone();
+    if (!closing_)
+      {
+        sendPending();
+      }
+  }
+
+  void StageDevice::handleIn(libusb_transfer* transfer)
+  {
+    USBPacketInWrapper_t packet;
+    bool have_packet = false;
+    StatusCallback callback;
+
+    // Fields the board's protocol version leaves out read as zero
+    memset(&packet, 0, sizeof(packet));
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (transfer->status == LIBUSB_TRANSFER_COMPLETED && protocol_version_ == 1
+          && transfer->actual_length >= (int)sizeof(USBPacketIn16Wrapper_t))
+        {
+          USBPacketIn16Wrapper_t narrow;
+          memcpy(&narrow, transfer->buffer, sizeof(narrow));
+          packet.CommandID = narrow.CommandID;
+          for (int motor_n = 0; motor_n < MOTOR_NUM; ++motor_n)
+            {
+              widenStatus(packet.MotorStatus[motor_n], narrow.MotorStatus[motor_n]);
+            }
+          packet.SegmentsFree = narrow.SegmentsFree;
+          packet.SegmentsAccepted = narrow.SegmentsAccepted;
+          packet.MoveID = narrow.MoveID;
+          packet.MoveStatus = narrow.MoveStatus;
+          have_packet = true;
+        }
+      else if (transfer->status == LIBUSB_TRANSFER_COMPLETED && protocol_version_ != 1
+               && transfer->actual_length >= (int)USBPACKETIN_V2_SIZE)
+        {
+          memcpy(&packet, transfer->buffer, std::min((size_t)transfer->actual_length, sizeof(packet)));
+          have_packet = true;
+        }
+
+      if (have_packet)
+        {
+          // The board answers commands one at a time, in order.  Move
+          // notifications come in between and answer nothing.
+          if (packet.CommandID != USB_CMD_MOVE_DONE && !sent_.empty())
+            {
+              const SentCommand& sent = sent_.front();
+              if (sent.command_id != packet.CommandID)
+                {
+                  ROS_WARN("received incorrect command ID %d expected %d", packet.CommandID, sent.command_id);
+                }
+              else if (packet.SegmentsAccepted < sent.segment_count)
+                {
+                  ROS_WARN("stage segment buffer full, dropped %d segments", sent.segment_count - packet.SegmentsAccepted);
+                }
+              recordLatency((ros::WallTime::now() - sent.stamp).toSec());
+              sent_.pop_front();
+            }
+
+          // Resync the free space with the board, less what is still on its way
+          segments_free_ = packet.SegmentsFree;
+          for (std::deque<SentCommand>::const_iterator it = sent_.begin(); it != sent_.end(); ++it)
+            {
+              if (clearsSegments(it->command_id))
+                {
+                  segments_free_ = SEGMENT_BUFFER_SIZE;
+                }
+              segments_free_ -= it->segment_count;
+            }
+          segments_free_ = std::max(segments_free_, 0);
+          sendPending();
+          callback = status_callback_;
+        }
+      else if (transfer->status != LIBUSB_TRANSFER_CANCELLED && !closing_)
+        {
+          ROS_ERROR("Error reading stage reply: transfer status %d", transfer->status);
+        }
+
+      if (closing_ || transfer->status == LIBUSB_TRANSFER_NO_DEVICE
+          || libusb_submit_transfer(transfer) != 0)
+        {
+          transferDone();
+        }
+    }
+
+    if (have_packet && callback)
+      {
+        callback(packet);
+      }
+  }
+
+  void StageDevice::handleTelemetry(libusb_transfer* transfer)
+  {
+    TelemetryPacketWrapper_t packet;
+    ros::Time stamp;
+    bool have_packet = false;
+    TelemetryCallback callback;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (transfer->status == LIBUSB_TRANSFER_COMPLETED && protocol_version_ == 1
+          && transfer->actual_length >= (int)sizeof(TelemetryPacket16Wrapper_t))
+        {
+          TelemetryPacket16Wrapper_t narrow;
+          memcpy(&narrow, transfer->buffer, sizeof(narrow));
+          packet.Sequence = narrow.Sequence;
+          packet.Tick = narrow.Tick;
+          for (int motor_n = 0; motor_n < MOTOR_NUM; ++motor_n)
+            {
+              widenStatus(packet.MotorStatus[motor_n], narrow.MotorStatus[motor_n]);
+            }
+          have_packet = true;
+        }
+      else if (transfer->status == LIBUSB_TRANSFER_COMPLETED && protocol_version_ != 1
+               && transfer->actual_length >= (int)sizeof(packet))
+        {
+          memcpy(&packet, transfer->buffer, sizeof(packet));
+          have_packet = true;
+        }
+
+      if (have_packet)
+        {
+          stamp = telemetryStamp(packet);
+          callback = telemetry_callback_;
+        }
+      else if (transfer->status != LIBUSB_TRANSFER_CANCELLED && !closing_)
+        {
+          ROS_ERROR("Error reading stage telemetry: transfer status %d", transfer->status);
+        }
+
+      if (closing_ || transfer->status == LIBUSB_TRANSFER_NO_DEVICE
+          || libusb_submit_transfer(transfer) != 0)
+        {
+          transferDone();
+        }
+    }
+
+    if (have_packet && callback)
+      {
+        callback(packet, stamp);
+      }
+  }
+
+  ros::Time StageDevice::telemetryStamp(const TelemetryPacketWrapper_t& packet)
+  {
+    double board_time = packet.Tick/(double)SEGMENT_TICK_FREQ;
+    double offset = ros::Time::now().toSec() - board_time;
+
+    // Transfer delays only ever add to the offset, so keep the smallest
+    // one seen, letting it creep up only as fast as the clocks can drift.
+    // A tick count going backwards means the board was reset.
+    if (telemetry_samples_ == 0 || packet.Tick < telemetry_last_tick_)
+      {
+        telemetry_offset_ = offset;
+      }
+    else
+      {
+        double elapsed = (packet.Tick - telemetry_last_tick_)/(double)SEGMENT_TICK_FREQ;
+        telemetry_offset_ = std::min(offset, telemetry_offset_ + elapsed*TELEMETRY_CLOCK_DRIFT);
+        telemetry_dropped_ += (uint16_t)(packet.Sequence - telemetry_last_sequence_ - 1);
+      }
+    telemetry_last_tick_ = packet.Tick;
+    telemetry_last_sequence_ = packet.Sequence;
+    ++telemetry_samples_;
+
+    return ros::Time(telemetry_offset_ + board_time);
+  }
+
+  void StageDevice::transferDone()
+  {
+    --active_transfers_;
+    if (active_transfers_ == 0)
+      {
+        transfers_done_.notify_all();
+      }
+  }
+
+  void StageDevice::eventLoop()
+  {
+    while (!stop_events_)
+      {
+        timeval timeout;
+        timeout.tv_sec = 0;
+        timeout.tv_usec = 100000;
+        libusb_handle_events_timeout(context_, &timeout);
+      }
+  }
+
+  void StageDevice::recordLatency(double latency)
+  {
+    latencies_[latency_index_] = latency;
+    latency_index_ = (latency_index_ + 1) % latencies_.size();
+    latency_count_ = std::min(latency_count_ + 1, latencies_.size());
+  }
+
+  StageDevice::LatencyStats StageDevice::getLatencyStats(bool reset)
+  {
+    std::vector<double> latencies;
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      latencies.assign(latencies_.begin(), latencies_.begin() + latency_count_);
+      if (reset)
+        {
+          latency_index_ = 0;
+          latency_count_ = 0;
+        }
+    }
+
+    LatencyStats stats;
+    stats.count = latencies.size();
+    stats.p50 = stats.p90 = stats.p99 = stats.max = 0.0;
+    if (latencies.empty())
+      {
+        return stats;
+      }
+
+    std::sort(latencies.begin(), latencies.end());
+    stats.p50 = latencies[(latencies.size() - 1) * 50 / 100];
+    stats.p90 = latencies[(latencies.size() - 1) * 90 / 100];
+    stats.p99 = latencies[(latencies.size() - 1) * 99 / 100];
+    stats.max = latencies.back();
+    return stats;
+  }
+
+}
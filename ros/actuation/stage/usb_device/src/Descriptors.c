@@ -93,7 +93,7 @@ USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor =
       .InterfaceNumber        = 0x00,
       .AlternateSetting       = 0x00,
 
-      .TotalEndpoints         = 2,
+      .TotalEndpoints         = 3,
 
       .Class                  = 0x03,
       .SubClass               = 0x00,
@@ -120,6 +120,16 @@ USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor =
       .Attributes             = EP_TYPE_BULK,
       .EndpointSize           = OUT_EPSIZE,
       .PollingIntervalMS      = 0x00
+    },
+
+    .TelemetryINEndpoint =
+    {
+      .Header                 = {.Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint},
+
+      .EndpointAddress        = (ENDPOINT_DESCRIPTOR_DIR_IN | TELEMETRY_EPNUM),
+      .Attributes             = EP_TYPE_INTERRUPT,
+      .EndpointSize           = TELEMETRY_EPSIZE,
+      .PollingIntervalMS      = 0x01
     }
   };
 
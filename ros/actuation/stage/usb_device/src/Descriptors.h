@@ -52,6 +52,7 @@
                   USB_Descriptor_Interface_t            Interface;
                   USB_Descriptor_Endpoint_t             DataINEndpoint;
                   USB_Descriptor_Endpoint_t             DataOUTEndpoint;
+                  USB_Descriptor_Endpoint_t             TelemetryINEndpoint;
 		} USB_Descriptor_Configuration_t;
 
 	/* Macros: */
@@ -59,6 +60,8 @@
 		#define OUT_EPNUM    1
 		#define IN_EPSIZE    64
                 #define OUT_EPSIZE   64
+		#define TELEMETRY_EPNUM   3
+		#define TELEMETRY_EPSIZE  32
 
 	/* Function Prototypes: */
 		uint16_t CALLBACK_USB_GetDescriptor(const uint16_t wValue, const uint8_t wIndex, void** const DescriptorAddress)
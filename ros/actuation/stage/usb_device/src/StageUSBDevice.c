@@ -89,6 +89,29 @@ int main(void)
   /* Initialize Motors */
   Motor_Init();
 
+  /* Initialize trajectory segment buffer and tick */
+  Segment_Init();
+
+  /* No move yet */
+  Move.ID = 0;
+  Move.Status = MOVE_STATUS_IDLE;
+  Move.MotorMask = 0;
+  Move.NotifyPending = 0;
+  Move.NotifyID = 0;
+  Move.NotifyStatus = MOVE_STATUS_IDLE;
+
+  /* No line yet */
+  Line.Active = 0;
+
+  /* Not homed, no encoders */
+  Input_Init();
+
+  /* Telemetry off until the host asks for it */
+  Telemetry_Init();
+
+  /* No replies waiting */
+  Reply_Init();
+
   /* Scheduling - routine never returns, so put this last in the main function */
   Scheduler_Start();
 }
@@ -123,13 +146,23 @@ void EVENT_USB_Disconnect(void)
  */
 void EVENT_USB_ConfigurationChanged(void)
 {
-  /* Setup USB In and Out Endpoints */
+  /* A new host session, which may not know about newer protocols, and
+     has no use for replies meant for the last one */
+  ProtocolVersion = 1;
+  Reply_Init();
+
+  /* Setup USB In and Out Endpoints, double banked so a command can come
+     in and a reply go out while the other bank is in use */
   Endpoint_ConfigureEndpoint(OUT_EPNUM, EP_TYPE_BULK,
                              ENDPOINT_DIR_OUT, OUT_EPSIZE,
-                             ENDPOINT_BANK_SINGLE);
+                             ENDPOINT_BANK_DOUBLE);
 
   Endpoint_ConfigureEndpoint(IN_EPNUM, EP_TYPE_BULK,
                              ENDPOINT_DIR_IN, IN_EPSIZE,
+                             ENDPOINT_BANK_DOUBLE);
+
+  Endpoint_ConfigureEndpoint(TELEMETRY_EPNUM, EP_TYPE_INTERRUPT,
+                             ENDPOINT_DIR_IN, TELEMETRY_EPSIZE,
                              ENDPOINT_BANK_SINGLE);
 
   /* Indicate USB connected and ready */
@@ -172,11 +205,14 @@ TASK(USB_ProcessPacket)
   /* Check if the USB System is connected to a Host */
   if (USB_IsConnected)
     {
+      /* Replies first, making room to take in the next command */
+      USBPacket_Send();
+
       /* Select the Data Out Endpoint */
       Endpoint_SelectEndpoint(OUT_EPNUM);
 
-      /* Check if OUT Endpoint contains a packet */
-      if (Endpoint_IsOUTReceived())
+      /* Check if OUT Endpoint contains a packet and its reply can be queued */
+      if (Endpoint_IsOUTReceived() && Reply_Free())
         {
           /* Check to see if a command from the host has been issued */
           if (Endpoint_IsReadWriteAllowed())
@@ -189,6 +225,7 @@ TASK(USB_ProcessPacket)
 
               /* Return the same CommandID that was received */
               USBPacketIn.CommandID = USBPacketOut.CommandID;
+              USBPacketIn.SegmentsAccepted = 0;
 
               /* Process USB packet */
               switch (USBPacketOut.CommandID)
@@ -196,12 +233,14 @@ TASK(USB_ProcessPacket)
                 case USB_CMD_AVR_RESET:
                   {
                     USBPacket_Write();
+                    USBPacket_Flush();
                     AVR_RESET();
                   }
                   break;
                 case USB_CMD_AVR_DFU_MODE:
                   {
                     USBPacket_Write();
+                    USBPacket_Flush();
                     boot_key = DFU_BOOT_KEY_VAL;
                     AVR_RESET();
                   }
@@ -216,98 +255,382 @@ TASK(USB_ProcessPacket)
                       {
                       IO_Init();
                       }
+                    /* A direct setpoint takes over from any stream or move */
+                    Segment_Clear();
+                    Move_Abort();
+                    Line_Abort();
+                    Home_Abort();
                     for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
                       {
                         Motor[Motor_N].Update = (USBPacketOut.MotorUpdate & (1<<Motor_N));
                         if (Motor[Motor_N].Update)
                           {
-                            ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
-                            {
-                              if (USBPacketOut.Setpoint[Motor_N].Frequency > Motor[Motor_N].FrequencyMax)
-                                {
-                                  Motor[Motor_N].Frequency = Motor[Motor_N].FrequencyMax;
-                                }
-                              else
-                                {
-                                  Motor[Motor_N].Frequency = USBPacketOut.Setpoint[Motor_N].Frequency;
-                                }
-                              Motor[Motor_N].PositionSetPoint = USBPacketOut.Setpoint[Motor_N].Position;
-                              if (Motor[Motor_N].PositionSetPoint > Motor[Motor_N].Position)
-                                {
-                                  Motor[Motor_N].Direction = Motor[Motor_N].DirectionPos;
-                                }
-                              else if (Motor[Motor_N].PositionSetPoint < Motor[Motor_N].Position)
-                                {
-                                  Motor[Motor_N].Direction = Motor[Motor_N].DirectionNeg;
-                                }
-                              else
-                                {
-                                  Motor[Motor_N].Frequency = 0;
-                                }
-                            }
+                            Motor_SetPoint(Motor_N,&USBPacketOut.Setpoint[Motor_N]);
                           }
                       }
                       Motor_Update_All();
                   }
                   break;
+                case USB_CMD_STREAM_SEGMENTS:
+                  {
+                    if (!IO_Enabled)
+                      {
+                        IO_Init();
+                      }
+                    Move_Abort();
+                    Line_Abort();
+                    Home_Abort();
+                    USBPacketIn.SegmentsAccepted = Segment_PushPacket();
+                  }
+                  break;
+                case USB_CMD_STREAM_CLEAR:
+                  {
+                    Segment_Clear();
+                    Move_Abort();
+                    Line_Abort();
+                    Home_Abort();
+                  }
+                  break;
+                case USB_CMD_MOVE:
+                  {
+                    if (!IO_Enabled)
+                      {
+                        IO_Init();
+                      }
+                    Segment_Clear();
+                    Move_Abort();
+                    Line_Abort();
+                    Home_Abort();
+                    Home.LimitHit = 0;
+                    for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+                      {
+                        Motor[Motor_N].Update = (USBPacketOut.MotorUpdate & (1<<Motor_N));
+                        if (Motor[Motor_N].Update)
+                          {
+                            Motor_SetPoint(Motor_N,&USBPacketOut.Setpoint[Motor_N]);
+                          }
+                      }
+                    Motor_Update_All();
+                    Move.ID = USBPacketOut.MoveID;
+                    Move.MotorMask = USBPacketOut.MotorUpdate;
+                    Move.Status = MOVE_STATUS_MOVING;
+                  }
+                  break;
+                case USB_CMD_MOVE_LINE:
+                  {
+                    if (!IO_Enabled)
+                      {
+                        IO_Init();
+                      }
+                    Segment_Clear();
+                    Move_Abort();
+                    Line_Abort();
+                    Home_Abort();
+                    Home.LimitHit = 0;
+                    Line_Start(USBPacketOut.MotorUpdate,USBPacketOut.Setpoint);
+                    Move.ID = USBPacketOut.MoveID;
+                    Move.MotorMask = USBPacketOut.MotorUpdate;
+                    Move.Status = MOVE_STATUS_MOVING;
+                  }
+                  break;
+                case USB_CMD_HOME:
+                  {
+                    if (!IO_Enabled)
+                      {
+                        IO_Init();
+                      }
+                    Segment_Clear();
+                    Move_Abort();
+                    Line_Abort();
+                    Home_Abort();
+                    Home_Start(USBPacketOut.MotorUpdate,USBPacketOut.Setpoint);
+                    Move.ID = USBPacketOut.MoveID;
+                    Move.MotorMask = USBPacketOut.MotorUpdate;
+                    Move.Status = MOVE_STATUS_MOVING;
+                  }
+                  break;
+                case USB_CMD_SET_ENCODER:
+                  {
+                    if (!IO_Enabled)
+                      {
+                        IO_Init();
+                      }
+                    for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+                      {
+                        if (USBPacketOut.MotorUpdate & (1<<Motor_N))
+                          {
+                            Encoder_Configure(Motor_N,&USBPacketOut.Encoder[Motor_N]);
+                          }
+                      }
+                  }
+                  break;
+                case USB_CMD_SET_ACCELERATION:
+                  {
+                    for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+                      {
+                        if (USBPacketOut.MotorUpdate & (1<<Motor_N))
+                          {
+                            Motor_SetAcceleration(Motor_N,USBPacketOut.Acceleration[Motor_N]);
+                          }
+                      }
+                  }
+                  break;
+                case USB_CMD_SET_TELEMETRY:
+                  {
+                    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+                    {
+                      Telemetry.Period = USBPacketOut.TelemetryPeriod;
+                      Telemetry.TicksLeft = Telemetry.Period;
+                      Telemetry.Ready = 0;
+                    }
+                  }
+                  break;
+                case USB_CMD_PROTOCOL_VERSION:
+                  {
+                    /* Settle on the highest version both ends know, the
+                       reply goes out in its own format */
+                    ProtocolVersion = USBPacketOut.ProtocolVersion;
+                    if (ProtocolVersion > PROTOCOL_VERSION_MAX)
+                      {
+                        ProtocolVersion = PROTOCOL_VERSION_MAX;
+                      }
+                    else if (ProtocolVersion < 1)
+                      {
+                        ProtocolVersion = 1;
+                      }
+                  }
+                  break;
                 default:
                   {
                   }
                 }
 
               /* Write the return USB packet */
-              for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
-                {
-                  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
-                  {
-                    USBPacketIn.MotorStatus[Motor_N].Frequency = Motor[Motor_N].Frequency;
-                    USBPacketIn.MotorStatus[Motor_N].Position = Motor[Motor_N].Position;
-                  }
-                }
+              Move_Check();
+              USBPacket_SetStatus();
               USBPacket_Write();
 
               /* Indicate ready */
               LEDs_SetAllLEDs(LEDS_LED2 | LEDS_LED4);
             }
         }
+
+      /* Report finished moves without waiting to be asked */
+      Home_Check();
+      Encoder_Check();
+      Move_Check();
+      if (Move.NotifyPending && Reply_Free())
+        {
+          USBPacketIn.CommandID = USB_CMD_MOVE_DONE;
+          USBPacketIn.SegmentsAccepted = 0;
+          USBPacket_SetStatus();
+          USBPacketIn.MoveID = Move.NotifyID;
+          USBPacketIn.MoveStatus = Move.NotifyStatus;
+          USBPacket_Write();
+          Move.NotifyPending = 0;
+        }
+
+      USBPacket_Send();
+      Telemetry_Send();
     }
 }
 
 static void USBPacket_Read(void)
 {
   uint8_t* USBPacketOutPtr = (uint8_t*)&USBPacketOut;
+  uint8_t  USBPacketOutSize = sizeof(USBPacketOut);
+
+  if (ProtocolVersion == 1)
+    {
+      USBPacketOutPtr = (uint8_t*)&USBPacketOut16;
+      USBPacketOutSize = sizeof(USBPacketOut16);
+    }
 
   /* Select the Data Out endpoint */
   Endpoint_SelectEndpoint(OUT_EPNUM);
 
   /* Read in USB packet header */
-  Endpoint_Read_Stream_LE(USBPacketOutPtr, sizeof(USBPacketOut));
+  Endpoint_Read_Stream_LE(USBPacketOutPtr, USBPacketOutSize);
 
   /* Finalize the stream transfer to send the last packet */
   Endpoint_ClearOUT();
+
+  if (ProtocolVersion == 1)
+    {
+      /* Widen into USBPacketOut, except segments, which Segment_PushPacket
+         widens one at a time */
+      USBPacketOut.CommandID = USBPacketOut16.CommandID;
+      USBPacketOut.MotorUpdate = USBPacketOut16.MotorUpdate;
+      if ((USBPacketOut.CommandID == USB_CMD_SET_STATE) || (USBPacketOut.CommandID == USB_CMD_MOVE) ||
+          (USBPacketOut.CommandID == USB_CMD_MOVE_LINE) || (USBPacketOut.CommandID == USB_CMD_HOME))
+        {
+          for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+            {
+              MotorStatus_Widen(&USBPacketOut.Setpoint[Motor_N],&USBPacketOut16.Setpoint[Motor_N]);
+            }
+          USBPacketOut.MoveID = USBPacketOut16.MoveID;
+        }
+      else
+        {
+          memcpy(USBPacketOut.Acceleration,USBPacketOut16.Acceleration,sizeof(USBPacketOut.Acceleration));
+        }
+    }
+}
+
+static void USBPacket_SetStatus(void)
+{
+  for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+    {
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+      {
+        USBPacketIn.MotorStatus[Motor_N].Frequency = Motor[Motor_N].Frequency;
+        USBPacketIn.MotorStatus[Motor_N].Position = Motor[Motor_N].Position;
+      }
+    }
+  USBPacketIn.SegmentsFree = Segment_Free();
+  USBPacketIn.MoveID = Move.ID;
+  USBPacketIn.MoveStatus = Move.Status;
+  USBPacketIn.LimitStatus = Limit_Status();
+  USBPacketIn.Homed = Home.Homed;
+  USBPacketIn.StepLoss = Home.StepLoss;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    USBPacketIn.TicksDropped = TicksDropped;
+  }
+  for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+    {
+      USBPacketIn.EncoderCount[Motor_N] = 0;
+      if (Motor_N < ENCODER_NUM)
+        {
+          ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+          {
+            USBPacketIn.EncoderCount[Motor_N] = Encoder.Count[Motor_N];
+          }
+        }
+    }
 }
 
+/* Queue USBPacketIn as a reply, in the wire format of the protocol
+   version in use.  Only call with Reply_Free() nonzero. */
 static void USBPacket_Write(void)
 {
-  uint8_t* USBPacketInPtr = (uint8_t*)&USBPacketIn;
+  ReplyWrapper_t *Reply = &ReplyQueue.Reply[ReplyQueue.Head & (REPLY_QUEUE_SIZE-1)];
+  USBPacketIn16Wrapper_t    *USBPacketIn16 = (USBPacketIn16Wrapper_t*)Reply->Data;
+  USBPacketVersionWrapper_t *USBPacketVersion = (USBPacketVersionWrapper_t*)Reply->Data;
+
+  if (USBPacketIn.CommandID == USB_CMD_PROTOCOL_VERSION)
+    {
+      USBPacketVersion->CommandID = USBPacketIn.CommandID;
+      USBPacketVersion->Magic = PROTOCOL_MAGIC;
+      USBPacketVersion->ProtocolVersion = ProtocolVersion;
+      USBPacketVersion->ProtocolVersionMax = PROTOCOL_VERSION_MAX;
+      Reply->Size = sizeof(USBPacketVersionWrapper_t);
+    }
+  else if (ProtocolVersion == 1)
+    {
+      USBPacketIn16->CommandID = USBPacketIn.CommandID;
+      for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+        {
+          MotorStatus_Narrow(&USBPacketIn16->MotorStatus[Motor_N],&USBPacketIn.MotorStatus[Motor_N]);
+        }
+      USBPacketIn16->SegmentsFree = USBPacketIn.SegmentsFree;
+      USBPacketIn16->SegmentsAccepted = USBPacketIn.SegmentsAccepted;
+      USBPacketIn16->MoveID = USBPacketIn.MoveID;
+      USBPacketIn16->MoveStatus = USBPacketIn.MoveStatus;
+      Reply->Size = sizeof(USBPacketIn16Wrapper_t);
+    }
+  else
+    {
+      memcpy(Reply->Data,&USBPacketIn,sizeof(USBPacketIn));
+      if (ProtocolVersion >= 5)
+        {
+          Reply->Size = sizeof(USBPacketIn);
+        }
+      else if (ProtocolVersion == 4)
+        {
+          Reply->Size = USBPACKETIN_V4_SIZE;
+        }
+      else
+        {
+          Reply->Size = USBPACKETIN_V2_SIZE;
+        }
+    }
+  ReplyQueue.Head++;
+}
+
+/* Send queued replies while the IN endpoint has a free bank, without
+   ever waiting on the host */
+static void USBPacket_Send(void)
+{
+  ReplyWrapper_t *Reply;
 
   /* Select the Data In endpoint */
   Endpoint_SelectEndpoint(IN_EPNUM);
 
-  /* Wait until read/write to IN data endpoint allowed */
-  while (!(Endpoint_IsReadWriteAllowed() && Endpoint_IsINReady()));
+  while ((ReplyQueue.Head != ReplyQueue.Tail) && Endpoint_IsReadWriteAllowed() && Endpoint_IsINReady())
+    {
+      Reply = &ReplyQueue.Reply[ReplyQueue.Tail & (REPLY_QUEUE_SIZE-1)];
 
-  /* Write the return data to the endpoint */
-  Endpoint_Write_Stream_LE(USBPacketInPtr, sizeof(USBPacketIn));
+      /* Write the return data to the endpoint */
+      Endpoint_Write_Stream_LE(Reply->Data, Reply->Size);
 
-  /* Finalize the stream transfer to send the last packet */
-  Endpoint_ClearIN();
+      /* Finalize the stream transfer to send the last packet */
+      Endpoint_ClearIN();
+      ReplyQueue.Tail++;
+    }
+}
+
+/* Send every queued reply, waiting on the host, before a reset */
+static void USBPacket_Flush(void)
+{
+  while (ReplyQueue.Head != ReplyQueue.Tail)
+    {
+      USBPacket_Send();
+    }
+}
+
+static void Reply_Init(void)
+{
+  ReplyQueue.Head = 0;
+  ReplyQueue.Tail = 0;
+}
+
+static uint8_t Reply_Free(void)
+{
+  return REPLY_QUEUE_SIZE - (uint8_t)(ReplyQueue.Head - ReplyQueue.Tail);
+}
+
+/* Version 1 positions wrap at 16 bits, as they always have */
+static void MotorStatus_Narrow(MotorStatus16_t *Narrow, MotorStatus_t *Status)
+{
+  Narrow->Frequency = (Status->Frequency > 0xFFFF) ? 0xFFFF : (uint16_t)Status->Frequency;
+  Narrow->Position = (uint16_t)Status->Position;
+}
+
+static void MotorStatus_Widen(MotorStatus_t *Status, MotorStatus16_t *Narrow)
+{
+  Status->Frequency = Narrow->Frequency;
+  Status->Position = Narrow->Position;
 }
 
 static void IO_Init(void)
 {
   /* Input lines initialization */
 
+  /* Limit switches on PORTD pins 0:2, pulled up, pressed low */
+  DDRD &= ~((1<<MOTOR_0_LIMIT_PIN) | (1<<MOTOR_1_LIMIT_PIN) | (1<<MOTOR_2_LIMIT_PIN));
+  PORTD |= ((1<<MOTOR_0_LIMIT_PIN) | (1<<MOTOR_1_LIMIT_PIN) | (1<<MOTOR_2_LIMIT_PIN));
+
+  /* Encoders on PORTE pins 4:7, pulled up, off until configured */
+  DDRE &= ~((1<<PE4) | (1<<PE5) | (1<<PE6) | (1<<PE7));
+  PORTE |= ((1<<PE4) | (1<<PE5) | (1<<PE6) | (1<<PE7));
+
+  /* Interrupt on any change of a limit switch */
+  EICRA = ((1<<ISC00) | (1<<ISC10) | (1<<ISC20));
+  EICRB = ((1<<ISC40) | (1<<ISC50) | (1<<ISC60) | (1<<ISC70));
+  EIFR = ((1<<INTF0) | (1<<INTF1) | (1<<INTF2));
+  EIMSK |= ((1<<INT0) | (1<<INT1) | (1<<INT2));
+
 
   /* Output lines initialization */
 
@@ -370,22 +693,34 @@ static void Timer_Init(void)
   Timer[0].Address.TOP = (uint16_t*)&OCR0A;
   Timer[0].Address.ClockSelect = &TCCR0B;
   Timer[0].Address.PinPort = &PINB;
+  Timer[0].Address.OutputPort = &PORTB;
+  Timer[0].Address.OutputControl = &TCCR0A;
   Timer[0].OutputPin = DDB7;
+  Timer[0].OutputCompare = (1<<COM0A0);
 
   Timer[1].Address.TOP = &OCR1A;
   Timer[1].Address.ClockSelect = &TCCR1B;
   Timer[1].Address.PinPort = &PINB;
+  Timer[1].Address.OutputPort = &PORTB;
+  Timer[1].Address.OutputControl = &TCCR1A;
   Timer[1].OutputPin = DDB5;
+  Timer[1].OutputCompare = (1<<COM1A0);
 
   Timer[2].Address.TOP = (uint16_t*)&OCR2A;
   Timer[2].Address.ClockSelect = &TCCR2B;
   Timer[2].Address.PinPort = &PINB;
+  Timer[2].Address.OutputPort = &PORTB;
+  Timer[2].Address.OutputControl = &TCCR2A;
   Timer[2].OutputPin = DDB4;
+  Timer[2].OutputCompare = (1<<COM2A0);
 
   Timer[3].Address.TOP = &OCR3A;
   Timer[3].Address.ClockSelect = &TCCR3B;
   Timer[3].Address.PinPort = &PINC;
+  Timer[3].Address.OutputPort = &PORTC;
+  Timer[3].Address.OutputControl = &TCCR3A;
   Timer[3].OutputPin = DDC6;
+  Timer[3].OutputCompare = (1<<COM3A0);
 
   /* Store ClockSelect Values for each Prescaler_N */
   Timer[0].ClockSelect[0] = (1<<CS00);
@@ -436,6 +771,7 @@ static void Motor_Init(void)
   Motor[0].Timer = MOTOR_0_TIMER;
   Motor[0].DirectionPort = &PORTC;
   Motor[0].DirectionPin = PC0;
+  Motor[0].LimitPin = MOTOR_0_LIMIT_PIN;
   Motor[0].Frequency = 0;
   Motor[0].FrequencyMax = MOTOR_0_FREQUENCY_MAX;
   Motor[0].Direction = 0;
@@ -443,11 +779,19 @@ static void Motor_Init(void)
   Motor[0].DirectionNeg = MOTOR_0_DIRECTION_NEG;
   Motor[0].Position = MOTOR_0_POSITION_HOME;
   Motor[0].PositionSetPoint = MOTOR_0_POSITION_HOME;
+  Motor[0].PositionHome = MOTOR_0_POSITION_HOME;
   Motor[0].Update = 1;
+  Motor[0].FrequencyTarget = 0;
+  Motor[0].DirectionTarget = 0;
+  Motor[0].Acceleration = 0;
+  Motor[0].RampFrequency = 0;
+  Motor[0].BrakeScale = 0;
+  Motor[0].BrakeLimit = 0;
 
   Motor[1].Timer = MOTOR_1_TIMER;
   Motor[1].DirectionPort = &PORTC;
   Motor[1].DirectionPin = PC1;
+  Motor[1].LimitPin = MOTOR_1_LIMIT_PIN;
   Motor[1].Frequency = 0;
   Motor[1].FrequencyMax = MOTOR_1_FREQUENCY_MAX;
   Motor[1].Direction = 0;
@@ -455,11 +799,19 @@ static void Motor_Init(void)
   Motor[1].DirectionNeg = MOTOR_1_DIRECTION_NEG;
   Motor[1].Position = MOTOR_1_POSITION_HOME;
   Motor[1].PositionSetPoint = MOTOR_1_POSITION_HOME;
+  Motor[1].PositionHome = MOTOR_1_POSITION_HOME;
   Motor[1].Update = 1;
+  Motor[1].FrequencyTarget = 0;
+  Motor[1].DirectionTarget = 0;
+  Motor[1].Acceleration = 0;
+  Motor[1].RampFrequency = 0;
+  Motor[1].BrakeScale = 0;
+  Motor[1].BrakeLimit = 0;
 
   Motor[2].Timer = MOTOR_2_TIMER;
   Motor[2].DirectionPort = &PORTC;
   Motor[2].DirectionPin = PC2;
+  Motor[2].LimitPin = MOTOR_2_LIMIT_PIN;
   Motor[2].Frequency = 0;
   Motor[2].FrequencyMax = MOTOR_2_FREQUENCY_MAX;
   Motor[2].Direction = 0;
@@ -467,7 +819,14 @@ static void Motor_Init(void)
   Motor[2].DirectionNeg = MOTOR_2_DIRECTION_NEG;
   Motor[2].Position = MOTOR_2_POSITION_HOME;
   Motor[2].PositionSetPoint = MOTOR_2_POSITION_HOME;
+  Motor[2].PositionHome = MOTOR_2_POSITION_HOME;
   Motor[2].Update = 1;
+  Motor[2].FrequencyTarget = 0;
+  Motor[2].DirectionTarget = 0;
+  Motor[2].Acceleration = 0;
+  Motor[2].RampFrequency = 0;
+  Motor[2].BrakeScale = 0;
+  Motor[2].BrakeLimit = 0;
 
   /* Update Motors */
   Motor_Update_All();
@@ -504,6 +863,7 @@ static void Timer_Off(uint8_t Timer_N)
 
 static void Motor_Update(uint8_t Motor_N)
 {
+  uint32_t TOPUnscaled;
   uint32_t TOPValue;
   uint8_t  Prescaler_N;
   uint16_t Prescaler=1;
@@ -516,6 +876,28 @@ static void Motor_Update(uint8_t Motor_N)
     Freq = Motor[Motor_N].Frequency;
   }
 
+  /* Leave Frequency alone too, the motor and tick interrupts may change it */
+  if (!Motor[Motor_N].Update)
+    {
+      return;
+    }
+
+  /* Never start toward a limit switch that is pressed */
+  if ((Freq > 0) && (Motor[Motor_N].Direction == Motor[Motor_N].DirectionNeg) && Limit_Pressed(Motor_N))
+    {
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+      {
+        Motor[Motor_N].Frequency = 0;
+        Motor[Motor_N].FrequencyTarget = 0;
+        Motor[Motor_N].RampFrequency = 0;
+        if (Home.Phase[Motor_N] == HOME_IDLE)
+          {
+            Home.LimitHit |= (1<<Motor_N);
+          }
+      }
+      Freq = 0;
+    }
+
   Timer_N = Motor[Motor_N].Timer;
   if (Motor[Motor_N].Update && (Freq == 0) && Timer[Timer_N].OnOff)
     {
@@ -528,20 +910,24 @@ static void Motor_Update(uint8_t Motor_N)
           Freq = Motor[Motor_N].FrequencyMax;
         }
       ScaleFactor = Timer[Timer_N].ScaleFactor;
-      TOPValue = (uint32_t)F_CLOCK/(ScaleFactor*(uint32_t)Freq);
+      TOPUnscaled = (uint32_t)F_CLOCK/(ScaleFactor*(uint32_t)Freq);
+      TOPValue = TOPUnscaled;
       Prescaler_N = 0;
+      /* The prescalers are powers of 2, so this is the division by each
+         of them, without dividing again every time */
       while ((TOPValue > Timer[Timer_N].TOPMax) && (Prescaler_N < (PRESCALER_NUM-1)))
         {
           Prescaler_N++;
           if (Timer_N == 2)
             {
               Prescaler = PrescalerArray8[Prescaler_N];
+              TOPValue = TOPUnscaled >> PrescalerShift8[Prescaler_N];
             }
           else
             {
               Prescaler = PrescalerArray16[Prescaler_N];
+              TOPValue = TOPUnscaled >> PrescalerShift16[Prescaler_N];
             }
-          TOPValue = (uint32_t)F_CLOCK/((uint32_t)Freq*(uint32_t)ScaleFactor*Prescaler);
           if ((Prescaler_N == (PRESCALER_NUM-1)) && (TOPValue > Timer[Timer_N].TOPMax))
             {
               TOPValue = Timer[Timer_N].TOPMax;
@@ -596,79 +982,404 @@ static void Motor_Update_All(void)
     }
 }
 
-/*
-  static void Position_Update(volatile uint8_t Motor_N)
-  {
-  uint8_t Timer_N;
-
-  Timer_N = Motor[Motor_N].Timer;
-  if (*Timer[Timer_N].Address.PinPort & (1<<Timer[Timer_N].OutputPin))
-  {
-  if (Motor[Motor_N].Direction == Motor[Motor_N].DirectionPos)
-  {
-  Motor[Motor_N].Position += 1;
-  }
-  else
-  {
-  Motor[Motor_N].Position -= 1;
-  }
-  if (Motor[Motor_N].Position == Motor[Motor_N].PositionSetPoint)
+static void Motor_SetPoint(uint8_t Motor_N, MotorStatus_t *Setpoint)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
   {
-  Motor[Motor_N].Frequency = 0;
-  Timer_Off(Motor[Motor_N].Timer);
-  }
-  }
+    if (Motor[Motor_N].Acceleration && (Setpoint->Frequency == 0))
+      {
+        /* Ramp down to a stop, still bounded by the old setpoint */
+        Motor[Motor_N].FrequencyTarget = 0;
+      }
+    else
+      {
+        if (Setpoint->Frequency > Motor[Motor_N].FrequencyMax)
+          {
+            Motor[Motor_N].FrequencyTarget = Motor[Motor_N].FrequencyMax;
+          }
+        else
+          {
+            Motor[Motor_N].FrequencyTarget = Setpoint->Frequency;
+          }
+        Motor[Motor_N].PositionSetPoint = Setpoint->Position;
+        if (Motor[Motor_N].PositionSetPoint > Motor[Motor_N].Position)
+          {
+            Motor[Motor_N].DirectionTarget = Motor[Motor_N].DirectionPos;
+          }
+        else if (Motor[Motor_N].PositionSetPoint < Motor[Motor_N].Position)
+          {
+            Motor[Motor_N].DirectionTarget = Motor[Motor_N].DirectionNeg;
+          }
+        else
+          {
+            Motor[Motor_N].FrequencyTarget = 0;
+          }
+      }
+
+    if (Motor[Motor_N].Acceleration)
+      {
+        /* Motor_Ramp gets there from the tick interrupt */
+        Motor[Motor_N].Update = 0;
+      }
+    else
+      {
+        Motor[Motor_N].Frequency = Motor[Motor_N].FrequencyTarget;
+        Motor[Motor_N].Direction = Motor[Motor_N].DirectionTarget;
+      }
   }
+}
 
-  ISR(MOTOR_0_INTERRUPT)
+static void Motor_SetAcceleration(uint8_t Motor_N, uint16_t Acceleration)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
   {
-  Position_Update(0);
-  return;
+    if (Acceleration && !Motor[Motor_N].Acceleration)
+      {
+        /* Ramp on from wherever the motor is now */
+        Motor[Motor_N].RampFrequency = Motor[Motor_N].Frequency;
+      }
+    else if (!Acceleration && Motor[Motor_N].Acceleration)
+      {
+        /* Jump to where the ramp was headed */
+        Motor[Motor_N].Frequency = Motor[Motor_N].FrequencyTarget;
+        Motor[Motor_N].Direction = Motor[Motor_N].DirectionTarget;
+        Motor[Motor_N].Update = 1;
+      }
+    Motor[Motor_N].Acceleration = Acceleration;
+    /* Divided out here, so the ramp only multiplies */
+    Motor[Motor_N].BrakeScale = (uint32_t)2*SEGMENT_TICK_FREQ*Acceleration;
+    Motor[Motor_N].BrakeLimit = Acceleration ? (0xFFFFFFFF/Motor[Motor_N].BrakeScale) : 0;
   }
 
-  ISR(MOTOR_1_INTERRUPT)
+  Motor_Update(Motor_N);
+}
+
+static void Motor_Stop(uint8_t Motor_N)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
   {
-  Position_Update(1);
-  return;
+    Motor[Motor_N].FrequencyTarget = 0;
+    if (!Motor[Motor_N].Acceleration)
+      {
+        Motor[Motor_N].Frequency = 0;
+        Motor[Motor_N].Update = 1;
+      }
   }
+  Motor_Update(Motor_N);
+}
 
-  ISR(MOTOR_2_INTERRUPT)
+/* Trapezoidal velocity profile, run once per segment tick for motors with
+   an Acceleration.  RampFrequency moves toward FrequencyTarget by at most
+   Acceleration per tick, comes down early enough to reach the position
+   setpoint at the start frequency, and comes down to zero before the
+   motor reverses.  The start frequency is one tick's worth of
+   acceleration. */
+static void Motor_Ramp(uint8_t Motor_N)
+{
+  uint16_t Accel;
+  uint16_t Freq;
+  uint16_t Target;
+  uint32_t Remaining;
+  uint8_t  Direction;
+
+  Accel = Motor[Motor_N].Acceleration;
+  if (Accel == 0)
+    {
+      return;
+    }
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
   {
-  Position_Update(2);
-  return;
+    /* The motor interrupt stops the timer at the setpoint */
+    if (Motor[Motor_N].Frequency == 0)
+      {
+        Motor[Motor_N].RampFrequency = 0;
+      }
+    if (Motor[Motor_N].PositionSetPoint > Motor[Motor_N].Position)
+      {
+        Remaining = Motor[Motor_N].PositionSetPoint - Motor[Motor_N].Position;
+      }
+    else
+      {
+        Remaining = Motor[Motor_N].Position - Motor[Motor_N].PositionSetPoint;
+      }
   }
-*/
 
-ISR(MOTOR_0_INTERRUPT)
-{
-  if (PINB & (1<<DDB5))
+  Freq = Motor[Motor_N].RampFrequency;
+  Direction = Motor[Motor_N].Direction;
+  if (Freq == 0)
     {
-      if (Motor[0].Direction == Motor[0].DirectionPos)
-        {
-          Motor[0].Position += 1;
-        }
-      else
-        {
-          Motor[0].Position -= 1;
-        }
-      if (Motor[0].Position == Motor[0].PositionSetPoint)
+      /* Stopped, so free to turn around */
+      Direction = Motor[Motor_N].DirectionTarget;
+    }
+
+  if ((Remaining == 0) || (Motor[Motor_N].FrequencyTarget == 0) ||
+      (Direction != Motor[Motor_N].DirectionTarget))
+    {
+      Target = 0;
+    }
+  else
+    {
+      Target = Motor[Motor_N].FrequencyTarget;
+      if (Freq > 0)
         {
-          Motor[0].Frequency = 0;
-          Timer_Off(Motor[0].Timer);
-          /* Add this to test drift problem... */
-          *Motor[0].DirectionPort &= ~(1<<Motor[0].DirectionPin);
+          /* Steps to stop from Freq: Freq^2/(2*Accel*SEGMENT_TICK_FREQ),
+             compared without dividing, as this runs every tick */
+          if ((Remaining <= Motor[Motor_N].BrakeLimit) &&
+              (Remaining*Motor[Motor_N].BrakeScale <= (uint32_t)Freq*Freq) && (Target > Accel))
+            {
+              Target = Accel;
+            }
         }
     }
-  return;
+
+  if (Freq < Target)
+    {
+      Freq = ((Target - Freq) > Accel) ? (Freq + Accel) : Target;
+    }
+  else if (Freq > Target)
+    {
+      Freq = ((Freq - Target) > Accel) ? (Freq - Accel) : Target;
+    }
+
+  if ((Freq != Motor[Motor_N].RampFrequency) || (Direction != Motor[Motor_N].Direction))
+    {
+      Motor[Motor_N].RampFrequency = Freq;
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+      {
+        Motor[Motor_N].Frequency = Freq;
+        Motor[Motor_N].Direction = Direction;
+      }
+      Motor[Motor_N].Update = 1;
+      Motor_Update(Motor_N);
+    }
 }
 
-ISR(MOTOR_1_INTERRUPT)
+static void Segment_Init(void)
 {
-  if (PINC & (1<<DDC6))
-    {
-      if (Motor[1].Direction == Motor[1].DirectionPos)
-        {
-          Motor[1].Position += 1;
+  SegmentBuffer.Head = 0;
+  SegmentBuffer.Tail = 0;
+  SegmentBuffer.TicksLeft = 0;
+  SegmentBuffer.Running = 0;
+  SegmentBuffer.Hold = 0;
+  SegmentBuffer.MotorMask = 0;
+
+  /* Timer 0 does not drive a motor, so it runs the segment tick */
+  /* Set CTC Mode on Timer 0, OC0A/OC0B disconnected */
+  /* Top @ OCR0A, Tick @ SEGMENT_TICK_FREQ */
+  TCCR0A = (1<<WGM01);
+  TCCR0B = 0;
+  OCR0A = (uint8_t)(F_CLOCK/((uint32_t)SEGMENT_TICK_PRESCALER*SEGMENT_TICK_FREQ) - 1);
+  TIMSK0 = (1<<OCIE0A);
+  TCCR0B = ((1<<CS01)|(1<<CS00));
+}
+
+static uint8_t Segment_Free(void)
+{
+  return SEGMENT_BUFFER_SIZE - (uint8_t)(SegmentBuffer.Head - SegmentBuffer.Tail);
+}
+
+static uint8_t Segment_Push(SegmentWrapper_t *Segment)
+{
+  if (Segment_Free() == 0)
+    {
+      return 0;
+    }
+
+  /* Only the tick interrupt reads the slot, and only once Head moves past it */
+  memcpy(&SegmentBuffer.Segment[SegmentBuffer.Head & (SEGMENT_BUFFER_SIZE-1)],Segment,sizeof(SegmentWrapper_t));
+  SegmentBuffer.Head++;
+  return 1;
+}
+
+/* Queue as many segments of the packet as fit, the host resends the rest */
+static uint8_t Segment_PushPacket(void)
+{
+  SegmentWrapper_t Segment;
+  uint8_t Accepted = 0;
+
+  if (ProtocolVersion == 1)
+    {
+      while ((Accepted < USBPacketOut16.SegmentCount) && (Accepted < SEGMENT16_PACKET_NUM))
+        {
+          Segment.MotorUpdate = USBPacketOut16.Segment[Accepted].MotorUpdate;
+          Segment.Duration = USBPacketOut16.Segment[Accepted].Duration;
+          for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+            {
+              MotorStatus_Widen(&Segment.Setpoint[Motor_N],&USBPacketOut16.Segment[Accepted].Setpoint[Motor_N]);
+            }
+          if (!Segment_Push(&Segment))
+            {
+              break;
+            }
+          Accepted++;
+        }
+    }
+  else
+    {
+      while ((Accepted < USBPacketOut.SegmentCount) && (Accepted < SEGMENT_PACKET_NUM) &&
+             Segment_Push(&USBPacketOut.Segment[Accepted]))
+        {
+          Accepted++;
+        }
+    }
+  return Accepted;
+}
+
+static void Segment_Clear(void)
+{
+  uint8_t MotorMask;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    SegmentBuffer.Tail = SegmentBuffer.Head;
+    SegmentBuffer.TicksLeft = 0;
+    SegmentBuffer.Running = 0;
+    SegmentBuffer.Hold = 0;
+    MotorMask = SegmentBuffer.MotorMask;
+    SegmentBuffer.MotorMask = 0;
+  }
+
+  /* The tick interrupt is idle from here on, so the motors are ours */
+  Segment_StopMotors(MotorMask);
+}
+
+static void Segment_StopMotors(uint8_t MotorMask)
+{
+  for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+    {
+      if (MotorMask & (1<<Motor_N))
+        {
+          Motor_Stop(Motor_N);
+        }
+    }
+}
+
+static void Segment_Tick(void)
+{
+  SegmentWrapper_t *Segment;
+
+  if (SegmentBuffer.Running)
+    {
+      if (SegmentBuffer.Hold)
+        {
+          if (SegmentBuffer.Head == SegmentBuffer.Tail)
+            {
+              return;
+            }
+        }
+      else if (--SegmentBuffer.TicksLeft > 0)
+        {
+          return;
+        }
+    }
+
+  if (SegmentBuffer.Head == SegmentBuffer.Tail)
+    {
+      /* Ran dry: stop rather than keep running open loop */
+      if (SegmentBuffer.Running)
+        {
+          SegmentBuffer.Running = 0;
+          Segment_StopMotors(SegmentBuffer.MotorMask);
+          SegmentBuffer.MotorMask = 0;
+        }
+      return;
+    }
+
+  Segment = &SegmentBuffer.Segment[SegmentBuffer.Tail & (SEGMENT_BUFFER_SIZE-1)];
+  for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+    {
+      Motor[Motor_N].Update = (Segment->MotorUpdate & (1<<Motor_N));
+      if (Motor[Motor_N].Update)
+        {
+          Motor_SetPoint(Motor_N,&Segment->Setpoint[Motor_N]);
+          Motor_Update(Motor_N);
+        }
+    }
+  SegmentBuffer.MotorMask |= Segment->MotorUpdate;
+  SegmentBuffer.TicksLeft = Segment->Duration;
+  SegmentBuffer.Hold = (Segment->Duration == 0);
+  SegmentBuffer.Running = 1;
+  SegmentBuffer.Tail++;
+}
+
+/*
+  static void Position_Update(volatile uint8_t Motor_N)
+  {
+  uint8_t Timer_N;
+
+  Timer_N = Motor[Motor_N].Timer;
+  if (*Timer[Timer_N].Address.PinPort & (1<<Timer[Timer_N].OutputPin))
+  {
+  if (Motor[Motor_N].Direction == Motor[Motor_N].DirectionPos)
+  {
+  Motor[Motor_N].Position += 1;
+  }
+  else
+  {
+  Motor[Motor_N].Position -= 1;
+  }
+  if (Motor[Motor_N].Position == Motor[Motor_N].PositionSetPoint)
+  {
+  Motor[Motor_N].Frequency = 0;
+  Timer_Off(Motor[Motor_N].Timer);
+  }
+  }
+  }
+
+  ISR(MOTOR_0_INTERRUPT)
+  {
+  Position_Update(0);
+  return;
+  }
+
+  ISR(MOTOR_1_INTERRUPT)
+  {
+  Position_Update(1);
+  return;
+  }
+
+  ISR(MOTOR_2_INTERRUPT)
+  {
+  Position_Update(2);
+  return;
+  }
+*/
+
+ISR(MOTOR_0_INTERRUPT)
+{
+  if (PINB & (1<<DDB5))
+    {
+      if (Motor[0].Direction == Motor[0].DirectionPos)
+        {
+          Motor[0].Position += 1;
+        }
+      else
+        {
+          Motor[0].Position -= 1;
+        }
+      if (Motor[0].Position == Motor[0].PositionSetPoint)
+        {
+          Motor[0].Frequency = 0;
+          Timer_Off(Motor[0].Timer);
+          /* Add this to test drift problem... */
+          *Motor[0].DirectionPort &= ~(1<<Motor[0].DirectionPin);
+        }
+    }
+  if (Line.Active && (Line.Lead == 0))
+    {
+      Line_Step(PINB & (1<<DDB5));
+    }
+  return;
+}
+
+ISR(MOTOR_1_INTERRUPT)
+{
+  if (PINC & (1<<DDC6))
+    {
+      if (Motor[1].Direction == Motor[1].DirectionPos)
+        {
+          Motor[1].Position += 1;
         }
       else
         {
@@ -682,6 +1393,10 @@ ISR(MOTOR_1_INTERRUPT)
           *Motor[1].DirectionPort &= ~(1<<Motor[1].DirectionPin);
         }
     }
+  if (Line.Active && (Line.Lead == 1))
+    {
+      Line_Step(PINC & (1<<DDC6));
+    }
   return;
 }
 
@@ -705,5 +1420,785 @@ ISR(MOTOR_2_INTERRUPT)
           *Motor[2].DirectionPort &= ~(1<<Motor[2].DirectionPin);
         }
     }
+  if (Line.Active && (Line.Lead == 2))
+    {
+      Line_Step(PINB & (1<<DDB4));
+    }
   return;
 }
+
+ISR(INT0_vect)
+{
+  Limit_Change(0);
+}
+
+ISR(INT1_vect)
+{
+  Limit_Change(1);
+}
+
+ISR(INT2_vect)
+{
+  Limit_Change(2);
+}
+
+ISR(INT4_vect)
+{
+  Encoder_Update(0,(PINE>>PE4) & 0x03);
+}
+
+ISR(INT5_vect)
+{
+  Encoder_Update(0,(PINE>>PE4) & 0x03);
+}
+
+ISR(INT6_vect)
+{
+  Encoder_Update(1,(PINE>>PE6) & 0x03);
+}
+
+ISR(INT7_vect)
+{
+  Encoder_Update(1,(PINE>>PE6) & 0x03);
+}
+
+static void Move_Abort(void)
+{
+  if (Move.Status == MOVE_STATUS_MOVING)
+    {
+      Move.Status = MOVE_STATUS_ABORTED;
+      Move_Notify();
+    }
+}
+
+static void Move_Notify(void)
+{
+  if (Move.ID != 0)
+    {
+      Move.NotifyID = Move.ID;
+      Move.NotifyStatus = Move.Status;
+      Move.NotifyPending = 1;
+    }
+}
+
+static void Move_Check(void)
+{
+  uint8_t Done = 1;
+
+  /* Hold off until the last notification has gone out */
+  if ((Move.Status != MOVE_STATUS_MOVING) || Move.NotifyPending)
+    {
+      return;
+    }
+
+  /* A limit switch cut it short, so stop the rest of it too */
+  if (Home.LimitHit & Move.MotorMask)
+    {
+      for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+        {
+          if (Move.MotorMask & (1<<Motor_N))
+            {
+              Motor_Stop(Motor_N);
+            }
+        }
+      Move.Status = MOVE_STATUS_ABORTED;
+      Move_Notify();
+      return;
+    }
+
+  /* Followers have not stopped until the line lets go of them, nor
+     homing motors until they are home */
+  if ((Line.Active && (Move.MotorMask & Line.FollowerMask)) || (Move.MotorMask & Home.MotorMask))
+    {
+      Done = 0;
+    }
+
+  /* Done once every motor has stopped, either at its setpoint or where a
+     zero frequency ramped it down */
+  for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+    {
+      if (Move.MotorMask & (1<<Motor_N))
+        {
+          ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+          {
+            if ((Motor[Motor_N].Frequency != 0) ||
+                ((Motor[Motor_N].Position != Motor[Motor_N].PositionSetPoint) &&
+                 (Motor[Motor_N].FrequencyTarget != 0)))
+              {
+                Done = 0;
+              }
+          }
+        }
+    }
+
+  if (Done)
+    {
+      Move.Status = MOVE_STATUS_DONE;
+      Move_Notify();
+    }
+}
+
+/* Start a coordinated move of the motors in MotorMask to their Setpoint
+   Positions.  The largest Setpoint Frequency is the speed along the
+   line, in steps/s.  Lines start from rest: the motors are stopped where
+   they are first. */
+static void Line_Start(uint8_t MotorMask, MotorStatus_t *Setpoint)
+{
+  MotorStatus_t LeadSetpoint;
+  int32_t  Delta[MOTOR_NUM];
+  uint32_t Distance;
+  uint32_t Speed = 0;
+  float    Length = 0;
+  uint8_t  Timer_N;
+
+  Line.Steps = 0;
+  Line.FollowerMask = 0;
+  Line.RestMask = 0;
+  Line.PulseMask = 0;
+  for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+    {
+      if (MotorMask & (1<<Motor_N))
+        {
+          ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+          {
+            Timer_Off(Motor[Motor_N].Timer);
+            Motor[Motor_N].Frequency = 0;
+            Motor[Motor_N].FrequencyTarget = 0;
+            Motor[Motor_N].RampFrequency = 0;
+            Motor[Motor_N].Update = 0;
+          }
+        }
+    }
+
+  /* Any step still pending has been counted by now */
+  for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+    {
+      Delta[Motor_N] = 0;
+      if (MotorMask & (1<<Motor_N))
+        {
+          Delta[Motor_N] = Setpoint[Motor_N].Position - Motor[Motor_N].Position;
+          Distance = (Delta[Motor_N] < 0) ? -Delta[Motor_N] : Delta[Motor_N];
+          Length += (float)Distance*Distance;
+          if (Distance > Line.Steps)
+            {
+              Line.Steps = Distance;
+              Line.Lead = Motor_N;
+            }
+          if (Setpoint[Motor_N].Frequency > Speed)
+            {
+              Speed = Setpoint[Motor_N].Frequency;
+            }
+          Motor[Motor_N].PositionSetPoint = Setpoint[Motor_N].Position;
+        }
+    }
+  if ((Line.Steps == 0) || (Speed == 0))
+    {
+      return;
+    }
+
+  for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+    {
+      if (!(MotorMask & (1<<Motor_N)) || (Motor_N == Line.Lead) || (Delta[Motor_N] == 0))
+        {
+          continue;
+        }
+      Timer_N = Motor[Motor_N].Timer;
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+      {
+        /* Take the step pin over from the timer at the level it left it */
+        if (*Timer[Timer_N].Address.PinPort & (1<<Timer[Timer_N].OutputPin))
+          {
+            *Timer[Timer_N].Address.OutputPort |= (1<<Timer[Timer_N].OutputPin);
+            Line.RestMask |= (1<<Motor_N);
+          }
+        else
+          {
+            *Timer[Timer_N].Address.OutputPort &= ~(1<<Timer[Timer_N].OutputPin);
+          }
+        *Timer[Timer_N].Address.OutputControl &= ~Timer[Timer_N].OutputCompare;
+      }
+      if (Delta[Motor_N] > 0)
+        {
+          Motor[Motor_N].Direction = Motor[Motor_N].DirectionPos;
+          Line.Delta[Motor_N] = Delta[Motor_N];
+        }
+      else
+        {
+          Motor[Motor_N].Direction = Motor[Motor_N].DirectionNeg;
+          Line.Delta[Motor_N] = -Delta[Motor_N];
+        }
+      Motor[Motor_N].DirectionTarget = Motor[Motor_N].Direction;
+      if (Motor[Motor_N].Direction)
+        {
+          *Motor[Motor_N].DirectionPort |= (1<<Motor[Motor_N].DirectionPin);
+        }
+      else
+        {
+          *Motor[Motor_N].DirectionPort &= ~(1<<Motor[Motor_N].DirectionPin);
+        }
+      Line.Error[Motor_N] = Line.Steps/2;
+      /* At most 1.0, so times a 16 bit frequency it fits 32 bits */
+      Line.Ratio[Motor_N] = (((uint64_t)Line.Delta[Motor_N]<<16) + Line.Steps/2)/Line.Steps;
+      Line.FollowerMask |= (1<<Motor_N);
+    }
+
+  /* The lead covers its share of the line in the time the whole line takes */
+  LeadSetpoint.Position = Setpoint[Line.Lead].Position;
+  LeadSetpoint.Frequency = (uint32_t)(Speed*(Line.Steps/sqrtf(Length)) + 0.5);
+  if (LeadSetpoint.Frequency == 0)
+    {
+      LeadSetpoint.Frequency = 1;
+    }
+  Motor[Line.Lead].Update = 1;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    /* Before the ramp can start the lead from the tick */
+    Motor_SetPoint(Line.Lead,&LeadSetpoint);
+    Line.Active = (Line.FollowerMask != 0);
+  }
+  Motor_Update(Line.Lead);
+}
+
+/* From the lead motor interrupt, twice a lead step: Stepped with the lead
+   step pin high, once it has been counted, and again with it low */
+static void Line_Step(uint8_t Stepped)
+{
+  uint8_t Timer_N;
+
+  for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+    {
+      if (!(Line.FollowerMask & (1<<Motor_N)))
+        {
+          continue;
+        }
+      Timer_N = Motor[Motor_N].Timer;
+      if (!Stepped)
+        {
+          /* Back to rest, ending the pulse */
+          if (Line.PulseMask & (1<<Motor_N))
+            {
+              *Timer[Timer_N].Address.OutputPort ^= (1<<Timer[Timer_N].OutputPin);
+            }
+          continue;
+        }
+      Line.Error[Motor_N] += Line.Delta[Motor_N];
+      if (Line.Error[Motor_N] >= Line.Steps)
+        {
+          Line.Error[Motor_N] -= Line.Steps;
+          *Timer[Timer_N].Address.OutputPort ^= (1<<Timer[Timer_N].OutputPin);
+          Line.PulseMask |= (1<<Motor_N);
+          if (Motor[Motor_N].Direction == Motor[Motor_N].DirectionPos)
+            {
+              Motor[Motor_N].Position += 1;
+            }
+          else
+            {
+              Motor[Motor_N].Position -= 1;
+            }
+        }
+    }
+  if (!Stepped)
+    {
+      Line.PulseMask = 0;
+    }
+}
+
+/* From the segment tick, after the ramps: report the followers at their
+   share of the lead frequency, and let them go once the lead has stopped
+   at the end of the line */
+static void Line_Tick(void)
+{
+  uint32_t LeadFrequency;
+  uint8_t  Stopped;
+
+  if (!Line.Active)
+    {
+      return;
+    }
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    LeadFrequency = Motor[Line.Lead].Frequency;
+    Stopped = !Timer[Motor[Line.Lead].Timer].OnOff &&
+      ((Motor[Line.Lead].Position == Motor[Line.Lead].PositionSetPoint) ||
+       (Motor[Line.Lead].FrequencyTarget == 0));
+  }
+  if (Stopped)
+    {
+      Line_End();
+      return;
+    }
+  for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+    {
+      if (Line.FollowerMask & (1<<Motor_N))
+        {
+          ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+          {
+            Motor[Motor_N].Frequency = (LeadFrequency*Line.Ratio[Motor_N] + 0x8000)>>16;
+          }
+        }
+    }
+}
+
+/* Give the follower step pins back to their timers, at rest */
+static void Line_End(void)
+{
+  uint8_t Timer_N;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    if (Line.Active)
+      {
+        for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+          {
+            if (Line.FollowerMask & (1<<Motor_N))
+              {
+                Timer_N = Motor[Motor_N].Timer;
+                if (Line.PulseMask & (1<<Motor_N))
+                  {
+                    *Timer[Timer_N].Address.OutputPort ^= (1<<Timer[Timer_N].OutputPin);
+                  }
+                *Timer[Timer_N].Address.OutputControl |= Timer[Timer_N].OutputCompare;
+                Motor[Motor_N].Frequency = 0;
+              }
+          }
+        Line.PulseMask = 0;
+        Line.Active = 0;
+      }
+  }
+}
+
+/* Cut a line short: the followers stop at once, the lead as a motor
+   given a zero frequency would */
+static void Line_Abort(void)
+{
+  if (Line.Active)
+    {
+      Line_End();
+      Motor_Stop(Line.Lead);
+    }
+}
+
+static void Input_Init(void)
+{
+  for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+    {
+      Home.Phase[Motor_N] = HOME_IDLE;
+      Home.Frequency[Motor_N] = 0;
+      Encoder.Config[Motor_N].Steps = 0;
+      Encoder.Config[Motor_N].Counts = 0;
+      Encoder.Config[Motor_N].Tolerance = STEP_LOSS_TOLERANCE;
+    }
+  Home.MotorMask = 0;
+  Home.Homed = 0;
+  Home.StepLoss = 0;
+  Home.LimitHit = 0;
+}
+
+static uint8_t Limit_Pressed(uint8_t Motor_N)
+{
+  /* The inputs float until IO_Init pulls them up */
+  return IO_Enabled && !(PIND & (1<<Motor[Motor_N].LimitPin));
+}
+
+static uint8_t Limit_Status(void)
+{
+  uint8_t Status = 0;
+
+  for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+    {
+      if (Limit_Pressed(Motor_N))
+        {
+          Status |= (1<<Motor_N);
+        }
+    }
+  return Status;
+}
+
+/* From the limit switch interrupts */
+static void Limit_Change(uint8_t Motor_N)
+{
+  if (Limit_Pressed(Motor_N))
+    {
+      if (Home.Phase[Motor_N] == HOME_SEEK)
+        {
+          Motor_Halt(Motor_N);
+          Home.Phase[Motor_N] = HOME_FOUND;
+        }
+      else if ((Home.Phase[Motor_N] == HOME_IDLE) && Motor_Running(Motor_N) &&
+               (Motor[Motor_N].Direction == Motor[Motor_N].DirectionNeg))
+        {
+          Limit_Stop(Motor_N);
+        }
+    }
+  else if (Home.Phase[Motor_N] == HOME_BACKOFF)
+    {
+      /* Let go: this is home */
+      Motor_Halt(Motor_N);
+      Motor[Motor_N].Position = Motor[Motor_N].PositionHome;
+      Motor[Motor_N].PositionSetPoint = Motor[Motor_N].PositionHome;
+      Home.Phase[Motor_N] = HOME_DONE;
+      Home.Homed |= (1<<Motor_N);
+      Home.StepLoss &= ~(1<<Motor_N);
+      Encoder_Zero(Motor_N);
+    }
+}
+
+/* Stop at once on running into a limit switch, along with the rest of a
+   line.  A homed motor should only meet it about home. */
+static void Limit_Stop(uint8_t Motor_N)
+{
+  int32_t Error;
+
+  if (Line.Active && ((Line.Lead == Motor_N) || (Line.FollowerMask & (1<<Motor_N))))
+    {
+      Line_End();
+      Motor_Halt(Line.Lead);
+    }
+  Motor_Halt(Motor_N);
+
+  Error = Motor[Motor_N].Position - Motor[Motor_N].PositionHome;
+  if ((Home.Homed & (1<<Motor_N)) &&
+      ((Error > Encoder.Config[Motor_N].Tolerance) || (-Error > Encoder.Config[Motor_N].Tolerance)))
+    {
+      Home.StepLoss |= (1<<Motor_N);
+    }
+  Home.LimitHit |= (1<<Motor_N);
+}
+
+/* Stop where it is without a ramp, from anywhere */
+static void Motor_Halt(uint8_t Motor_N)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    Timer_Off(Motor[Motor_N].Timer);
+    Motor[Motor_N].Frequency = 0;
+    Motor[Motor_N].FrequencyTarget = 0;
+    Motor[Motor_N].RampFrequency = 0;
+    Motor[Motor_N].Update = 0;
+  }
+}
+
+static uint8_t Motor_Running(uint8_t Motor_N)
+{
+  return Timer[Motor[Motor_N].Timer].OnOff || (Line.Active && (Line.FollowerMask & (1<<Motor_N)));
+}
+
+/* Stopped at its setpoint or by a zero frequency, rather than waiting on
+   a ramp to start */
+static uint8_t Motor_Stopped(uint8_t Motor_N)
+{
+  uint8_t Stopped;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    Stopped = !Timer[Motor[Motor_N].Timer].OnOff &&
+      ((Motor[Motor_N].Position == Motor[Motor_N].PositionSetPoint) ||
+       (Motor[Motor_N].FrequencyTarget == 0));
+  }
+  return Stopped;
+}
+
+/* Home the motors in MotorMask, seeking their switches at their Setpoint
+   Frequency */
+static void Home_Start(uint8_t MotorMask, MotorStatus_t *Setpoint)
+{
+  for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+    {
+      if (!(MotorMask & (1<<Motor_N)))
+        {
+          continue;
+        }
+      Home.Frequency[Motor_N] = Setpoint[Motor_N].Frequency ? Setpoint[Motor_N].Frequency : 1;
+      Home.Homed &= ~(1<<Motor_N);
+      Home.MotorMask |= (1<<Motor_N);
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+      {
+        Home.Phase[Motor_N] = Limit_Pressed(Motor_N) ? HOME_FOUND : HOME_SEEK;
+      }
+      if (Home.Phase[Motor_N] == HOME_SEEK)
+        {
+          Home_Move(Motor_N,-HOME_TRAVEL_MAX,Home.Frequency[Motor_N]);
+        }
+    }
+  Home.LimitHit = 0;
+}
+
+static void Home_Move(uint8_t Motor_N, int32_t Distance, uint32_t Frequency)
+{
+  MotorStatus_t Setpoint;
+
+  Setpoint.Frequency = Frequency;
+  Setpoint.Position = Motor[Motor_N].Position + Distance;
+  Motor[Motor_N].Update = 1;
+  Motor_SetPoint(Motor_N,&Setpoint);
+  Motor_Update(Motor_N);
+}
+
+/* From the main loop: back off the switches found, and give up on
+   motors that ran out of travel looking for them */
+static void Home_Check(void)
+{
+  uint8_t  Phase;
+  uint8_t  Failed = 0;
+  uint32_t Frequency;
+
+  for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+    {
+      if (!(Home.MotorMask & (1<<Motor_N)))
+        {
+          continue;
+        }
+      Phase = Home.Phase[Motor_N];
+      if ((Phase == HOME_SEEK) && Motor_Stopped(Motor_N))
+        {
+          if (Limit_Pressed(Motor_N))
+            {
+              Phase = HOME_FOUND;
+            }
+          else
+            {
+              Failed |= (1<<Motor_N);
+            }
+        }
+      if (Phase == HOME_FOUND)
+        {
+          Frequency = Home.Frequency[Motor_N]/HOME_BACKOFF_DIVIDER;
+          Home.Phase[Motor_N] = HOME_BACKOFF;
+          Home_Move(Motor_N,HOME_BACKOFF_MAX,Frequency ? Frequency : 1);
+        }
+      else if (Phase == HOME_DONE)
+        {
+          Home.Phase[Motor_N] = HOME_IDLE;
+          Home.MotorMask &= ~(1<<Motor_N);
+        }
+      else if ((Phase == HOME_BACKOFF) && Motor_Stopped(Motor_N))
+        {
+          ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+          {
+            /* Unless it let go just now */
+            if (Home.Phase[Motor_N] == HOME_BACKOFF)
+              {
+                Failed |= (1<<Motor_N);
+              }
+          }
+        }
+    }
+
+  if (Failed)
+    {
+      for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+        {
+          if (Failed & (1<<Motor_N))
+            {
+              Home.Phase[Motor_N] = HOME_IDLE;
+              Home.MotorMask &= ~(1<<Motor_N);
+            }
+        }
+      if (Move.MotorMask & Failed)
+        {
+          Move_Abort();
+        }
+    }
+}
+
+/* Stop homing, the motors as a zero frequency would */
+static void Home_Abort(void)
+{
+  for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+    {
+      if (Home.MotorMask & (1<<Motor_N))
+        {
+          ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+          {
+            Home.Phase[Motor_N] = HOME_IDLE;
+          }
+          Motor_Stop(Motor_N);
+        }
+    }
+  Home.MotorMask = 0;
+}
+
+static void Encoder_Configure(uint8_t Motor_N, EncoderConfig_t *Config)
+{
+  uint8_t Mask;
+
+  Encoder.Config[Motor_N] = *Config;
+  if (Encoder.Config[Motor_N].Tolerance == 0)
+    {
+      Encoder.Config[Motor_N].Tolerance = STEP_LOSS_TOLERANCE;
+    }
+  Home.StepLoss &= ~(1<<Motor_N);
+  if (Motor_N >= ENCODER_NUM)
+    {
+      Encoder.Config[Motor_N].Counts = 0;
+      return;
+    }
+
+  /* INT4:5 for encoder 0, INT6:7 for encoder 1 */
+  Mask = (0x03<<(INT4 + 2*Motor_N));
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    if (Encoder.Config[Motor_N].Counts)
+      {
+        Encoder.State[Motor_N] = (PINE>>(PE4 + 2*Motor_N)) & 0x03;
+        EIFR = Mask;
+        EIMSK |= Mask;
+      }
+    else
+      {
+        EIMSK &= ~Mask;
+      }
+  }
+  Encoder_Zero(Motor_N);
+}
+
+static void Encoder_Zero(uint8_t Motor_N)
+{
+  if (Motor_N >= ENCODER_NUM)
+    {
+      return;
+    }
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    Encoder.Count[Motor_N] = 0;
+    Encoder.Origin[Motor_N] = Motor[Motor_N].Position;
+  }
+}
+
+/* From the encoder interrupts, on either channel changing */
+static void Encoder_Update(uint8_t Encoder_N, uint8_t State)
+{
+  Encoder.Count[Encoder_N] += QuadratureTable[(Encoder.State[Encoder_N]<<2) | State];
+  Encoder.State[Encoder_N] = State;
+}
+
+/* From the main loop: compare the steps taken with the encoder counts */
+static void Encoder_Check(void)
+{
+  int32_t Steps;
+  int32_t Count;
+  int32_t Error;
+
+  for ( uint8_t Motor_N=0; Motor_N<ENCODER_NUM; Motor_N++ )
+    {
+      if (!Encoder.Config[Motor_N].Counts)
+        {
+          continue;
+        }
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+      {
+        Steps = Motor[Motor_N].Position - Encoder.Origin[Motor_N];
+        Count = Encoder.Count[Motor_N];
+      }
+      Error = Steps - (int32_t)(((int64_t)Count*Encoder.Config[Motor_N].Steps)/Encoder.Config[Motor_N].Counts);
+      if ((Error > Encoder.Config[Motor_N].Tolerance) || (-Error > Encoder.Config[Motor_N].Tolerance))
+        {
+          Home.StepLoss |= (1<<Motor_N);
+        }
+    }
+}
+
+static void Telemetry_Init(void)
+{
+  Telemetry.Tick = 0;
+  Telemetry.Period = 0;
+  Telemetry.TicksLeft = 0;
+  Telemetry.Ready = 0;
+  Telemetry.Sample.Sequence = 0;
+}
+
+/* Take a sample at the start of the segment tick, before the segment
+   and ramps change anything.  Telemetry.Tick itself is counted ahead of
+   the tick interrupt's Busy check, so it keeps counting through ticks
+   that are dropped, and the sample periods stretch over them instead. */
+static void Telemetry_Tick(void)
+{
+  if ((Telemetry.Period == 0) || (--Telemetry.TicksLeft != 0))
+    {
+      return;
+    }
+  Telemetry.TicksLeft = Telemetry.Period;
+
+  Telemetry.Sample.Sequence++;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    /* A tick nested in this one counts it even while Busy */
+    Telemetry.Sample.Tick = Telemetry.Tick;
+  }
+  for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+    {
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+      {
+        Telemetry.Sample.MotorStatus[Motor_N].Frequency = Motor[Motor_N].Frequency;
+        Telemetry.Sample.MotorStatus[Motor_N].Position = Motor[Motor_N].Position;
+      }
+    }
+  Telemetry.Ready = 1;
+}
+
+static void Telemetry_Send(void)
+{
+  TelemetryPacketWrapper_t   Sample;
+  TelemetryPacket16Wrapper_t Sample16;
+
+  if (!Telemetry.Ready)
+    {
+      return;
+    }
+
+  /* Never wait on the host here, the next sample replaces this one */
+  Endpoint_SelectEndpoint(TELEMETRY_EPNUM);
+  if (!(Endpoint_IsReadWriteAllowed() && Endpoint_IsINReady()))
+    {
+      return;
+    }
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    Sample = Telemetry.Sample;
+    Telemetry.Ready = 0;
+  }
+  if (ProtocolVersion == 1)
+    {
+      Sample16.Sequence = Sample.Sequence;
+      Sample16.Tick = Sample.Tick;
+      for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+        {
+          MotorStatus_Narrow(&Sample16.MotorStatus[Motor_N],&Sample.MotorStatus[Motor_N]);
+        }
+      Endpoint_Write_Stream_LE((uint8_t*)&Sample16, sizeof(Sample16));
+    }
+  else
+    {
+      Endpoint_Write_Stream_LE((uint8_t*)&Sample, sizeof(Sample));
+    }
+  Endpoint_ClearIN();
+}
+
+/* Segment tick: next trajectory segment, then the acceleration ramps.
+   This takes a while, so let the motor interrupts in meanwhile rather
+   than lose steps. */
+ISR(TIMER0_COMPA_vect, ISR_NOBLOCK)
+{
+  static uint8_t Busy = 0;
+
+  Telemetry.Tick++;
+  if (Busy)
+    {
+      TicksDropped++;
+      return;
+    }
+  Busy = 1;
+  Telemetry_Tick();
+  Segment_Tick();
+  for ( uint8_t Motor_N=0; Motor_N<MOTOR_NUM; Motor_N++ )
+    {
+      /* Line_Step drives the followers */
+      if (!(Line.Active && (Line.FollowerMask & (1<<Motor_N))))
+        {
+          Motor_Ramp(Motor_N);
+        }
+    }
+  Line_Tick();
+  Busy = 0;
+}
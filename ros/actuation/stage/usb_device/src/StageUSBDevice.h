@@ -43,7 +43,9 @@
 #include <avr/interrupt.h>
 #include <util/atomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
+#include <math.h>
 
 #include "Descriptors.h"
 
@@ -56,6 +58,16 @@
 /* USB Commands */
 #define USB_CMD_GET_STATE       1
 #define USB_CMD_SET_STATE       2
+#define USB_CMD_STREAM_SEGMENTS 3
+#define USB_CMD_STREAM_CLEAR    4
+#define USB_CMD_SET_ACCELERATION 5
+#define USB_CMD_MOVE            6
+#define USB_CMD_SET_TELEMETRY   7
+#define USB_CMD_PROTOCOL_VERSION 8
+#define USB_CMD_MOVE_LINE       9
+#define USB_CMD_HOME            10
+#define USB_CMD_SET_ENCODER     11
+#define USB_CMD_MOVE_DONE       100  /* Sent unprompted, see Move_Check */
 #define USB_CMD_AVR_RESET       200
 #define USB_CMD_AVR_DFU_MODE    201
 
@@ -78,6 +90,9 @@
 #define MOTOR_0_INTERRUPT     TIMER1_OVF_vect
 #define MOTOR_1_INTERRUPT     TIMER3_OVF_vect
 #define MOTOR_2_INTERRUPT     TIMER2_OVF_vect
+#define MOTOR_0_LIMIT_PIN     PD0  /* INT0 */
+#define MOTOR_1_LIMIT_PIN     PD1  /* INT1 */
+#define MOTOR_2_LIMIT_PIN     PD2  /* INT2 */
 
 /* Software reset */
 #define AVR_RESET() wdt_enable(WDTO_30MS); while(1) {}
@@ -87,20 +102,71 @@
 #define TIMER_NUM 4
 #define PRESCALER_NUM 5
 
+/* Position moves */
+#define MOVE_STATUS_IDLE        0
+#define MOVE_STATUS_MOVING      1
+#define MOVE_STATUS_DONE        2
+#define MOVE_STATUS_ABORTED     3
+
+/* Homing: each axis has a limit switch at its home (negative) end,
+   active low on PORTD.  Homing runs onto the switch, then backs off
+   slowly until it lets go, which is MOTOR_*_POSITION_HOME. */
+#define HOME_IDLE             0
+#define HOME_SEEK             1
+#define HOME_FOUND            2
+#define HOME_BACKOFF          3
+#define HOME_DONE             4
+#define HOME_TRAVEL_MAX       2000000  /* Steps to look for the switch */
+#define HOME_BACKOFF_MAX      20000    /* Steps to look for it to let go */
+#define HOME_BACKOFF_DIVIDER  8        /* Backoff frequency divider */
+
+/* Quadrature encoders, A and B on PORTE pins 4:5 (INT4:5) for motor 0
+   and 6:7 (INT6:7) for motor 1 */
+#define ENCODER_NUM           2
+#define STEP_LOSS_TOLERANCE   64       /* Default, steps */
+
+/* Replies waiting for the IN endpoint */
+#define REPLY_QUEUE_SIZE        4    /* Power of 2 */
+
+/* Protocol versions: 1 has 16-bit positions and frequencies on the
+   wire, 2 has signed 32-bit positions and 32-bit frequencies, 3 adds
+   USB_CMD_MOVE_LINE on the wire format of 2, and 4 adds USB_CMD_HOME,
+   USB_CMD_SET_ENCODER and the input status at the end of every reply,
+   and 5 adds TicksDropped after it.  Every host session starts at 1
+   until USB_CMD_PROTOCOL_VERSION asks for more; inside the firmware
+   everything is kept as in version 5. */
+#define PROTOCOL_VERSION_MAX  5
+#define PROTOCOL_MAGIC        0xFFFF /* Never a version 1 motor frequency */
+
+/* Trajectory streaming */
+#define SEGMENT_BUFFER_SIZE   64   /* Power of 2, at most 128 */
+#define SEGMENT_PACKET_NUM    2    /* Segments per USB packet */
+#define SEGMENT16_PACKET_NUM  4    /* Segments per version 1 USB packet */
+#define SEGMENT_TICK_FREQ     1000 /* Segment Duration units, Hz */
+#define SEGMENT_TICK_PRESCALER 64
+
 /* Type Defines: */
 typedef struct
 {
   uint8_t     Timer;
   volatile uint8_t     *DirectionPort;
   uint8_t     DirectionPin;
+  uint8_t     LimitPin;
   uint16_t    Frequency;
   uint16_t    FrequencyMax;
   uint8_t     Direction;
   uint8_t     DirectionPos;
   uint8_t     DirectionNeg;
-  uint16_t    Position;
-  uint16_t    PositionSetPoint;
+  int32_t     Position;
+  int32_t     PositionSetPoint;
+  int32_t     PositionHome;
   uint8_t     Update;
+  uint16_t    FrequencyTarget;
+  uint8_t     DirectionTarget;
+  uint16_t    Acceleration;   /* Hz per segment tick, 0 for no ramp */
+  uint16_t    RampFrequency;
+  uint32_t    BrakeScale;     /* 2*SEGMENT_TICK_FREQ*Acceleration */
+  uint32_t    BrakeLimit;     /* Largest distance BrakeScale can multiply */
 } MotorWrapper_t;
 
 typedef struct
@@ -110,8 +176,11 @@ typedef struct
     volatile uint16_t    *TOP;
     volatile uint8_t     *ClockSelect;
     volatile uint8_t     *PinPort;
+    volatile uint8_t     *OutputPort;
+    volatile uint8_t     *OutputControl;
   } Address;
   uint8_t     OutputPin;
+  uint8_t     OutputCompare;  /* COMnA bits that connect OutputPin */
   uint8_t     ClockSelect[PRESCALER_NUM + 1];
   uint8_t     Prescaler_N;
   uint8_t     ScaleFactor;
@@ -120,25 +189,253 @@ typedef struct
   uint8_t     OnOff;
 } TimerWrapper_t;
 
+typedef struct
+{
+  uint32_t   Frequency;
+  int32_t    Position;
+} MotorStatus_t;
+
 typedef struct
 {
   uint16_t   Frequency;
   uint16_t   Position;
-} MotorStatus_t;
+} MotorStatus16_t;
 
+/* One trajectory segment: the Setpoints of the motors in MotorUpdate
+   are applied as by USB_CMD_SET_STATE, then held for Duration ticks.
+   A Duration of 0 holds the segment until the next one is queued. */
 typedef struct
 {
-  uint8_t       CommandID;
   uint8_t       MotorUpdate;
+  uint16_t      Duration;
   MotorStatus_t Setpoint[MOTOR_NUM];
+} SegmentWrapper_t;
+
+typedef struct
+{
+  uint8_t         MotorUpdate;
+  uint16_t        Duration;
+  MotorStatus16_t Setpoint[MOTOR_NUM];
+} Segment16Wrapper_t;
+
+typedef struct
+{
+  SegmentWrapper_t  Segment[SEGMENT_BUFFER_SIZE];
+  volatile uint8_t  Head;       /* Written by USB_ProcessPacket */
+  volatile uint8_t  Tail;       /* Written by the tick interrupt */
+  uint16_t          TicksLeft;
+  uint8_t           Running;
+  uint8_t           Hold;
+  uint8_t           MotorMask;  /* Motors moved by the stream so far */
+} SegmentBuffer_t;
+
+/* A move is a set of position setpoints tracked until every motor in
+   MotorMask has stopped.  Moves with a nonzero ID are reported with an
+   unprompted USB_CMD_MOVE_DONE packet when they finish or are aborted. */
+typedef struct
+{
+  uint8_t       ID;
+  uint8_t       Status;
+  uint8_t       MotorMask;
+  uint8_t       NotifyPending;
+  uint8_t       NotifyID;
+  uint8_t       NotifyStatus;
+} MoveWrapper_t;
+
+/* A coordinated move.  The Lead motor, the one with the most steps to
+   go, runs on its own timer as for a move, ramps and all.  Each step it
+   takes steps the followers in FollowerMask by Bresenham, driving their
+   step pins from the lead interrupt, so all of them get there together
+   along a straight line.  Error[] starts at Steps/2; a follower steps
+   whenever adding its Delta[] takes Error[] past Steps.  Follower pins
+   rest at the level the timer left them in, RestMask, and pulse away
+   from it for half a lead step. */
+typedef struct
+{
+  volatile uint8_t Active;
+  uint8_t       Lead;
+  uint8_t       FollowerMask;
+  uint8_t       RestMask;
+  uint8_t       PulseMask;  /* Followers away from rest */
+  uint32_t      Steps;      /* Lead steps from start to end */
+  uint32_t      Delta[MOTOR_NUM];
+  uint32_t      Error[MOTOR_NUM];
+  uint32_t      Ratio[MOTOR_NUM];  /* Delta/Steps in 16.16 fixed point */
+} LineWrapper_t;
+
+/* Encoder Counts make Steps motor steps, Steps negative if the encoder
+   counts the other way; 0 Counts for no encoder.  A motor more than
+   Tolerance steps (0 for STEP_LOSS_TOLERANCE) from where its encoder,
+   or once homed its limit switch, puts it is reported as having lost
+   steps. */
+typedef struct
+{
+  int16_t       Steps;
+  uint16_t      Counts;
+  uint16_t      Tolerance;
+} EncoderConfig_t;
+
+typedef struct
+{
+  volatile int32_t Count[ENCODER_NUM];
+  uint8_t       State[ENCODER_NUM];    /* B and A levels */
+  int32_t       Origin[ENCODER_NUM];   /* Motor Position at Count 0 */
+  EncoderConfig_t Config[MOTOR_NUM];
+} EncoderWrapper_t;
+
+/* Homing, limit switches and step loss, per motor bit.  The limit switch
+   interrupts move Phase on from HOME_SEEK and HOME_BACKOFF; Home_Check
+   does the rest from the main loop. */
+typedef struct
+{
+  volatile uint8_t Phase[MOTOR_NUM];
+  uint32_t      Frequency[MOTOR_NUM];
+  uint8_t       MotorMask;  /* Motors homing */
+  volatile uint8_t Homed;
+  volatile uint8_t StepLoss;
+  volatile uint8_t LimitHit;   /* Motors a switch stopped since the last move started */
+} HomeWrapper_t;
+
+/* One state sample, as sent on the telemetry endpoint */
+typedef struct
+{
+  uint16_t      Sequence;   /* Counts samples taken, sent or not */
+  uint32_t      Tick;       /* Segment ticks since power up */
+  MotorStatus_t MotorStatus[MOTOR_NUM];
+} TelemetryPacketWrapper_t;
+
+typedef struct
+{
+  uint16_t        Sequence;
+  uint32_t        Tick;
+  MotorStatus16_t MotorStatus[MOTOR_NUM];
+} TelemetryPacket16Wrapper_t;
+
+/* Motor state is sampled on the segment tick every Period ticks.  A
+   sample the host has not picked up by the time the next one is taken
+   is replaced by it. */
+typedef struct
+{
+  volatile uint32_t         Tick;       /* Counted even when the tick is dropped */
+  uint16_t                  Period;     /* Segment ticks, 0 for off */
+  uint16_t                  TicksLeft;
+  volatile uint8_t          Ready;
+  TelemetryPacketWrapper_t  Sample;
+} TelemetryWrapper_t;
+
+typedef struct
+{
+  uint8_t       CommandID;
+  union
+  {
+    /* USB_CMD_SET_STATE, USB_CMD_SET_ACCELERATION, USB_CMD_MOVE,
+       USB_CMD_MOVE_LINE, USB_CMD_SET_TELEMETRY, USB_CMD_PROTOCOL_VERSION,
+       USB_CMD_HOME (Setpoint Frequency only), USB_CMD_SET_ENCODER */
+    struct
+    {
+      uint8_t       MotorUpdate;
+      union
+      {
+        MotorStatus_t Setpoint[MOTOR_NUM];
+        uint16_t      Acceleration[MOTOR_NUM];
+        EncoderConfig_t Encoder[MOTOR_NUM];
+        uint16_t      TelemetryPeriod;
+        uint8_t       ProtocolVersion;
+      };
+      uint8_t       MoveID;
+    };
+    /* USB_CMD_STREAM_SEGMENTS */
+    struct
+    {
+      uint8_t          SegmentCount;
+      SegmentWrapper_t Segment[SEGMENT_PACKET_NUM];
+    };
+  };
 } USBPacketOutWrapper_t;
 
+/* Version 1 of USBPacketOutWrapper_t.  Acceleration, TelemetryPeriod
+   and ProtocolVersion sit at the same offsets in both. */
+typedef struct
+{
+  uint8_t       CommandID;
+  union
+  {
+    struct
+    {
+      uint8_t         MotorUpdate;
+      union
+      {
+        MotorStatus16_t Setpoint[MOTOR_NUM];
+        uint16_t        Acceleration[MOTOR_NUM];
+      };
+      uint8_t         MoveID;
+    };
+    struct
+    {
+      uint8_t            SegmentCount;
+      Segment16Wrapper_t Segment[SEGMENT16_PACKET_NUM];
+    };
+  };
+} USBPacketOut16Wrapper_t;
+
 typedef struct
 {
   uint8_t       CommandID;
   MotorStatus_t MotorStatus[MOTOR_NUM];
+  uint8_t       SegmentsFree;
+  uint8_t       SegmentsAccepted;
+  uint8_t       MoveID;
+  uint8_t       MoveStatus;
+  /* Version 4 on */
+  uint8_t       LimitStatus;    /* Limit switches pressed */
+  uint8_t       Homed;
+  uint8_t       StepLoss;
+  int32_t       EncoderCount[MOTOR_NUM];
+  /* Version 5 on */
+  uint16_t      TicksDropped;   /* Segment ticks skipped since power up */
 } USBPacketInWrapper_t;
 
+/* Versions 2 and 3 stop short of the input status, 4 of TicksDropped */
+#define USBPACKETIN_V2_SIZE   offsetof(USBPacketInWrapper_t, LimitStatus)
+#define USBPACKETIN_V4_SIZE   offsetof(USBPacketInWrapper_t, TicksDropped)
+
+typedef struct
+{
+  uint8_t         CommandID;
+  MotorStatus16_t MotorStatus[MOTOR_NUM];
+  uint8_t         SegmentsFree;
+  uint8_t         SegmentsAccepted;
+  uint8_t         MoveID;
+  uint8_t         MoveStatus;
+} USBPacketIn16Wrapper_t;
+
+/* Reply to USB_CMD_PROTOCOL_VERSION.  Firmware without the command
+   echoes its ID with the motor 0 frequency where Magic is. */
+typedef struct
+{
+  uint8_t       CommandID;
+  uint16_t      Magic;
+  uint8_t       ProtocolVersion;     /* In use from now on */
+  uint8_t       ProtocolVersionMax;
+} USBPacketVersionWrapper_t;
+
+/* Replies are queued in their wire format and sent as the IN endpoint
+   frees a bank, so the next command can be taken in meanwhile.  A
+   command is only read once there is room for its reply, so a host that
+   stops reading holds the commands back on the OUT endpoint. */
+typedef struct
+{
+  uint8_t       Size;
+  uint8_t       Data[sizeof(USBPacketInWrapper_t)];
+} ReplyWrapper_t;
+
+typedef struct
+{
+  ReplyWrapper_t Reply[REPLY_QUEUE_SIZE];
+  uint8_t        Head;
+  uint8_t        Tail;
+} ReplyQueue_t;
+
 /* Enums: */
 /** Enum for the possible status codes for passing to the UpdateStatus() function. */
 enum USB_StatusCodes_t
@@ -152,10 +449,25 @@ enum USB_StatusCodes_t
 /* Global Variables: */
 const  uint16_t         PrescalerArray16[PRESCALER_NUM] = {1, 8, 64, 256, 1024};
 const  uint16_t         PrescalerArray8[PRESCALER_NUM] = {1, 8, 32, 64, 128};
+/* log2 of the above */
+const  uint8_t          PrescalerShift16[PRESCALER_NUM] = {0, 3, 6, 8, 10};
+const  uint8_t          PrescalerShift8[PRESCALER_NUM] = {0, 3, 5, 6, 7};
+/* Encoder count change by previous and new (B<<1)|A levels */
+const  int8_t           QuadratureTable[16] = {0, 1, -1, 0, -1, 0, 0, 1, 1, 0, 0, -1, 0, -1, 1, 0};
 MotorWrapper_t          Motor[MOTOR_NUM];
 TimerWrapper_t          Timer[TIMER_NUM];
 USBPacketOutWrapper_t   USBPacketOut;
+USBPacketOut16Wrapper_t USBPacketOut16;
 USBPacketInWrapper_t    USBPacketIn;
+ReplyQueue_t            ReplyQueue;
+uint8_t                 ProtocolVersion=1;
+SegmentBuffer_t         SegmentBuffer;
+MoveWrapper_t           Move;
+LineWrapper_t           Line;
+HomeWrapper_t           Home;
+EncoderWrapper_t        Encoder;
+TelemetryWrapper_t      Telemetry;
+volatile uint16_t       TicksDropped=0;  /* Tick interrupts that found the last one still Busy */
 uint8_t                 IO_Enabled=0;
 
 /* Task Definitions: */
@@ -172,6 +484,13 @@ void UpdateStatus(uint8_t CurrentStatus);
 #if defined(INCLUDE_FROM_STAGEUSBDEVICE_C)
 static void USBPacket_Read(void);
 static void USBPacket_Write(void);
+static void USBPacket_Send(void);
+static void USBPacket_Flush(void);
+static void Reply_Init(void);
+static uint8_t Reply_Free(void);
+static void USBPacket_SetStatus(void);
+static void MotorStatus_Narrow(MotorStatus16_t *Narrow, MotorStatus_t *Status);
+static void MotorStatus_Widen(MotorStatus_t *Status, MotorStatus16_t *Narrow);
 static void IO_Init(void);
 static void IO_Disconnect(void);
 static void Timer_Init(void);
@@ -180,6 +499,44 @@ static void Timer_Off(uint8_t Timer_N);
 static void Motor_Init(void);
 static void Motor_Update(uint8_t Motor_N);
 static void Motor_Update_All(void);
+static void Motor_SetPoint(uint8_t Motor_N, MotorStatus_t *Setpoint);
+static void Motor_SetAcceleration(uint8_t Motor_N, uint16_t Acceleration);
+static void Motor_Stop(uint8_t Motor_N);
+static void Motor_Ramp(uint8_t Motor_N);
+static void Segment_Init(void);
+static void Segment_Clear(void);
+static void Segment_StopMotors(uint8_t MotorMask);
+static uint8_t Segment_Push(SegmentWrapper_t *Segment);
+static uint8_t Segment_PushPacket(void);
+static uint8_t Segment_Free(void);
+static void Segment_Tick(void);
+static void Move_Abort(void);
+static void Move_Check(void);
+static void Move_Notify(void);
+static void Line_Start(uint8_t MotorMask, MotorStatus_t *Setpoint);
+static void Line_Step(uint8_t Stepped);
+static void Line_Tick(void);
+static void Line_End(void);
+static void Line_Abort(void);
+static void Input_Init(void);
+static uint8_t Limit_Pressed(uint8_t Motor_N);
+static uint8_t Limit_Status(void);
+static void Limit_Change(uint8_t Motor_N);
+static void Limit_Stop(uint8_t Motor_N);
+static void Motor_Halt(uint8_t Motor_N);
+static uint8_t Motor_Running(uint8_t Motor_N);
+static uint8_t Motor_Stopped(uint8_t Motor_N);
+static void Home_Start(uint8_t MotorMask, MotorStatus_t *Setpoint);
+static void Home_Move(uint8_t Motor_N, int32_t Distance, uint32_t Frequency);
+static void Home_Check(void);
+static void Home_Abort(void);
+static void Encoder_Configure(uint8_t Motor_N, EncoderConfig_t *Config);
+static void Encoder_Zero(uint8_t Motor_N);
+static void Encoder_Update(uint8_t Encoder_N, uint8_t State);
+static void Encoder_Check(void);
+static void Telemetry_Init(void);
+static void Telemetry_Tick(void);
+static void Telemetry_Send(void);
 //static void Position_Update(volatile uint8_t Motor_N);
 #endif
 
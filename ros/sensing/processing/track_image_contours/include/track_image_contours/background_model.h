@@ -0,0 +1,81 @@
+// background_model.h
+//
+// Running background estimate for the plate ROI.  Each pixel keeps an
+// exponentially weighted mean and variance, updated every frame at the
+// given rate except where the pixel is foreground or inside the bounding
+// box of a tracked blob, so the background follows lighting drift without
+// absorbing the flies and robots standing on it.  A pixel is foreground
+// when it differs from the mean by more than the larger of the threshold
+// and a multiple of its standard deviation, so flickering pixels stop
+// turning up as blobs.
+//
+// The update runs four pixels to an SSE2 register where the compiler
+// has it, and pixel by pixel, with the same arithmetic, otherwise.
+
+#ifndef TRACK_IMAGE_CONTOURS_BACKGROUND_MODEL_H
+#define TRACK_IMAGE_CONTOURS_BACKGROUND_MODEL_H
+
+#include "track_image_contours/blob_extractor.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace track_image_contours
+{
+
+  class BackgroundModel
+  {
+  public:
+    BackgroundModel();
+
+    // Sets the ROI size and starts over from a black background
+    void setSize(int width, int height);
+
+    // Fraction of the way each background pixel moves toward the image
+    // per update, 0 for a fixed background
+    void setRate(float rate) { rate_ = rate; }
+    // Standard deviations a pixel has to differ by to be foreground, 0
+    // to use the threshold alone
+    void setVarianceGain(float gain) { gain_ = gain; }
+    // Smallest difference that counts as foreground
+    void setThreshold(int threshold) { threshold_ = threshold; }
+    // Pixels around a tracked blob's bounding box left out of the update
+    void setHoldMargin(int margin) { margin_ = margin; }
+
+    // Starts the mean from a width x height 8 bit image, rows step bytes
+    // apart, with no variance
+    void reset(const uint8_t* image, int step);
+
+    // Blends the image into the background except at nonzero foreground
+    // pixels and around the bounding boxes of the first count blobs
+    void update(const uint8_t* image, int step, const uint8_t* foreground, int foreground_step,
+                const V_Blob& blobs, size_t count);
+
+    // The rounded mean and the per pixel foreground threshold as of the
+    // last reset or update, width x height with rows width bytes apart
+    const uint8_t* getBackground() const { return &background_[0]; }
+    const uint8_t* getThresholds() const { return &thresholds_[0]; }
+
+  private:
+    void holdRow(int y, const uint8_t* foreground, const V_Blob& blobs, size_t count);
+
+    int width_;
+    int height_;
+    float rate_;
+    float gain_;
+    int threshold_;
+    int margin_;
+
+    std::vector<float> mean_;
+    std::vector<float> variance_;
+    std::vector<uint8_t> background_;
+    std::vector<uint8_t> thresholds_;
+    // Pixels of the row being updated left as they are, nonzero to hold
+    std::vector<uint8_t> hold_;
+  };
+
+}
+
+#endif
@@ -0,0 +1,179 @@
+// blob_extractor.h
+//
+// Finds the foreground blobs in the plate ROI in a single pass over the
+// image.  Each pixel is differenced against the background, masked and
+// thresholded, and each row's foreground is gathered into runs, summing
+// their moments along the row.  Runs are then labelled into 8-connected
+// components against the runs of the row above, each label accumulating
+// the moments of its runs; labels that turn out to touch are merged at
+// the end.  No contour is traced, filled or remeasured, and past the
+// threshold itself the work goes with the foreground, not the ROI.  The
+// run buffers are sized for the widest row once, in setSize, and the
+// labels' storage is kept from one image to the next, so an image costs
+// no allocation once one as busy has been seen.
+//
+// Moments are weighted by the background difference, as cv.Moments of
+// the thresholded foreground image weighted them in ImageProcessor.py, so
+// areas compare with the same robot_min_area and robot_max_area.
+//
+// With morphology on, the thresholded foreground is packed into a
+// PackedMask and opened and closed before the runs are read back out of
+// it, which takes a second, foreground only, pass over the image.
+
+#ifndef TRACK_IMAGE_CONTOURS_BLOB_EXTRACTOR_H
+#define TRACK_IMAGE_CONTOURS_BLOB_EXTRACTOR_H
+
+#include "track_image_contours/packed_mask.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace track_image_contours
+{
+
+  struct Blob
+  {
+    // Sum of the background difference over the blob
+    double area;
+    // Centroid in ROI pixels
+    double x;
+    double y;
+    // Central moments
+    double mu20;
+    double mu11;
+    double mu02;
+    double mu30;
+    double mu21;
+    double mu12;
+    double mu03;
+    // Foreground pixels in the blob and their bounding box
+    int pixels;
+    int x_min;
+    int y_min;
+    int x_max;
+    int y_max;
+  };
+  typedef std::vector<Blob> V_Blob;
+
+  // Rectangle of the ROI, in ROI pixels
+  struct Window
+  {
+    int x;
+    int y;
+    int width;
+    int height;
+  };
+  typedef std::vector<Window> V_Window;
+
+  class BlobExtractor
+  {
+  public:
+    BlobExtractor();
+
+    // Sets the ROI size, clearing the mask to all on and the background
+    // to black
+    void setSize(int width, int height);
+    int getWidth() const { return width_; }
+    int getHeight() const { return height_; }
+
+    // Copies width x height 8 bit images, rows step bytes apart.
+    // Differences from the background are ANDed with the mask, so pixels
+    // off the mask are never foreground.
+    void setMask(const uint8_t* mask, int step);
+    void setBackground(const uint8_t* background, int step);
+
+    // Pixels differing from the background by more than threshold are
+    // foreground, the same threshold everywhere or one per pixel
+    void setThreshold(int threshold);
+    void setThresholds(const uint8_t* thresholds, int step);
+
+    // Blobs of at least min_pixels foreground pixels, largest area first
+    void setMinPixels(int min_pixels) { min_pixels_ = min_pixels; }
+
+    // Radii of the square the foreground is opened and then closed by, 0
+    // to skip either.  Pixels the closing adds are weighted by their
+    // difference like any other, below the threshold as it is.
+    void setMorphology(int open_radius, int close_radius);
+
+    // One pass over a width x height image.  If diff or foreground are
+    // given, they receive the background difference and the thresholded
+    // difference (0 where background), each with rows step bytes apart.
+    void extract(const uint8_t* image, int step, V_Blob& blobs,
+                 uint8_t* diff = NULL, uint8_t* foreground = NULL, int out_step = 0);
+
+    // The same over the given windows of the ROI only, which must not
+    // overlap; image, diff and foreground still start at the ROI origin.
+    // A blob cut by a window edge is reported as far as it is inside.
+    void extract(const uint8_t* image, int step, const V_Window& windows, V_Blob& blobs,
+                 uint8_t* diff = NULL, uint8_t* foreground = NULL, int out_step = 0);
+
+  private:
+    // Moment sums of a provisional label
+    struct Sums
+    {
+      int64_t m00;
+      int64_t m10;
+      int64_t m01;
+      int64_t m20;
+      int64_t m11;
+      int64_t m02;
+      int64_t m30;
+      int64_t m21;
+      int64_t m12;
+      int64_t m03;
+      int pixels;
+      int x_min;
+      int y_min;
+      int x_max;
+      int y_max;
+    };
+
+    // Foreground run of a row, columns x_min to x_max, with its moment
+    // sums along the row
+    struct Run
+    {
+      int x_min;
+      int x_max;
+      int label;
+      int64_t s0;
+      int64_t s1;
+      int64_t s2;
+      int64_t s3;
+    };
+
+    void scan(const uint8_t* image, int step, const Window& window,
+              uint8_t* diff, uint8_t* foreground, int out_step);
+    void scanCleaned(const uint8_t* image, int step, const Window& window,
+                     uint8_t* diff, uint8_t* foreground, int out_step);
+    void labelRuns(int y);
+    void collect(V_Blob& blobs);
+    int newLabel(int x, int y);
+    int findRoot(int label);
+    int unite(int a, int b);
+    void addSums(Sums& to, const Sums& from);
+
+    int width_;
+    int height_;
+    int min_pixels_;
+    std::vector<uint8_t> mask_;
+    std::vector<uint8_t> background_;
+    std::vector<uint8_t> thresholds_;
+    int open_radius_;
+    int close_radius_;
+    // Thresholded foreground of the window being cleaned
+    PackedMask packed_;
+
+    // Runs of the previous and current rows of a window, left to right;
+    // a row has at most (width + 1)/2
+    std::vector<Run> runs_prev_;
+    std::vector<Run> runs_cur_;
+    // Union-find over provisional labels; parent_[0] is background
+    std::vector<int> parent_;
+    std::vector<Sums> sums_;
+  };
+
+}
+
+#endif
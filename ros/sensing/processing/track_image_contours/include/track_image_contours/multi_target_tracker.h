@@ -0,0 +1,136 @@
+// multi_target_tracker.h
+//
+// Follows any number of targets from one set of detections to the next.
+// Each track runs a constant velocity Kalman filter, the same model as
+// plate_tf's, with x and y filtered independently; as both axes see the
+// same time steps and measurements they share one covariance.  Each image
+// the tracks are predicted to its time and detections are assigned to
+// them by the Hungarian method, minimizing the total squared Mahalanobis
+// distance, with pairs further apart than the gate never assigned.  A
+// detection left over starts a track, which is confirmed once it has
+// been assigned a detection in confirm_hits images and dropped if it
+// misses one before then.  A confirmed track that goes more than
+// max_missed images in a row without one is dropped.
+//
+// A detection's heading may point either way along its axis.  Each
+// track takes the end favoured by the detection's skew, the direction it
+// is moving (fully from heading_speed up) and its heading before, with
+// skew weighed by skew_gain.  Headings are counterclockwise from x with
+// y up; setYUp says whether the coordinates' own y is up too, as in
+// Plate, or down, as in the image frames, so that the direction of
+// motion is taken the same way.
+
+#ifndef TRACK_IMAGE_CONTOURS_MULTI_TARGET_TRACKER_H
+#define TRACK_IMAGE_CONTOURS_MULTI_TARGET_TRACKER_H
+
+#include <stdint.h>
+
+#include <vector>
+
+namespace track_image_contours
+{
+
+  struct Detection
+  {
+    double x;
+    double y;
+    // Variance of x and y, added to the measurement noise
+    double position_variance;
+    // Heading in radians and the variance of its axis
+    double theta;
+    double theta_variance;
+    // Skewness toward theta, see pose_estimator.h
+    double skew;
+    double area;
+    double ecc;
+  };
+  typedef std::vector<Detection> V_Detection;
+
+  struct TrackState
+  {
+    uint32_t id;
+    // Filtered position and velocity per second
+    double x;
+    double y;
+    double x_velocity;
+    double y_velocity;
+    // Covariance of position and velocity along either axis
+    double p_pos;
+    double p_pos_vel;
+    double p_vel;
+    // Heading, settled between the ends of the last detection
+    double theta;
+    double theta_variance;
+    // As last detected
+    double area;
+    double ecc;
+    int age;
+    int hits;
+    int missed;
+  };
+  typedef std::vector<TrackState> V_TrackState;
+
+  class MultiTargetTracker
+  {
+  public:
+    MultiTargetTracker();
+
+    // Acceleration noise, in units/s^2 per sqrt(Hz), and the measurement
+    // noise of a detection, in units
+    void setProcessNoise(double noise) { process_noise_ = noise; }
+    void setMeasurementNoise(double noise) { measurement_noise_ = noise; }
+    // Standard deviation of the velocity of a new track, in units/s
+    void setInitialVelocity(double velocity) { initial_velocity_ = velocity; }
+    // Largest Mahalanobis distance a detection can be assigned at
+    void setGate(double gate) { gate_ = gate; }
+    // Speed, in units/s, from which motion settles the heading
+    void setHeadingSpeed(double speed) { heading_speed_ = speed; }
+    // Weight of a detection's skew against motion and history
+    void setSkewGain(double gain) { skew_gain_ = gain; }
+    // Whether y of the positions points up, default false for image
+    // coordinates
+    void setYUp(bool y_up) { y_up_ = y_up; }
+    void setConfirmHits(int hits) { confirm_hits_ = hits; }
+    void setMaxMissed(int missed) { max_missed_ = missed; }
+
+    // Drops every track
+    void clear();
+
+    // Advances the tracks to time, in seconds, and assigns them the
+    // detections made then
+    void update(double time, const V_Detection& detections);
+
+    // Every track, confirmed or not
+    const V_TrackState& getTracks() const { return tracks_; }
+    bool isConfirmed(const TrackState& track) const { return track.hits >= confirm_hits_; }
+
+  private:
+    void predict(TrackState& track, double dt) const;
+    void correct(TrackState& track, const Detection& detection) const;
+    double distance2(const TrackState& track, const Detection& detection) const;
+    double heading(const TrackState& track, const Detection& detection) const;
+    void startTrack(const Detection& detection);
+
+    double process_noise_;
+    double measurement_noise_;
+    double initial_velocity_;
+    double gate_;
+    double heading_speed_;
+    double skew_gain_;
+    bool y_up_;
+    int confirm_hits_;
+    int max_missed_;
+
+    bool started_;
+    double time_;
+    uint32_t next_id_;
+    V_TrackState tracks_;
+
+    // Scratch for the assignment, kept to save reallocating it each image
+    std::vector<double> cost_;
+    std::vector<int> assignment_;
+  };
+
+}
+
+#endif
@@ -0,0 +1,62 @@
+// packed_mask.h
+//
+// Binary image packed 64 pixels to a word, bit k of word j of a row
+// being column 64 j + k, for morphology on the thresholded foreground.
+// Opening and closing are by a square, which is separable: a pass along
+// the rows shifting whole words, then a pass down the columns combining
+// whole rows, so each pixel costs a few word operations over 64.  As
+// cvErode and cvDilate do, erosion takes outside the image to be set and
+// dilation takes it to be clear, so blobs at the edge are not eaten
+// into.
+
+#ifndef TRACK_IMAGE_CONTOURS_PACKED_MASK_H
+#define TRACK_IMAGE_CONTOURS_PACKED_MASK_H
+
+#include <stdint.h>
+
+#include <vector>
+
+namespace track_image_contours
+{
+
+  class PackedMask
+  {
+  public:
+    PackedMask();
+
+    // Sets the size, clearing every pixel; storage is kept for reuse
+    void setSize(int width, int height);
+    int getWidth() const { return width_; }
+    int getHeight() const { return height_; }
+    int getWordsPerRow() const { return words_; }
+
+    // Bits past the width in a row's last word must be left clear
+    uint64_t* row(int y) { return &bits_[y*words_]; }
+    const uint64_t* row(int y) const { return &bits_[y*words_]; }
+
+    // Set pixels with a clear one within radius in either direction are
+    // cleared, and the reverse
+    void erode(int radius);
+    void dilate(int radius);
+    // Erosion then dilation, dropping specks and whiskers narrower than
+    // 2 radius + 1; dilation then erosion, filling holes and gaps as
+    // narrow
+    void open(int radius);
+    void close(int radius);
+
+  private:
+    void shiftRows(int radius, bool erode);
+    void combineRows(int radius, bool erode);
+
+    int width_;
+    int height_;
+    int words_;
+    // Bits of a row's last word that are inside the image
+    uint64_t last_word_;
+    std::vector<uint64_t> bits_;
+    std::vector<uint64_t> scratch_;
+  };
+
+}
+
+#endif
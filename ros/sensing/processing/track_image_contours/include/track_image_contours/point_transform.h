@@ -0,0 +1,43 @@
+// point_transform.h
+//
+// Plane to plane transform, projective in general, applied to all of an
+// image's contours in one go rather than one tf or service call each.
+// Headings and covariances are carried through the transform's Jacobian
+// at each point.
+
+#ifndef TRACK_IMAGE_CONTOURS_POINT_TRANSFORM_H
+#define TRACK_IMAGE_CONTOURS_POINT_TRANSFORM_H
+
+#include <stddef.h>
+
+namespace track_image_contours
+{
+
+  class PointTransform
+  {
+  public:
+    // Identity
+    PointTransform();
+
+    // Row major 3x3 matrix taking homogeneous (x, y, 1) to the output
+    void setMatrix(const double matrix[9]);
+    const double* getMatrix() const { return matrix_; }
+
+    // This transform after other
+    PointTransform operator*(const PointTransform& other) const;
+    // False, leaving it as it is, if the matrix is singular
+    bool invert();
+
+    // Maps n points in place.  theta, if given, holds angles of
+    // directions at the points, counterclockwise from x in the
+    // coordinates' own sense; xx, xy and yy, if given, their covariances.
+    void apply(size_t n, double* x, double* y, double* theta = NULL,
+               double* xx = NULL, double* xy = NULL, double* yy = NULL) const;
+
+  private:
+    double matrix_[9];
+  };
+
+}
+
+#endif
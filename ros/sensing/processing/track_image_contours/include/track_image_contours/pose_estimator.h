@@ -0,0 +1,50 @@
+// pose_estimator.h
+//
+// Pose of a blob from the moments BlobExtractor sums, with no further
+// pass over the image.  The centroid is the difference weighted one, so
+// it is already sub-pixel.  The heading runs along the major axis toward
+// the end the third moment along the axis is skewed to, the thin end of
+// the blob: for a fly seen from above, the head rather than the wider
+// abdomen.  Where the blob is near symmetric, skew is near 0 and the
+// heading is no better than a coin toss; MultiTargetTracker then decides
+// it from the motion and previous heading of the track.
+//
+// The covariances assume independent pixel noise of standard deviation
+// noise in the background difference.
+
+#ifndef TRACK_IMAGE_CONTOURS_POSE_ESTIMATOR_H
+#define TRACK_IMAGE_CONTOURS_POSE_ESTIMATOR_H
+
+#include "track_image_contours/blob_extractor.h"
+
+namespace track_image_contours
+{
+
+  struct BlobPose
+  {
+    // Centroid in ROI pixels
+    double x;
+    double y;
+    // Heading in [0, 2 pi), counterclockwise from x with image y up as
+    // ContourInfo's theta always was
+    double theta;
+    // Skewness along the heading, 0 or more; around 0.1 is already a
+    // clear difference between the ends
+    double skew;
+    // Ratio of the second moments along the major and minor axes, 0 for
+    // a line one pixel wide
+    double ecc;
+    // Covariance of the centroid, pixels^2
+    double x_variance;
+    double y_variance;
+    double xy_covariance;
+    // Variance of the direction of the major axis, rad^2, at most that
+    // of an angle uniform over pi for a round blob
+    double theta_variance;
+  };
+
+  void estimatePose(const Blob& blob, double noise, BlobPose& pose);
+
+}
+
+#endif
@@ -320,6 +320,9 @@ class ImageProcessor:
     # Find contours
     image_sum = cv.Sum(self.im_foreground_binary)
     if self.image_sum_min < image_sum[0]:
+      # Fresh storage each image, or the contours of every image so far
+      # pile up in it
+      self.storage = cv.CreateMemStorage()
       self.contour_seq = cv.FindContours(self.im_foreground_binary,self.storage,mode=cv.CV_RETR_CCOMP)
     else:
       self.contour_seq = None
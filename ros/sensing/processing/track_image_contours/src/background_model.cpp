@@ -0,0 +1,154 @@
+// background_model.cpp
+
+#include "track_image_contours/background_model.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace track_image_contours
+{
+
+  // One pixel of the update, as the SSE2 loop does four
+  static inline void updatePixel(float value, bool update, float rate, float keep, float gain, float threshold,
+                                 float& mean, float& variance, uint8_t& background, uint8_t& foreground_threshold)
+  {
+    if (update)
+      {
+        float d = value - mean;
+        float step = rate*d;
+        mean = mean + step;
+        variance = keep*(variance + step*d);
+      }
+    background = (uint8_t)lrintf(mean);
+    float t = std::min(std::max(gain*sqrtf(variance), threshold), 255.0f);
+    foreground_threshold = (uint8_t)lrintf(t);
+  }
+
+  BackgroundModel::BackgroundModel()
+    : width_(0)
+    , height_(0)
+    , rate_(0)
+    , gain_(0)
+    , threshold_(30)
+    , margin_(4)
+  {
+  }
+
+  void BackgroundModel::setSize(int width, int height)
+  {
+    width_ = width;
+    height_ = height;
+    mean_.assign(width*height, 0);
+    variance_.assign(width*height, 0);
+    background_.assign(width*height, 0);
+    thresholds_.assign(width*height, std::min(threshold_, 255));
+    hold_.assign(width, 0);
+  }
+
+  void BackgroundModel::reset(const uint8_t* image, int step)
+  {
+    for (int y = 0; y < height_; ++y)
+      {
+        const uint8_t* row = image + y*step;
+        for (int x = 0; x < width_; ++x)
+          {
+            mean_[y*width_ + x] = row[x];
+            variance_[y*width_ + x] = 0;
+          }
+        memcpy(&background_[y*width_], row, width_);
+      }
+    std::fill(thresholds_.begin(), thresholds_.end(), std::min(threshold_, 255));
+  }
+
+  void BackgroundModel::holdRow(int y, const uint8_t* foreground, const V_Blob& blobs, size_t count)
+  {
+    memcpy(&hold_[0], foreground, width_);
+    for (size_t i = 0; i < count && i < blobs.size(); ++i)
+      {
+        const Blob& blob = blobs[i];
+        if (y < blob.y_min - margin_ || blob.y_max + margin_ < y)
+          {
+            continue;
+          }
+        int x_min = std::max(blob.x_min - margin_, 0);
+        int x_max = std::min(blob.x_max + margin_, width_ - 1);
+        memset(&hold_[x_min], 0xFF, x_max - x_min + 1);
+      }
+  }
+
+  void BackgroundModel::update(const uint8_t* image, int step, const uint8_t* foreground, int foreground_step,
+                               const V_Blob& blobs, size_t count)
+  {
+    float keep = 1 - rate_;
+    float threshold = (float)threshold_;
+
+    for (int y = 0; y < height_; ++y)
+      {
+        const uint8_t* row = image + y*step;
+        holdRow(y, foreground + y*foreground_step, blobs, count);
+        float* mean = &mean_[y*width_];
+        float* variance = &variance_[y*width_];
+        uint8_t* background = &background_[y*width_];
+        uint8_t* thresholds = &thresholds_[y*width_];
+        const uint8_t* hold = &hold_[0];
+        int x = 0;
+
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        const __m128 rate4 = _mm_set1_ps(rate_);
+        const __m128 keep4 = _mm_set1_ps(keep);
+        const __m128 gain4 = _mm_set1_ps(gain_);
+        const __m128 threshold4 = _mm_set1_ps(threshold);
+        const __m128 max4 = _mm_set1_ps(255.0f);
+        for (; x + 16 <= width_; x += 16)
+          {
+            __m128i pixels8 = _mm_loadu_si128((const __m128i*)(row + x));
+            __m128i update8 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(hold + x)), zero);
+            __m128i background16[2];
+            __m128i thresholds16[2];
+            for (int half = 0; half < 2; ++half)
+              {
+                __m128i pixels16 = half ? _mm_unpackhi_epi8(pixels8, zero) : _mm_unpacklo_epi8(pixels8, zero);
+                __m128i update16 = half ? _mm_unpackhi_epi8(update8, update8) : _mm_unpacklo_epi8(update8, update8);
+                __m128i background32[2];
+                __m128i thresholds32[2];
+                for (int quarter = 0; quarter < 2; ++quarter)
+                  {
+                    int i = x + 8*half + 4*quarter;
+                    __m128 value = _mm_cvtepi32_ps(quarter ? _mm_unpackhi_epi16(pixels16, zero) : _mm_unpacklo_epi16(pixels16, zero));
+                    __m128 update = _mm_castsi128_ps(quarter ? _mm_unpackhi_epi16(update16, update16) : _mm_unpacklo_epi16(update16, update16));
+                    __m128 m = _mm_loadu_ps(mean + i);
+                    __m128 v = _mm_loadu_ps(variance + i);
+                    __m128 d = _mm_sub_ps(value, m);
+                    __m128 s = _mm_mul_ps(rate4, d);
+                    m = _mm_add_ps(m, _mm_and_ps(update, s));
+                    __m128 v_new = _mm_mul_ps(keep4, _mm_add_ps(v, _mm_mul_ps(s, d)));
+                    v = _mm_or_ps(_mm_and_ps(update, v_new), _mm_andnot_ps(update, v));
+                    _mm_storeu_ps(mean + i, m);
+                    _mm_storeu_ps(variance + i, v);
+                    __m128 t = _mm_min_ps(_mm_max_ps(_mm_mul_ps(gain4, _mm_sqrt_ps(v)), threshold4), max4);
+                    background32[quarter] = _mm_cvtps_epi32(m);
+                    thresholds32[quarter] = _mm_cvtps_epi32(t);
+                  }
+                background16[half] = _mm_packs_epi32(background32[0], background32[1]);
+                thresholds16[half] = _mm_packs_epi32(thresholds32[0], thresholds32[1]);
+              }
+            _mm_storeu_si128((__m128i*)(background + x), _mm_packus_epi16(background16[0], background16[1]));
+            _mm_storeu_si128((__m128i*)(thresholds + x), _mm_packus_epi16(thresholds16[0], thresholds16[1]));
+          }
+#endif
+
+        for (; x < width_; ++x)
+          {
+            updatePixel(row[x], hold[x] == 0, rate_, keep, gain_, threshold,
+                        mean[x], variance[x], background[x], thresholds[x]);
+          }
+      }
+  }
+
+}
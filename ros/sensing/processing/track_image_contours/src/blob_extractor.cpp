@@ -0,0 +1,433 @@
+// blob_extractor.cpp
+
+#include "track_image_contours/blob_extractor.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace track_image_contours
+{
+
+  static bool largerArea(const Blob& a, const Blob& b)
+  {
+    return a.area > b.area;
+  }
+
+  BlobExtractor::BlobExtractor()
+    : width_(0)
+    , height_(0)
+    , min_pixels_(1)
+    , open_radius_(0)
+    , close_radius_(0)
+  {
+  }
+
+  void BlobExtractor::setSize(int width, int height)
+  {
+    width_ = width;
+    height_ = height;
+    mask_.assign(width*height, 0xFF);
+    background_.assign(width*height, 0);
+    thresholds_.assign(width*height, 30);
+    runs_prev_.clear();
+    runs_cur_.clear();
+    runs_prev_.reserve((width + 1)/2);
+    runs_cur_.reserve((width + 1)/2);
+  }
+
+  void BlobExtractor::setMask(const uint8_t* mask, int step)
+  {
+    for (int y = 0; y < height_; ++y)
+      {
+        memcpy(&mask_[y*width_], mask + y*step, width_);
+      }
+  }
+
+  void BlobExtractor::setBackground(const uint8_t* background, int step)
+  {
+    for (int y = 0; y < height_; ++y)
+      {
+        memcpy(&background_[y*width_], background + y*step, width_);
+      }
+  }
+
+  void BlobExtractor::setThreshold(int threshold)
+  {
+    std::fill(thresholds_.begin(), thresholds_.end(), std::max(std::min(threshold, 255), 0));
+  }
+
+  void BlobExtractor::setThresholds(const uint8_t* thresholds, int step)
+  {
+    for (int y = 0; y < height_; ++y)
+      {
+        memcpy(&thresholds_[y*width_], thresholds + y*step, width_);
+      }
+  }
+
+  void BlobExtractor::setMorphology(int open_radius, int close_radius)
+  {
+    open_radius_ = std::max(open_radius, 0);
+    close_radius_ = std::max(close_radius, 0);
+  }
+
+  int BlobExtractor::newLabel(int x, int y)
+  {
+    Sums sums;
+    memset(&sums, 0, sizeof(sums));
+    sums.x_min = sums.x_max = x;
+    sums.y_min = sums.y_max = y;
+    parent_.push_back(parent_.size());
+    sums_.push_back(sums);
+    return parent_.size() - 1;
+  }
+
+  int BlobExtractor::findRoot(int label)
+  {
+    int root = label;
+    while (parent_[root] != root)
+      {
+        root = parent_[root];
+      }
+    // Flatten the path behind us
+    while (parent_[label] != root)
+      {
+        int next = parent_[label];
+        parent_[label] = root;
+        label = next;
+      }
+    return root;
+  }
+
+  int BlobExtractor::unite(int a, int b)
+  {
+    a = findRoot(a);
+    b = findRoot(b);
+    // The older label survives, so roots stay the smallest in their set
+    if (a < b)
+      {
+        parent_[b] = a;
+        return a;
+      }
+    parent_[a] = b;
+    return b;
+  }
+
+  void BlobExtractor::addSums(Sums& to, const Sums& from)
+  {
+    to.m00 += from.m00;
+    to.m10 += from.m10;
+    to.m01 += from.m01;
+    to.m20 += from.m20;
+    to.m11 += from.m11;
+    to.m02 += from.m02;
+    to.m30 += from.m30;
+    to.m21 += from.m21;
+    to.m12 += from.m12;
+    to.m03 += from.m03;
+    to.pixels += from.pixels;
+    to.x_min = std::min(to.x_min, from.x_min);
+    to.y_min = std::min(to.y_min, from.y_min);
+    to.x_max = std::max(to.x_max, from.x_max);
+    to.y_max = std::max(to.y_max, from.y_max);
+  }
+
+  void BlobExtractor::extract(const uint8_t* image, int step, V_Blob& blobs,
+                              uint8_t* diff, uint8_t* foreground, int out_step)
+  {
+    Window roi = {0, 0, width_, height_};
+    parent_.assign(1, 0);
+    sums_.resize(1);
+    if (open_radius_ > 0 || close_radius_ > 0)
+      {
+        scanCleaned(image, step, roi, diff, foreground, out_step);
+      }
+    else
+      {
+        scan(image, step, roi, diff, foreground, out_step);
+      }
+    collect(blobs);
+  }
+
+  void BlobExtractor::extract(const uint8_t* image, int step, const V_Window& windows, V_Blob& blobs,
+                              uint8_t* diff, uint8_t* foreground, int out_step)
+  {
+    parent_.assign(1, 0);
+    sums_.resize(1);
+    for (size_t i = 0; i < windows.size(); ++i)
+      {
+        if (open_radius_ > 0 || close_radius_ > 0)
+          {
+            scanCleaned(image, step, windows[i], diff, foreground, out_step);
+          }
+        else
+          {
+            scan(image, step, windows[i], diff, foreground, out_step);
+          }
+      }
+    collect(blobs);
+  }
+
+  void BlobExtractor::scan(const uint8_t* image, int step, const Window& window,
+                           uint8_t* diff, uint8_t* foreground, int out_step)
+  {
+    runs_prev_.clear();
+    int x_begin = window.x;
+    int x_end = window.x + window.width;
+
+    for (int y = window.y; y < window.y + window.height; ++y)
+      {
+        const uint8_t* row = image + y*step;
+        const uint8_t* mask = &mask_[y*width_];
+        const uint8_t* background = &background_[y*width_];
+        const uint8_t* thresholds = &thresholds_[y*width_];
+        uint8_t* diff_row = diff ? diff + y*out_step : NULL;
+        uint8_t* foreground_row = foreground ? foreground + y*out_step : NULL;
+        runs_cur_.clear();
+        Run* run = NULL;
+
+        for (int x = x_begin; x < x_end; ++x)
+          {
+            int d = abs(row[x] - background[x]) & mask[x];
+            if (diff_row)
+              {
+                diff_row[x] = d;
+              }
+            if (d <= thresholds[x])
+              {
+                if (foreground_row)
+                  {
+                    foreground_row[x] = 0;
+                  }
+                run = NULL;
+                continue;
+              }
+            if (foreground_row)
+              {
+                foreground_row[x] = d;
+              }
+
+            if (run == NULL)
+              {
+                runs_cur_.push_back(Run());
+                run = &runs_cur_.back();
+                run->x_min = x;
+                run->s0 = run->s1 = run->s2 = run->s3 = 0;
+              }
+            run->x_max = x;
+            int64_t dx = d*(int64_t)x;
+            int64_t dxx = dx*x;
+            run->s0 += d;
+            run->s1 += dx;
+            run->s2 += dxx;
+            run->s3 += dxx*x;
+          }
+        labelRuns(y);
+        runs_prev_.swap(runs_cur_);
+      }
+  }
+
+  // As scan, but thresholding into packed_ first, cleaning it up, and
+  // only then reading the runs and their moments out of the image
+  void BlobExtractor::scanCleaned(const uint8_t* image, int step, const Window& window,
+                                  uint8_t* diff, uint8_t* foreground, int out_step)
+  {
+    packed_.setSize(window.width, window.height);
+    int words = packed_.getWordsPerRow();
+    for (int y = window.y; y < window.y + window.height; ++y)
+      {
+        const uint8_t* row = image + y*step + window.x;
+        const uint8_t* mask = &mask_[y*width_ + window.x];
+        const uint8_t* background = &background_[y*width_ + window.x];
+        const uint8_t* thresholds = &thresholds_[y*width_ + window.x];
+        uint8_t* diff_row = diff ? diff + y*out_step + window.x : NULL;
+        uint64_t* bits = packed_.row(y - window.y);
+        for (int j = 0; j < words; ++j)
+          {
+            int x_begin = 64*j;
+            int x_end = std::min(x_begin + 64, window.width);
+            uint64_t word = 0;
+            for (int x = x_begin; x < x_end; ++x)
+              {
+                int d = abs(row[x] - background[x]) & mask[x];
+                if (diff_row)
+                  {
+                    diff_row[x] = d;
+                  }
+                word |= (uint64_t)(d > thresholds[x]) << (x - x_begin);
+              }
+            bits[j] = word;
+          }
+        if (foreground)
+          {
+            memset(foreground + y*out_step + window.x, 0, window.width);
+          }
+      }
+
+    if (open_radius_ > 0)
+      {
+        packed_.open(open_radius_);
+      }
+    if (close_radius_ > 0)
+      {
+        packed_.close(close_radius_);
+      }
+
+    runs_prev_.clear();
+    for (int y = window.y; y < window.y + window.height; ++y)
+      {
+        const uint8_t* row = image + y*step;
+        const uint8_t* mask = &mask_[y*width_];
+        const uint8_t* background = &background_[y*width_];
+        uint8_t* foreground_row = foreground ? foreground + y*out_step : NULL;
+        const uint64_t* bits = packed_.row(y - window.y);
+        runs_cur_.clear();
+
+        // Runs are read a word at a time, jumping to the next set bit and
+        // then the next clear one
+        int start = -1;
+        for (int j = 0; j < words; ++j)
+          {
+            uint64_t word = bits[j];
+            int k = 0;
+            while (k < 64)
+              {
+                uint64_t rest = ((start < 0) ? word : ~word) >> k;
+                if (rest == 0)
+                  {
+                    break;
+                  }
+                k += __builtin_ctzll(rest);
+                if (start < 0)
+                  {
+                    start = 64*j + k;
+                  }
+                else
+                  {
+                    Run run = {window.x + start, window.x + 64*j + k - 1, 0, 0, 0, 0, 0};
+                    runs_cur_.push_back(run);
+                    start = -1;
+                  }
+              }
+          }
+        if (start >= 0)
+          {
+            Run run = {window.x + start, window.x + window.width - 1, 0, 0, 0, 0, 0};
+            runs_cur_.push_back(run);
+          }
+
+        for (size_t i = 0; i < runs_cur_.size(); ++i)
+          {
+            Run& run = runs_cur_[i];
+            for (int x = run.x_min; x <= run.x_max; ++x)
+              {
+                int d = abs(row[x] - background[x]) & mask[x];
+                if (foreground_row)
+                  {
+                    foreground_row[x] = d;
+                  }
+                int64_t dx = d*(int64_t)x;
+                int64_t dxx = dx*x;
+                run.s0 += d;
+                run.s1 += dx;
+                run.s2 += dxx;
+                run.s3 += dxx*x;
+              }
+          }
+        labelRuns(y);
+        runs_prev_.swap(runs_cur_);
+      }
+  }
+
+  // Gives each run of row y the label of the runs above it that it
+  // touches, uniting them, or a new one, and adds its moments to it
+  void BlobExtractor::labelRuns(int y)
+  {
+    int64_t y1 = y;
+    int64_t y2 = y1*y1;
+    int64_t y3 = y2*y1;
+    size_t above = 0;
+    for (size_t i = 0; i < runs_cur_.size(); ++i)
+      {
+        Run& run = runs_cur_[i];
+        // Runs above ending left of this one's diagonal neighbour are no
+        // use to this or any later run
+        while (above < runs_prev_.size() && runs_prev_[above].x_max + 1 < run.x_min)
+          {
+            ++above;
+          }
+        int label = 0;
+        for (size_t j = above; j < runs_prev_.size() && runs_prev_[j].x_min <= run.x_max + 1; ++j)
+          {
+            int n = runs_prev_[j].label;
+            label = label ? unite(label, n) : n;
+          }
+        if (label == 0)
+          {
+            label = newLabel(run.x_min, y);
+          }
+        run.label = label;
+
+        Sums& sums = sums_[label];
+        sums.m00 += run.s0;
+        sums.m10 += run.s1;
+        sums.m01 += run.s0*y1;
+        sums.m20 += run.s2;
+        sums.m11 += run.s1*y1;
+        sums.m02 += run.s0*y2;
+        sums.m30 += run.s3;
+        sums.m21 += run.s2*y1;
+        sums.m12 += run.s1*y2;
+        sums.m03 += run.s0*y3;
+        sums.pixels += run.x_max - run.x_min + 1;
+        sums.x_min = std::min(sums.x_min, run.x_min);
+        sums.x_max = std::max(sums.x_max, run.x_max);
+        sums.y_max = y;
+      }
+  }
+
+  void BlobExtractor::collect(V_Blob& blobs)
+  {
+    blobs.clear();
+    // Fold the sums of each merged label into its root
+    for (size_t label = 1; label < parent_.size(); ++label)
+      {
+        int root = findRoot(label);
+        if ((size_t)root != label)
+          {
+            addSums(sums_[root], sums_[label]);
+          }
+      }
+
+    for (size_t label = 1; label < parent_.size(); ++label)
+      {
+        const Sums& sums = sums_[label];
+        if ((size_t)parent_[label] != label || sums.pixels < min_pixels_ || sums.m00 == 0)
+          {
+            continue;
+          }
+        Blob blob;
+        double m00 = sums.m00;
+        blob.area = m00;
+        blob.x = sums.m10/m00;
+        blob.y = sums.m01/m00;
+        blob.mu20 = sums.m20 - blob.x*sums.m10;
+        blob.mu11 = sums.m11 - blob.x*sums.m01;
+        blob.mu02 = sums.m02 - blob.y*sums.m01;
+        double x = blob.x;
+        double y = blob.y;
+        blob.mu30 = sums.m30 - 3*x*sums.m20 + 2*x*x*sums.m10;
+        blob.mu21 = sums.m21 - 2*x*sums.m11 - y*sums.m20 + 2*x*x*sums.m01;
+        blob.mu12 = sums.m12 - 2*y*sums.m11 - x*sums.m02 + 2*y*y*sums.m10;
+        blob.mu03 = sums.m03 - 3*y*sums.m02 + 2*y*y*sums.m01;
+        blob.pixels = sums.pixels;
+        blob.x_min = sums.x_min;
+        blob.y_min = sums.y_min;
+        blob.x_max = sums.x_max;
+        blob.y_max = sums.y_max;
+        blobs.push_back(blob);
+      }
+    std::sort(blobs.begin(), blobs.end(), largerArea);
+  }
+
+}
@@ -0,0 +1,1062 @@
+// image_processor_nodelet.cpp
+//
+// C++ port of ImageProcessor.py as a nodelet, so it can share a manager,
+// and its images, with the nodes before and after it.  Masking,
+// background subtraction, thresholding and the moments of every blob come
+// from one BlobExtractor pass over the plate ROI instead of a cv call and
+// a full ROI redraw per contour.  It reads the same parameters and
+// publishes the same ContourInfo.  The diff, foreground and processed
+// images are only made while something subscribes to them, and are drawn
+// and published on a thread of their own, so the image callback never
+// waits on them; frames arriving while it is still busy go undrawn.
+// Unlike the Python node, the background adapts, see background_model.h,
+// and once every blob wanted is found the search can narrow to windows
+// around where each is expected next.
+//
+// A camera can also look at several arenas, each with its own ROI, mask,
+// background and output coordinates, set by arena_count and the arena_N_
+// parameters.  They are processed from the one image in parallel on a
+// pool of worker threads, and each publishes under its own name.
+
+#include "track_image_contours/background_model.h"
+#include "track_image_contours/blob_extractor.h"
+#include "track_image_contours/point_transform.h"
+#include "track_image_contours/pose_estimator.h"
+
+#include <ros/ros.h>
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#include <image_transport/image_transport.h>
+#include <sensor_msgs/Image.h>
+#include <geometry_msgs/PointStamped.h>
+#include <tf/transform_listener.h>
+#include <track_image_contours/ContourInfo.h>
+
+#include <opencv/cv.h>
+#include <opencv/highgui.h>
+#include <cv_bridge/CvBridge.h>
+
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+
+namespace track_image_contours
+{
+
+  class ImageProcessorNodelet : public nodelet::Nodelet
+  {
+  public:
+    ImageProcessorNodelet()
+      : render_busy_(false)
+      , render_stop_(false)
+      , rendered_(0)
+      , render_skipped_(0)
+      , work_image_(NULL)
+      , work_threshold_(0)
+      , work_generation_(0)
+      , next_arena_(0)
+      , arenas_done_(0)
+      , work_stop_(false)
+    {
+    }
+
+    virtual ~ImageProcessorNodelet()
+    {
+      {
+        boost::mutex::scoped_lock lock(work_mutex_);
+        work_stop_ = true;
+      }
+      work_ready_.notify_all();
+      workers_.join_all();
+      {
+        boost::mutex::scoped_lock lock(render_mutex_);
+        render_stop_ = true;
+      }
+      render_wake_.notify_one();
+      render_thread_.join();
+      for (size_t i = 0; i < arenas_.size(); ++i)
+        {
+          releaseImages(*arenas_[i]);
+        }
+    }
+
+  private:
+    // What the debug images are drawn from, handed from the image
+    // callback to the render thread
+    struct DebugFrame
+    {
+      sensor_msgs::ImageConstPtr image;
+      V_Blob blobs;
+      V_Window windows;
+      bool diff;
+      bool foreground;
+      bool processed;
+    };
+
+    // A blob being tracked, with its step since the last image
+    struct Target
+    {
+      double x;
+      double y;
+      double dx;
+      double dy;
+      int half_width;
+      int half_height;
+    };
+
+    // One plate ROI of the image, with everything tracked in it.  Only
+    // one worker at a time touches an arena, and the render thread only
+    // its render_ members and processed image.
+    struct Arena
+    {
+      Arena()
+        : frames_initialized(false)
+        , images_initialized(false)
+        , have_output_transform(false)
+        , frames_since_search(0)
+        , contour_count(-1)
+        , want_diff(false)
+        , want_foreground(false)
+        , want_processed(false)
+        , mask(NULL)
+        , background(NULL)
+        , diff(NULL)
+        , foreground(NULL)
+        , processed(NULL)
+        , render_diff(NULL)
+        , render_foreground(NULL)
+      {
+      }
+
+      // Empty for the single arena of the ImageProcessor.py parameters,
+      // which publishes at the top level
+      std::string name;
+      // Prefix of the arena's own parameters
+      std::string param_prefix;
+      std::string roi_frame;
+      std::string plate_frame;
+      std::string output_coordinates;
+      std::string background_file;
+      int width;
+      int height;
+      // Circle about the plate_frame origin, unless polygon has vertices,
+      // in ROI pixels
+      int mask_radius;
+      std::vector<CvPoint> polygon;
+
+      bool frames_initialized;
+      bool images_initialized;
+      int roi_x;
+      int roi_y;
+      int plate_x;
+      int plate_y;
+
+      // ROI to output coordinates, as of output_transform_time
+      bool have_output_transform;
+      ros::Time output_transform_time;
+      PointTransform output_transform;
+      PointTransform plate_homography;
+      std::vector<BlobPose> poses;
+      std::vector<double> pose_x;
+      std::vector<double> pose_y;
+      std::vector<double> pose_theta;
+      std::vector<double> pose_xx;
+      std::vector<double> pose_xy;
+      std::vector<double> pose_yy;
+
+      BackgroundModel model;
+      BlobExtractor extractor;
+      V_Blob blobs;
+      std::vector<Target> targets;
+      V_Window windows;
+      int frames_since_search;
+      // Blobs reported from this image, -1 if it was not processed
+      int contour_count;
+      bool want_diff;
+      bool want_foreground;
+      bool want_processed;
+
+      IplImage* mask;
+      IplImage* background;
+      IplImage* diff;
+      IplImage* foreground;
+      IplImage* processed;
+      IplImage* render_diff;
+      IplImage* render_foreground;
+      DebugFrame render_frame;
+
+      boost::shared_ptr<image_transport::ImageTransport> it;
+      ros::Publisher contour_info_pub;
+      image_transport::Publisher diff_pub;
+      image_transport::Publisher foreground_pub;
+      image_transport::Publisher processed_pub;
+    };
+    typedef boost::shared_ptr<Arena> ArenaPtr;
+
+    virtual void onInit()
+    {
+      ros::NodeHandle& nh = getNodeHandle();
+      double value;
+      nh.param("contour_count_max", value, 2.0);
+      contour_count_max_ = (int)value;
+      nh.param("mask_radius", value, 225.0);
+      int mask_radius = (int)value;
+      nh.param("ROIPlateImage_width", value, 480.0);
+      int roi_width = (int)value;
+      nh.param("ROIPlateImage_height", value, 480.0);
+      int roi_height = (int)value;
+      std::string output_coordinates;
+      nh.param("ImageProcessor_OutputCoordinates", output_coordinates, std::string("Camera"));
+      std::string background_file;
+      nh.param("background_file", background_file, std::string("background.png"));
+      // Fraction of the way the background moves toward each image, 0
+      // to keep the first one
+      nh.param("background_update_rate", value, 0.01);
+      float update_rate = value;
+      // Standard deviations of background noise a pixel has to differ by
+      // to be foreground, on top of diff_threshold
+      nh.param("background_variance_gain", value, 3.0);
+      float variance_gain = value;
+      // Pixels searched around where each blob is expected, 0 to search
+      // the whole ROI every image
+      nh.param("tracking_window_margin", value, 0.0);
+      window_margin_ = (int)value;
+      // Images between searches of the whole ROI while tracking
+      nh.param("tracking_search_period", value, 30.0);
+      search_period_ = (int)value;
+      // Standard deviation of the pixel noise in the background
+      // difference, for the pose covariances
+      nh.param("pose_noise", pose_noise_, 3.0);
+      // Radii the foreground is opened and then closed by, 0 for none
+      nh.param("morphology_open_radius", value, 0.0);
+      int open_radius = (int)value;
+      nh.param("morphology_close_radius", value, 0.0);
+      int close_radius = (int)value;
+
+      // Arenas of the one image, 0 for the single plate ROI above
+      nh.param("arena_count", value, 0.0);
+      int arena_count = (int)value;
+      for (int i = 0; i < std::max(arena_count, 1); ++i)
+        {
+          ArenaPtr arena(new Arena);
+          if (arena_count > 0)
+            {
+              std::string index = boost::lexical_cast<std::string>(i);
+              arena->param_prefix = "arena_" + index + "_";
+              const std::string& prefix = arena->param_prefix;
+              nh.param(prefix + "name", arena->name, "arena_" + index);
+              nh.param(prefix + "roi_frame", arena->roi_frame, "ROIPlateImage_" + index);
+              nh.param(prefix + "plate_frame", arena->plate_frame, "PlateImage_" + index);
+              nh.param(prefix + "output_coordinates", arena->output_coordinates, output_coordinates);
+              arena->background_file = arena->name + "_" + background_file;
+              nh.param(prefix + "width", value, (double)roi_width);
+              arena->width = (int)value;
+              nh.param(prefix + "height", value, (double)roi_height);
+              arena->height = (int)value;
+              nh.param(prefix + "mask_radius", value, (double)mask_radius);
+              arena->mask_radius = (int)value;
+              // Polygon mask as mask_vertex_K_x and _y, in ROI pixels
+              nh.param(prefix + "mask_vertex_count", value, 0.0);
+              int vertex_count = (int)value;
+              for (int k = 0; k < vertex_count; ++k)
+                {
+                  std::string vertex = prefix + "mask_vertex_" + boost::lexical_cast<std::string>(k);
+                  double x = 0;
+                  double y = 0;
+                  nh.getParam(vertex + "_x", x);
+                  nh.getParam(vertex + "_y", y);
+                  arena->polygon.push_back(cvPoint((int)x, (int)y));
+                }
+            }
+          else
+            {
+              arena->roi_frame = "ROIPlateImage";
+              arena->plate_frame = "PlateImage";
+              arena->output_coordinates = output_coordinates;
+              arena->background_file = background_file;
+              arena->width = roi_width;
+              arena->height = roi_height;
+              arena->mask_radius = mask_radius;
+            }
+          arena->model.setRate(update_rate);
+          arena->model.setVarianceGain(variance_gain);
+          arena->extractor.setMorphology(open_radius, close_radius);
+
+          ros::NodeHandle arena_nh = arena->name.empty() ? nh : ros::NodeHandle(nh, arena->name);
+          arena->it.reset(new image_transport::ImageTransport(arena_nh));
+          arena->contour_info_pub = arena_nh.advertise<ContourInfo>("ContourInfo", 10);
+          arena->diff_pub = arena->it->advertise("DiffImage", 1);
+          arena->foreground_pub = arena->it->advertise("ForegroundImage", 1);
+          arena->processed_pub = arena->it->advertise("ProcessedImage", 1);
+          arenas_.push_back(arena);
+        }
+
+      // Threads arenas are processed on, the image callback's own
+      // included; 0 for one per arena up to one per core
+      nh.param("arena_threads", value, 0.0);
+      int threads = (int)value;
+      if (threads <= 0)
+        {
+          threads = std::max((int)boost::thread::hardware_concurrency(), 1);
+        }
+      threads = std::min(threads, (int)arenas_.size());
+      for (int i = 1; i < threads; ++i)
+        {
+          workers_.create_thread(boost::bind(&ImageProcessorNodelet::workerLoop, this));
+        }
+
+      tf_listener_.reset(new tf::TransformListener(nh));
+      it_.reset(new image_transport::ImageTransport(nh));
+      image_sub_ = it_->subscribe("UndistortedImage", 1, &ImageProcessorNodelet::imageCallback, this);
+      render_thread_ = boost::thread(boost::bind(&ImageProcessorNodelet::renderLoop, this));
+    }
+
+    // Where the arena's ROI sits in the undistorted image, and where the
+    // plate center sits in the ROI, once tf knows
+    bool initializeFrames(Arena& arena)
+    {
+      geometry_msgs::PointStamped origin;
+      geometry_msgs::PointStamped point;
+      try
+        {
+          origin.header.frame_id = arena.roi_frame;
+          tf_listener_->transformPoint("UndistortedImage", origin, point);
+          arena.roi_x = (int)point.point.x;
+          arena.roi_y = (int)point.point.y;
+          if (arena.polygon.empty())
+            {
+              origin.header.frame_id = arena.plate_frame;
+              tf_listener_->transformPoint(arena.roi_frame, origin, point);
+              arena.plate_x = (int)point.point.x;
+              arena.plate_y = (int)point.point.y;
+            }
+        }
+      catch (tf::TransformException& ex)
+        {
+          NODELET_DEBUG("Waiting for the plate image frames: %s", ex.what());
+          return false;
+        }
+      if (arena.output_coordinates == "Plate" && !loadPlateHomography(arena))
+        {
+          return false;
+        }
+      arena.frames_initialized = true;
+      return true;
+    }
+
+    // An arena's own calibration parameter, else the camera's
+    bool getCalibration(const Arena& arena, const std::string& name, double& value)
+    {
+      ros::NodeHandle& nh = getNodeHandle();
+      return nh.getParam(arena.param_prefix + name, value) || nh.getParam(name, value);
+    }
+
+    // Camera to Plate homography from the camera calibration, as
+    // plate_tf's PlateCameraTransforms.py builds it for its services
+    bool loadPlateHomography(Arena& arena)
+    {
+      double fx, fy;
+      double rvec[3];
+      double tvec[3];
+      if (!getCalibration(arena, "KK_fx_undistorted", fx) || !getCalibration(arena, "KK_fy_undistorted", fy) ||
+          !getCalibration(arena, "camera_plate_rvec_0", rvec[0]) ||
+          !getCalibration(arena, "camera_plate_rvec_1", rvec[1]) ||
+          !getCalibration(arena, "camera_plate_rvec_2", rvec[2]) ||
+          !getCalibration(arena, "camera_plate_tvec_0", tvec[0]) ||
+          !getCalibration(arena, "camera_plate_tvec_1", tvec[1]) ||
+          !getCalibration(arena, "camera_plate_tvec_2", tvec[2]))
+        {
+          NODELET_ERROR_THROTTLE(5, "Plate output needs the camera plate calibration parameters");
+          return false;
+        }
+
+      // Rotation from the Rodrigues vector
+      double r[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+      double angle = sqrt(rvec[0]*rvec[0] + rvec[1]*rvec[1] + rvec[2]*rvec[2]);
+      if (angle > 0)
+        {
+          double k[3] = {rvec[0]/angle, rvec[1]/angle, rvec[2]/angle};
+          double c = cos(angle);
+          double s = sin(angle);
+          for (int row = 0; row < 3; ++row)
+            {
+              for (int col = 0; col < 3; ++col)
+                {
+                  r[3*row + col] = (1 - c)*k[row]*k[col] + ((row == col) ? c : 0);
+                }
+            }
+          r[1] -= s*k[2];
+          r[2] += s*k[1];
+          r[3] += s*k[2];
+          r[5] -= s*k[0];
+          r[6] -= s*k[1];
+          r[7] += s*k[0];
+        }
+
+      // Plate to Camera is the intrinsic matrix, less its principal point
+      // as Camera is centered on it, times the first two rotation columns
+      // and the translation
+      double plate_camera[9] = {
+        fx*r[0], fx*r[1], fx*tvec[0],
+        fy*r[3], fy*r[4], fy*tvec[1],
+        r[6], r[7], tvec[2]};
+      arena.plate_homography.setMatrix(plate_camera);
+      if (!arena.plate_homography.invert())
+        {
+          NODELET_ERROR_THROTTLE(5, "Camera plate calibration is singular");
+          return false;
+        }
+      return true;
+    }
+
+    // Brings the arena's cached ROI to output transform up to date,
+    // looking it up again only when tf has a newer one
+    bool updateOutputTransform(Arena& arena)
+    {
+      bool plate = arena.output_coordinates == "Plate";
+      std::string frame = plate ? std::string("Camera") : arena.output_coordinates;
+      ros::Time latest;
+      std::string error;
+      if (tf_listener_->getLatestCommonTime(frame, arena.roi_frame, latest, &error) != tf::NO_ERROR)
+        {
+          NODELET_WARN_THROTTLE(5, "%s", error.c_str());
+          return arena.have_output_transform;
+        }
+      if (arena.have_output_transform && latest == arena.output_transform_time)
+        {
+          return true;
+        }
+
+      tf::StampedTransform transform;
+      try
+        {
+          tf_listener_->lookupTransform(frame, arena.roi_frame, latest, transform);
+        }
+      catch (tf::TransformException& ex)
+        {
+          NODELET_WARN_THROTTLE(5, "%s", ex.what());
+          return arena.have_output_transform;
+        }
+      // Image frames share the z = 0 plane
+      const tf::Matrix3x3& basis = transform.getBasis();
+      const tf::Vector3& origin = transform.getOrigin();
+      double matrix[9] = {
+        basis[0][0], basis[0][1], origin.x(),
+        basis[1][0], basis[1][1], origin.y(),
+        0, 0, 1};
+      arena.output_transform.setMatrix(matrix);
+      if (plate)
+        {
+          arena.output_transform = arena.plate_homography*arena.output_transform;
+        }
+      arena.output_transform_time = latest;
+      arena.have_output_transform = true;
+      return true;
+    }
+
+    bool initializeImages(Arena& arena, const IplImage* image)
+    {
+      if (arena.roi_x < 0 || arena.roi_y < 0 ||
+          arena.roi_x + arena.width > image->width || arena.roi_y + arena.height > image->height)
+        {
+          NODELET_ERROR("Plate ROI %dx%d at (%d, %d) does not fit the %dx%d image",
+                        arena.width, arena.height, arena.roi_x, arena.roi_y, image->width, image->height);
+          return false;
+        }
+
+      CvSize size = cvSize(arena.width, arena.height);
+      arena.mask = cvCreateImage(size, IPL_DEPTH_8U, 1);
+      arena.diff = cvCreateImage(size, IPL_DEPTH_8U, 1);
+      arena.foreground = cvCreateImage(size, IPL_DEPTH_8U, 1);
+      arena.processed = cvCreateImage(size, IPL_DEPTH_8U, 3);
+      arena.render_diff = cvCreateImage(size, IPL_DEPTH_8U, 1);
+      arena.render_foreground = cvCreateImage(size, IPL_DEPTH_8U, 1);
+      cvZero(arena.mask);
+      if (arena.polygon.empty())
+        {
+          cvCircle(arena.mask, cvPoint(arena.plate_x, arena.plate_y), arena.mask_radius, cvScalarAll(255), CV_FILLED);
+        }
+      else
+        {
+          CvPoint* vertices = &arena.polygon[0];
+          int vertex_count = arena.polygon.size();
+          cvFillPoly(arena.mask, &vertices, &vertex_count, 1, cvScalarAll(255));
+        }
+
+      arena.extractor.setSize(arena.width, arena.height);
+      arena.extractor.setMask((const uint8_t*)arena.mask->imageData, arena.mask->widthStep);
+      arena.model.setSize(arena.width, arena.height);
+
+      // First image starts the background unless one can be loaded
+      const char* file = arena.background_file.c_str();
+      arena.background = cvLoadImage(file, CV_LOAD_IMAGE_GRAYSCALE);
+      if (arena.background != NULL &&
+          (arena.background->width != arena.width || arena.background->height != arena.height))
+        {
+          NODELET_WARN("Ignoring %s, it is not %dx%d", file, arena.width, arena.height);
+          cvReleaseImage(&arena.background);
+        }
+      if (arena.background == NULL)
+        {
+          arena.background = cvCreateImage(size, IPL_DEPTH_8U, 1);
+          for (int y = 0; y < arena.height; ++y)
+            {
+              const uint8_t* row = roiRow(arena, image, y);
+              uint8_t* out = (uint8_t*)arena.background->imageData + y*arena.background->widthStep;
+              const uint8_t* mask = (const uint8_t*)arena.mask->imageData + y*arena.mask->widthStep;
+              for (int x = 0; x < arena.width; ++x)
+                {
+                  out[x] = row[x] & mask[x];
+                }
+            }
+          cvSaveImage(file, arena.background);
+        }
+      arena.model.reset((const uint8_t*)arena.background->imageData, arena.background->widthStep);
+      arena.extractor.setBackground(arena.model.getBackground(), arena.width);
+      arena.extractor.setThresholds(arena.model.getThresholds(), arena.width);
+
+      arena.images_initialized = true;
+      return true;
+    }
+
+    void releaseImages(Arena& arena)
+    {
+      IplImage** images[] = {&arena.mask, &arena.background, &arena.diff, &arena.foreground, &arena.processed,
+                             &arena.render_diff, &arena.render_foreground};
+      for (size_t i = 0; i < sizeof(images)/sizeof(images[0]); ++i)
+        {
+          if (*images[i] != NULL)
+            {
+              cvReleaseImage(images[i]);
+            }
+        }
+    }
+
+    const uint8_t* roiRow(const Arena& arena, const IplImage* image, int y) const
+    {
+      return (const uint8_t*)image->imageData + (arena.roi_y + y)*image->widthStep + arena.roi_x;
+    }
+
+    void imageCallback(const sensor_msgs::ImageConstPtr& msg)
+    {
+      IplImage* image = bridge_.imgMsgToCv(msg, "passthrough");
+      if (image == NULL || image->nChannels != 1 || image->depth != IPL_DEPTH_8U)
+        {
+          NODELET_ERROR_THROTTLE(5, "ImageProcessor needs 8 bit grayscale images");
+          return;
+        }
+
+      // Look for new diff_threshold value, used from the next update
+      double threshold = 30;
+      getNodeHandle().getParamCached("diff_threshold", threshold);
+
+      processArenas(image, (int)threshold);
+      handOffDebugFrame(msg);
+    }
+
+    // Has the workers and this thread take the arenas between them, and
+    // returns once all are done with this image
+    void processArenas(const IplImage* image, int threshold)
+    {
+      {
+        boost::mutex::scoped_lock lock(work_mutex_);
+        work_image_ = image;
+        work_threshold_ = threshold;
+        next_arena_ = 0;
+        arenas_done_ = 0;
+        ++work_generation_;
+      }
+      work_ready_.notify_all();
+      processWaitingArenas();
+
+      boost::mutex::scoped_lock lock(work_mutex_);
+      while (arenas_done_ < arenas_.size())
+        {
+          work_done_.wait(lock);
+        }
+      work_image_ = NULL;
+    }
+
+    void workerLoop()
+    {
+      unsigned int generation = 0;
+      for (;;)
+        {
+          {
+            boost::mutex::scoped_lock lock(work_mutex_);
+            while (!work_stop_ && work_generation_ == generation)
+              {
+                work_ready_.wait(lock);
+              }
+            if (work_stop_)
+              {
+                return;
+              }
+            generation = work_generation_;
+          }
+          processWaitingArenas();
+        }
+    }
+
+    // Processes arenas of the current image until none are left to start
+    void processWaitingArenas()
+    {
+      for (;;)
+        {
+          size_t i;
+          const IplImage* image;
+          int threshold;
+          {
+            boost::mutex::scoped_lock lock(work_mutex_);
+            if (work_image_ == NULL || next_arena_ >= arenas_.size())
+              {
+                return;
+              }
+            i = next_arena_++;
+            image = work_image_;
+            threshold = work_threshold_;
+          }
+
+          processArena(*arenas_[i], image, threshold);
+
+          boost::mutex::scoped_lock lock(work_mutex_);
+          if (++arenas_done_ == arenas_.size())
+            {
+              work_done_.notify_all();
+            }
+        }
+    }
+
+    void processArena(Arena& arena, const IplImage* image, int threshold)
+    {
+      arena.contour_count = -1;
+      if (!arena.frames_initialized && !initializeFrames(arena))
+        {
+          return;
+        }
+      if (!arena.images_initialized && !initializeImages(arena, image))
+        {
+          return;
+        }
+      arena.model.setThreshold(threshold);
+
+      arena.want_diff = arena.diff_pub.getNumSubscribers() > 0;
+      arena.want_foreground = arena.foreground_pub.getNumSubscribers() > 0;
+      arena.want_processed = arena.processed_pub.getNumSubscribers() > 0;
+      uint8_t* diff = arena.want_diff ? (uint8_t*)arena.diff->imageData : NULL;
+      uint8_t* foreground = (uint8_t*)arena.foreground->imageData;
+      int out_step = arena.diff->widthStep;
+
+      // Search the windows while every target is still found whole in
+      // its own, else the whole ROI
+      bool search = arena.targets.empty() || window_margin_ <= 0 || arena.frames_since_search >= search_period_;
+      if (!search)
+        {
+          predictWindows(arena);
+          if (arena.want_diff)
+            {
+              cvZero(arena.diff);
+            }
+          cvZero(arena.foreground);
+          arena.extractor.extract(roiRow(arena, image, 0), image->widthStep, arena.windows, arena.blobs,
+                                  diff, foreground, out_step);
+          search = !windowsHold(arena);
+          ++arena.frames_since_search;
+        }
+      if (search)
+        {
+          arena.windows.clear();
+          arena.extractor.extract(roiRow(arena, image, 0), image->widthStep, arena.blobs,
+                                  diff, foreground, out_step);
+          arena.frames_since_search = 0;
+        }
+      int contour_count = std::min((int)arena.blobs.size(), contour_count_max_);
+
+      // The background model needs the foreground of the whole ROI to know
+      // what to leave out of its update, so it only learns from searches
+      if (search)
+        {
+          arena.model.update(roiRow(arena, image, 0), image->widthStep,
+                             foreground, arena.foreground->widthStep, arena.blobs, contour_count);
+          arena.extractor.setBackground(arena.model.getBackground(), arena.width);
+          arena.extractor.setThresholds(arena.model.getThresholds(), arena.width);
+        }
+      updateTargets(arena, contour_count);
+
+      if (contour_count != 0 && updateOutputTransform(arena))
+        {
+          publishContours(arena, contour_count);
+        }
+      arena.contour_count = contour_count;
+    }
+
+    // Gives the render thread what it needs to draw this image's debug
+    // images, unless it is still drawing the last.  The diff and
+    // foreground images change places with its own rather than being
+    // copied, and the processed image is drawn from the message itself.
+    void handOffDebugFrame(const sensor_msgs::ImageConstPtr& msg)
+    {
+      boost::mutex::scoped_lock lock(render_mutex_);
+      bool wanted = false;
+      for (size_t i = 0; i < arenas_.size(); ++i)
+        {
+          const Arena& arena = *arenas_[i];
+          wanted = wanted || (arena.contour_count >= 0 &&
+                              (arena.want_diff || arena.want_foreground || arena.want_processed));
+        }
+      if (!wanted)
+        {
+          return;
+        }
+      if (render_busy_)
+        {
+          ++render_skipped_;
+          return;
+        }
+
+      for (size_t i = 0; i < arenas_.size(); ++i)
+        {
+          Arena& arena = *arenas_[i];
+          DebugFrame& frame = arena.render_frame;
+          bool processed = arena.contour_count >= 0;
+          frame.image = msg;
+          frame.blobs.assign(arena.blobs.begin(), arena.blobs.begin() + std::max(arena.contour_count, 0));
+          frame.windows = arena.windows;
+          frame.diff = processed && arena.want_diff;
+          frame.foreground = processed && arena.want_foreground;
+          frame.processed = processed && arena.want_processed;
+          if (frame.diff)
+            {
+              std::swap(arena.diff, arena.render_diff);
+            }
+          if (frame.foreground)
+            {
+              std::swap(arena.foreground, arena.render_foreground);
+            }
+        }
+      render_busy_ = true;
+      render_wake_.notify_one();
+    }
+
+    void renderLoop()
+    {
+      ros::WallTime report_start = ros::WallTime::now();
+      double render_time = 0;
+      for (;;)
+        {
+          {
+            boost::mutex::scoped_lock lock(render_mutex_);
+            while (!render_busy_ && !render_stop_)
+              {
+                render_wake_.wait(lock);
+              }
+            if (render_stop_)
+              {
+                return;
+              }
+          }
+
+          ros::WallTime start = ros::WallTime::now();
+          for (size_t i = 0; i < arenas_.size(); ++i)
+            {
+              Arena& arena = *arenas_[i];
+              const DebugFrame& frame = arena.render_frame;
+              if (frame.diff)
+                {
+                  publishImage(arena.diff_pub, arena.render_diff, frame.image->header);
+                }
+              if (frame.foreground)
+                {
+                  publishImage(arena.foreground_pub, arena.render_foreground, frame.image->header);
+                }
+              if (frame.processed)
+                {
+                  publishProcessed(arena);
+                }
+            }
+          ros::WallTime end = ros::WallTime::now();
+          render_time += (end - start).toSec();
+
+          int rendered;
+          int skipped;
+          {
+            boost::mutex::scoped_lock lock(render_mutex_);
+            for (size_t i = 0; i < arenas_.size(); ++i)
+              {
+                arenas_[i]->render_frame.image.reset();
+              }
+            render_busy_ = false;
+            rendered = ++rendered_;
+            skipped = render_skipped_;
+          }
+
+          // What drawing here instead of in the image callback saved it
+          if ((end - report_start).toSec() >= 60)
+            {
+              NODELET_INFO("Debug images took %.2f ms a frame off the tracking thread, %d of %d frames left undrawn",
+                           1000*render_time/rendered, skipped, rendered + skipped);
+              boost::mutex::scoped_lock lock(render_mutex_);
+              rendered_ = 0;
+              render_skipped_ = 0;
+              render_time = 0;
+              report_start = end;
+            }
+        }
+    }
+
+    // Poses of the blobs reported, converted from the arena's ROI to its
+    // output coordinates together
+    void publishContours(Arena& arena, int contour_count)
+    {
+      ContourInfo info;
+      info.header.stamp = ros::Time::now();
+      info.header.frame_id = arena.output_coordinates;
+      arena.poses.resize(contour_count);
+      arena.pose_x.resize(contour_count);
+      arena.pose_y.resize(contour_count);
+      arena.pose_theta.resize(contour_count);
+      arena.pose_xx.resize(contour_count);
+      arena.pose_xy.resize(contour_count);
+      arena.pose_yy.resize(contour_count);
+      for (int i = 0; i < contour_count; ++i)
+        {
+          BlobPose& pose = arena.poses[i];
+          estimatePose(arena.blobs[i], pose_noise_, pose);
+          arena.pose_x[i] = pose.x;
+          arena.pose_y[i] = pose.y;
+          // Image frames have y down but theta is given with y up
+          arena.pose_theta[i] = -pose.theta;
+          arena.pose_xx[i] = pose.x_variance;
+          arena.pose_xy[i] = pose.xy_covariance;
+          arena.pose_yy[i] = pose.y_variance;
+        }
+      arena.output_transform.apply(contour_count, &arena.pose_x[0], &arena.pose_y[0], &arena.pose_theta[0],
+                                   &arena.pose_xx[0], &arena.pose_xy[0], &arena.pose_yy[0]);
+
+      // Plate has y up of its own
+      bool plate = arena.output_coordinates == "Plate";
+      for (int i = 0; i < contour_count; ++i)
+        {
+          const BlobPose& pose = arena.poses[i];
+          double theta = fmod(plate ? arena.pose_theta[i] : -arena.pose_theta[i], 2*M_PI);
+          info.x.push_back(arena.pose_x[i]);
+          info.y.push_back(arena.pose_y[i]);
+          info.theta.push_back((theta < 0) ? theta + 2*M_PI : theta);
+          info.area.push_back(arena.blobs[i].area);
+          info.ecc.push_back(pose.ecc);
+          info.x_variance.push_back(arena.pose_xx[i]);
+          info.y_variance.push_back(arena.pose_yy[i]);
+          info.xy_covariance.push_back(arena.pose_xy[i]);
+          info.theta_variance.push_back(pose.theta_variance);
+          info.skew.push_back(pose.skew);
+        }
+      arena.contour_info_pub.publish(info);
+    }
+
+    // Windows around where each target should be in this image, at its
+    // last position plus its last step, merged where they overlap
+    void predictWindows(Arena& arena)
+    {
+      V_Window& windows = arena.windows;
+      windows.clear();
+      for (size_t i = 0; i < arena.targets.size(); ++i)
+        {
+          const Target& target = arena.targets[i];
+          int x = (int)floor(target.x + target.dx);
+          int y = (int)floor(target.y + target.dy);
+          int x_min = std::max(x - target.half_width - window_margin_, 0);
+          int y_min = std::max(y - target.half_height - window_margin_, 0);
+          int x_max = std::min(x + target.half_width + window_margin_, arena.width - 1);
+          int y_max = std::min(y + target.half_height + window_margin_, arena.height - 1);
+          if (x_max < x_min || y_max < y_min)
+            {
+              continue;
+            }
+          Window window = {x_min, y_min, x_max - x_min + 1, y_max - y_min + 1};
+          windows.push_back(window);
+        }
+
+      bool merged = true;
+      while (merged)
+        {
+          merged = false;
+          for (size_t i = 0; i < windows.size() && !merged; ++i)
+            {
+              for (size_t j = i + 1; j < windows.size() && !merged; ++j)
+                {
+                  Window& a = windows[i];
+                  const Window& b = windows[j];
+                  if (a.x < b.x + b.width && b.x < a.x + a.width && a.y < b.y + b.height && b.y < a.y + a.height)
+                    {
+                      int x_max = std::max(a.x + a.width, b.x + b.width);
+                      int y_max = std::max(a.y + a.height, b.y + b.height);
+                      a.x = std::min(a.x, b.x);
+                      a.y = std::min(a.y, b.y);
+                      a.width = x_max - a.x;
+                      a.height = y_max - a.y;
+                      windows.erase(windows.begin() + j);
+                      merged = true;
+                    }
+                }
+            }
+        }
+    }
+
+    // Whether the windows found every target, none cut off by a window
+    // edge that is not also the edge of the ROI
+    bool windowsHold(const Arena& arena) const
+    {
+      if (arena.blobs.size() < arena.targets.size())
+        {
+          return false;
+        }
+      for (size_t i = 0; i < arena.targets.size(); ++i)
+        {
+          const Blob& blob = arena.blobs[i];
+          for (size_t j = 0; j < arena.windows.size(); ++j)
+            {
+              const Window& window = arena.windows[j];
+              if (blob.x_min < window.x || window.x + window.width <= blob.x_max ||
+                  blob.y_min < window.y || window.y + window.height <= blob.y_max)
+                {
+                  continue;
+                }
+              if ((blob.x_min == window.x && window.x > 0) ||
+                  (blob.x_max == window.x + window.width - 1 && blob.x_max < arena.width - 1) ||
+                  (blob.y_min == window.y && window.y > 0) ||
+                  (blob.y_max == window.y + window.height - 1 && blob.y_max < arena.height - 1))
+                {
+                  return false;
+                }
+            }
+        }
+      return true;
+    }
+
+    // Tracks the blobs reported while all contour_count_max are found,
+    // each with its step from the nearest target of the last image
+    void updateTargets(Arena& arena, int contour_count)
+    {
+      if (window_margin_ <= 0 || contour_count < contour_count_max_)
+        {
+          arena.targets.clear();
+          return;
+        }
+      std::vector<Target> targets(contour_count);
+      for (int i = 0; i < contour_count; ++i)
+        {
+          const Blob& blob = arena.blobs[i];
+          Target& target = targets[i];
+          target.x = blob.x;
+          target.y = blob.y;
+          target.dx = 0;
+          target.dy = 0;
+          target.half_width = std::max(blob.x_max - (int)blob.x, (int)blob.x - blob.x_min) + 1;
+          target.half_height = std::max(blob.y_max - (int)blob.y, (int)blob.y - blob.y_min) + 1;
+          double nearest = -1;
+          for (size_t j = 0; j < arena.targets.size(); ++j)
+            {
+              const Target& last = arena.targets[j];
+              double dx = blob.x - last.x;
+              double dy = blob.y - last.y;
+              double distance = dx*dx + dy*dy;
+              if (nearest < 0 || distance < nearest)
+                {
+                  nearest = distance;
+                  target.dx = dx;
+                  target.dy = dy;
+                }
+            }
+        }
+      arena.targets.swap(targets);
+    }
+
+    // The masked ROI with the blobs reported, and any windows searched,
+    // marked on it
+    void publishProcessed(Arena& arena)
+    {
+      const DebugFrame& frame = arena.render_frame;
+      const sensor_msgs::Image& image = *frame.image;
+      IplImage* processed = arena.processed;
+      for (int y = 0; y < arena.height; ++y)
+        {
+          const uint8_t* row = &image.data[0] + (arena.roi_y + y)*image.step + arena.roi_x;
+          const uint8_t* mask = (const uint8_t*)arena.mask->imageData + y*arena.mask->widthStep;
+          uint8_t* out = (uint8_t*)processed->imageData + y*processed->widthStep;
+          for (int x = 0; x < arena.width; ++x)
+            {
+              out[3*x] = out[3*x + 1] = out[3*x + 2] = row[x] & mask[x];
+            }
+        }
+      for (size_t i = 0; i < frame.blobs.size(); ++i)
+        {
+          const Blob& blob = frame.blobs[i];
+          cvRectangle(processed, cvPoint(blob.x_min, blob.y_min), cvPoint(blob.x_max, blob.y_max), CV_RGB(0, 0, 255));
+          cvCircle(processed, cvPoint((int)blob.x, (int)blob.y), 4, CV_RGB(0, 255, 0));
+        }
+      for (size_t i = 0; i < frame.windows.size(); ++i)
+        {
+          const Window& window = frame.windows[i];
+          cvRectangle(processed, cvPoint(window.x, window.y),
+                      cvPoint(window.x + window.width - 1, window.y + window.height - 1), CV_RGB(255, 255, 0));
+        }
+      publishImage(arena.processed_pub, processed, image.header);
+    }
+
+    void publishImage(image_transport::Publisher& pub, const IplImage* image, const std_msgs::Header& header)
+    {
+      sensor_msgs::Image msg;
+      if (sensor_msgs::CvBridge::fromIpltoRosImage(image, msg, "passthrough"))
+        {
+          msg.header = header;
+          msg.encoding = (image->nChannels == 3) ? "rgb8" : "mono8";
+          pub.publish(msg);
+        }
+    }
+
+    boost::shared_ptr<tf::TransformListener> tf_listener_;
+    boost::shared_ptr<image_transport::ImageTransport> it_;
+    image_transport::Subscriber image_sub_;
+    sensor_msgs::CvBridge bridge_;
+
+    int contour_count_max_;
+    int window_margin_;
+    int search_period_;
+    double pose_noise_;
+    std::vector<ArenaPtr> arenas_;
+
+    // Render thread's own; arenas' processed images are only drawn
+    // there.  render_busy_ is set from handing a frame over until it is
+    // drawn.
+    bool render_busy_;
+    bool render_stop_;
+    int rendered_;
+    int render_skipped_;
+    boost::mutex render_mutex_;
+    boost::condition_variable render_wake_;
+    boost::thread render_thread_;
+
+    // Arenas of work_image_ go to whichever thread asks next; work_image_
+    // is NULL between images
+    const IplImage* work_image_;
+    int work_threshold_;
+    unsigned int work_generation_;
+    size_t next_arena_;
+    size_t arenas_done_;
+    bool work_stop_;
+    boost::mutex work_mutex_;
+    boost::condition_variable work_ready_;
+    boost::condition_variable work_done_;
+    boost::thread_group workers_;
+  };
+
+}
+
+PLUGINLIB_DECLARE_CLASS(track_image_contours, ImageProcessorNodelet, track_image_contours::ImageProcessorNodelet, nodelet::Nodelet)
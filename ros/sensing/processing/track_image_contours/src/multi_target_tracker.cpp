@@ -0,0 +1,288 @@
+// multi_target_tracker.cpp
+
+#include "track_image_contours/multi_target_tracker.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace track_image_contours
+{
+
+  // Assigns each of n rows one of m >= n columns at the least total cost,
+  // cost being n x m row major.  The shortest augmenting path form of the
+  // Hungarian method, O(n^2 m).
+  static void hungarian(const std::vector<double>& cost, int n, int m, std::vector<int>& assignment)
+  {
+    const double inf = std::numeric_limits<double>::infinity();
+    // Potentials and matching are 1 based, column 0 standing for the row
+    // being added
+    std::vector<double> u(n + 1, 0);
+    std::vector<double> v(m + 1, 0);
+    std::vector<int> p(m + 1, 0);
+    std::vector<int> way(m + 1, 0);
+    std::vector<double> minv(m + 1);
+    std::vector<char> used(m + 1);
+
+    for (int i = 1; i <= n; ++i)
+      {
+        p[0] = i;
+        int j0 = 0;
+        std::fill(minv.begin(), minv.end(), inf);
+        std::fill(used.begin(), used.end(), 0);
+        do
+          {
+            used[j0] = 1;
+            int i0 = p[j0];
+            int j1 = 0;
+            double delta = inf;
+            for (int j = 1; j <= m; ++j)
+              {
+                if (used[j])
+                  {
+                    continue;
+                  }
+                double reduced = cost[(i0 - 1)*m + j - 1] - u[i0] - v[j];
+                if (reduced < minv[j])
+                  {
+                    minv[j] = reduced;
+                    way[j] = j0;
+                  }
+                if (minv[j] < delta)
+                  {
+                    delta = minv[j];
+                    j1 = j;
+                  }
+              }
+            for (int j = 0; j <= m; ++j)
+              {
+                if (used[j])
+                  {
+                    u[p[j]] += delta;
+                    v[j] -= delta;
+                  }
+                else
+                  {
+                    minv[j] -= delta;
+                  }
+              }
+            j0 = j1;
+          }
+        while (p[j0] != 0);
+        do
+          {
+            int j1 = way[j0];
+            p[j0] = p[j1];
+            j0 = j1;
+          }
+        while (j0 != 0);
+      }
+
+    assignment.assign(n, -1);
+    for (int j = 1; j <= m; ++j)
+      {
+        if (p[j] != 0)
+          {
+            assignment[p[j] - 1] = j - 1;
+          }
+      }
+  }
+
+  MultiTargetTracker::MultiTargetTracker()
+    : process_noise_(1000)
+    , measurement_noise_(1)
+    , initial_velocity_(100)
+    , gate_(3)
+    , heading_speed_(20)
+    , skew_gain_(10)
+    , y_up_(false)
+    , confirm_hits_(3)
+    , max_missed_(5)
+    , started_(false)
+    , time_(0)
+    , next_id_(0)
+  {
+  }
+
+  void MultiTargetTracker::clear()
+  {
+    tracks_.clear();
+    started_ = false;
+  }
+
+  void MultiTargetTracker::predict(TrackState& track, double dt) const
+  {
+    track.x += dt*track.x_velocity;
+    track.y += dt*track.y_velocity;
+    // P = F P F' + Q, white noise acceleration
+    double q = process_noise_*process_noise_;
+    double p_pos = track.p_pos + 2*dt*track.p_pos_vel + dt*dt*track.p_vel + q*dt*dt*dt/3;
+    double p_pos_vel = track.p_pos_vel + dt*track.p_vel + q*dt*dt/2;
+    double p_vel = track.p_vel + q*dt;
+    track.p_pos = p_pos;
+    track.p_pos_vel = p_pos_vel;
+    track.p_vel = p_vel;
+  }
+
+  void MultiTargetTracker::correct(TrackState& track, const Detection& detection) const
+  {
+    double s = track.p_pos + measurement_noise_*measurement_noise_ + detection.position_variance;
+    double k_pos = track.p_pos/s;
+    double k_vel = track.p_pos_vel/s;
+    double dx = detection.x - track.x;
+    double dy = detection.y - track.y;
+    track.x += k_pos*dx;
+    track.y += k_pos*dy;
+    track.x_velocity += k_vel*dx;
+    track.y_velocity += k_vel*dy;
+    double p_pos = (1 - k_pos)*track.p_pos;
+    double p_pos_vel = (1 - k_pos)*track.p_pos_vel;
+    double p_vel = track.p_vel - k_vel*track.p_pos_vel;
+    track.p_pos = p_pos;
+    track.p_pos_vel = p_pos_vel;
+    track.p_vel = p_vel;
+    track.theta = heading(track, detection);
+    track.theta_variance = detection.theta_variance;
+    track.area = detection.area;
+    track.ecc = detection.ecc;
+  }
+
+  // Detection's heading or its opposite, whichever the votes favour: its
+  // skew, the direction of motion scaled up to full at heading_speed, and
+  // the track's heading before
+  double MultiTargetTracker::heading(const TrackState& track, const Detection& detection) const
+  {
+    double vote = std::min(skew_gain_*detection.skew, 1.0);
+    double speed = sqrt(track.x_velocity*track.x_velocity + track.y_velocity*track.y_velocity);
+    if (speed > 0)
+      {
+        // theta has y up, which image coordinates do not
+        double motion = atan2(y_up_ ? track.y_velocity : -track.y_velocity, track.x_velocity);
+        vote += std::min(speed/heading_speed_, 1.0)*cos(detection.theta - motion);
+      }
+    vote += 0.5*cos(detection.theta - track.theta);
+    if (vote >= 0)
+      {
+        return detection.theta;
+      }
+    return fmod(detection.theta + M_PI, 2*M_PI);
+  }
+
+  double MultiTargetTracker::distance2(const TrackState& track, const Detection& detection) const
+  {
+    double s = track.p_pos + measurement_noise_*measurement_noise_ + detection.position_variance;
+    double dx = detection.x - track.x;
+    double dy = detection.y - track.y;
+    return (dx*dx + dy*dy)/s;
+  }
+
+  void MultiTargetTracker::startTrack(const Detection& detection)
+  {
+    TrackState track;
+    track.id = next_id_++;
+    track.x = detection.x;
+    track.y = detection.y;
+    track.x_velocity = 0;
+    track.y_velocity = 0;
+    track.p_pos = measurement_noise_*measurement_noise_ + detection.position_variance;
+    track.p_pos_vel = 0;
+    track.p_vel = initial_velocity_*initial_velocity_;
+    track.theta = detection.theta;
+    track.theta_variance = detection.theta_variance;
+    track.area = detection.area;
+    track.ecc = detection.ecc;
+    track.age = 0;
+    track.hits = 1;
+    track.missed = 0;
+    tracks_.push_back(track);
+  }
+
+  void MultiTargetTracker::update(double time, const V_Detection& detections)
+  {
+    double dt = started_ ? std::max(time - time_, 0.0) : 0;
+    started_ = true;
+    time_ = time;
+    for (size_t i = 0; i < tracks_.size(); ++i)
+      {
+        predict(tracks_[i], dt);
+        ++tracks_[i].age;
+      }
+
+    // Rows are whichever of tracks and detections there are fewer of.
+    // Pairs outside the gate cost more than any inside so are only ever
+    // assigned when nothing else is left, and are then rejected.
+    int track_count = tracks_.size();
+    int detection_count = detections.size();
+    bool by_track = track_count <= detection_count;
+    int n = by_track ? track_count : detection_count;
+    int m = by_track ? detection_count : track_count;
+    double gate2 = gate_*gate_;
+    double outside = 2*gate2*(n + 1) + 1;
+    cost_.resize(n*m);
+    for (int t = 0; t < track_count; ++t)
+      {
+        for (int d = 0; d < detection_count; ++d)
+          {
+            double c = distance2(tracks_[t], detections[d]);
+            if (c > gate2)
+              {
+                c = outside;
+              }
+            cost_[by_track ? t*m + d : d*m + t] = c;
+          }
+      }
+    std::vector<int> detection_track(detection_count, -1);
+    if (n > 0)
+      {
+        hungarian(cost_, n, m, assignment_);
+        for (int i = 0; i < n; ++i)
+          {
+            int j = assignment_[i];
+            if (j < 0 || cost_[i*m + j] > gate2)
+              {
+                continue;
+              }
+            detection_track[by_track ? j : i] = by_track ? i : j;
+          }
+      }
+
+    std::vector<char> track_hit(track_count, 0);
+    for (int d = 0; d < detection_count; ++d)
+      {
+        int t = detection_track[d];
+        if (t >= 0)
+          {
+            correct(tracks_[t], detections[d]);
+            ++tracks_[t].hits;
+            tracks_[t].missed = 0;
+            track_hit[t] = 1;
+          }
+      }
+
+    // Drop the tracks missed too long, and tentative ones missed at all
+    size_t kept = 0;
+    for (int t = 0; t < track_count; ++t)
+      {
+        TrackState& track = tracks_[t];
+        if (!track_hit[t])
+          {
+            ++track.missed;
+            if (track.missed > max_missed_ || !isConfirmed(track))
+              {
+                continue;
+              }
+          }
+        tracks_[kept++] = track;
+      }
+    tracks_.resize(kept);
+
+    for (int d = 0; d < detection_count; ++d)
+      {
+        if (detection_track[d] < 0)
+          {
+            startTrack(detections[d]);
+          }
+      }
+  }
+
+}
@@ -0,0 +1,113 @@
+// multi_target_tracker_nodelet.cpp
+//
+// Turns the contours on ContourInfo into tracks with persistent ids on
+// Tracks, see multi_target_tracker.h.  Tracks are in the coordinates
+// ContourInfo is in and only confirmed ones are published, the ones
+// missing from the latest contours at their predicted positions.  Load
+// it in the same manager as ImageProcessorNodelet so the contours are
+// passed without copying.
+
+#include "track_image_contours/multi_target_tracker.h"
+
+#include <ros/ros.h>
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#include <track_image_contours/ContourInfo.h>
+#include <track_image_contours/TrackArray.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace track_image_contours
+{
+
+  class MultiTargetTrackerNodelet : public nodelet::Nodelet
+  {
+  private:
+    virtual void onInit()
+    {
+      ros::NodeHandle& nh = getNodeHandle();
+      double value;
+      nh.param("tracker_process_noise", value, 1000.0);
+      tracker_.setProcessNoise(value);
+      nh.param("tracker_measurement_noise", value, 1.0);
+      tracker_.setMeasurementNoise(value);
+      nh.param("tracker_initial_velocity", value, 100.0);
+      tracker_.setInitialVelocity(value);
+      nh.param("tracker_gate", value, 3.0);
+      tracker_.setGate(value);
+      nh.param("tracker_heading_speed", value, 20.0);
+      tracker_.setHeadingSpeed(value);
+      nh.param("tracker_skew_gain", value, 10.0);
+      tracker_.setSkewGain(value);
+      nh.param("tracker_confirm_hits", value, 3.0);
+      tracker_.setConfirmHits((int)value);
+      nh.param("tracker_max_missed", value, 5.0);
+      tracker_.setMaxMissed((int)value);
+
+      tracks_pub_ = nh.advertise<TrackArray>("Tracks", 10);
+      contour_info_sub_ = nh.subscribe("ContourInfo", 10, &MultiTargetTrackerNodelet::contourCallback, this);
+    }
+
+    void contourCallback(const ContourInfoConstPtr& msg)
+    {
+      size_t count = std::min(std::min(std::min(msg->x.size(), msg->y.size()), std::min(msg->theta.size(), msg->area.size())),
+                              msg->ecc.size());
+      // The pose covariances and skew only come from ImageProcessorNodelet
+      bool pose = msg->x_variance.size() >= count && msg->y_variance.size() >= count &&
+        msg->theta_variance.size() >= count && msg->skew.size() >= count;
+      detections_.resize(count);
+      for (size_t i = 0; i < count; ++i)
+        {
+          Detection& detection = detections_[i];
+          detection.x = msg->x[i];
+          detection.y = msg->y[i];
+          detection.theta = msg->theta[i];
+          detection.area = msg->area[i];
+          detection.ecc = msg->ecc[i];
+          detection.position_variance = pose ? 0.5*(msg->x_variance[i] + msg->y_variance[i]) : 0;
+          detection.theta_variance = pose ? msg->theta_variance[i] : M_PI*M_PI/12;
+          detection.skew = pose ? msg->skew[i] : 0;
+        }
+      // Plate is the only output with y up
+      tracker_.setYUp(msg->header.frame_id == "Plate");
+      tracker_.update(msg->header.stamp.toSec(), detections_);
+
+      TrackArrayPtr tracks(new TrackArray);
+      tracks->header = msg->header;
+      const V_TrackState& states = tracker_.getTracks();
+      tracks->tracks.reserve(states.size());
+      for (size_t i = 0; i < states.size(); ++i)
+        {
+          const TrackState& state = states[i];
+          if (!tracker_.isConfirmed(state))
+            {
+              continue;
+            }
+          Track track;
+          track.id = state.id;
+          track.x = state.x;
+          track.y = state.y;
+          track.theta = state.theta;
+          track.position_variance = state.p_pos;
+          track.theta_variance = state.theta_variance;
+          track.x_velocity = state.x_velocity;
+          track.y_velocity = state.y_velocity;
+          track.area = state.area;
+          track.ecc = state.ecc;
+          track.age = state.age;
+          track.missed = state.missed;
+          tracks->tracks.push_back(track);
+        }
+      tracks_pub_.publish(tracks);
+    }
+
+    MultiTargetTracker tracker_;
+    V_Detection detections_;
+    ros::Subscriber contour_info_sub_;
+    ros::Publisher tracks_pub_;
+  };
+
+}
+
+PLUGINLIB_DECLARE_CLASS(track_image_contours, MultiTargetTrackerNodelet, track_image_contours::MultiTargetTrackerNodelet, nodelet::Nodelet)
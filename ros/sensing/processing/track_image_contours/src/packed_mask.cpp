@@ -0,0 +1,118 @@
+// packed_mask.cpp
+
+#include "track_image_contours/packed_mask.h"
+
+#include <algorithm>
+
+namespace track_image_contours
+{
+
+  PackedMask::PackedMask()
+    : width_(0)
+    , height_(0)
+    , words_(0)
+    , last_word_(0)
+  {
+  }
+
+  void PackedMask::setSize(int width, int height)
+  {
+    width_ = width;
+    height_ = height;
+    words_ = (width + 63)/64;
+    int spare = 64*words_ - width;
+    last_word_ = ~(uint64_t)0 >> spare;
+    bits_.assign(words_*height, 0);
+    scratch_.resize(words_*height);
+  }
+
+  void PackedMask::erode(int radius)
+  {
+    shiftRows(radius, true);
+    combineRows(radius, true);
+  }
+
+  void PackedMask::dilate(int radius)
+  {
+    shiftRows(radius, false);
+    combineRows(radius, false);
+  }
+
+  void PackedMask::open(int radius)
+  {
+    erode(radius);
+    dilate(radius);
+  }
+
+  void PackedMask::close(int radius)
+  {
+    dilate(radius);
+    erode(radius);
+  }
+
+  // Each pixel ANDed (eroding) or ORed with its left and right neighbours,
+  // radius times, the neighbours' bits coming in from the words either
+  // side
+  void PackedMask::shiftRows(int radius, bool erode)
+  {
+    if (words_ == 0)
+      {
+        return;
+      }
+    const uint64_t outside = erode ? ~(uint64_t)0 : 0;
+    for (int y = 0; y < height_; ++y)
+      {
+        uint64_t* bits = &bits_[y*words_];
+        // Past the width counts as outside the image
+        bits[words_ - 1] |= outside & ~last_word_;
+        for (int pass = 0; pass < radius; ++pass)
+          {
+            uint64_t previous = outside;
+            for (int j = 0; j < words_; ++j)
+              {
+                uint64_t word = bits[j];
+                uint64_t next = (j + 1 < words_) ? bits[j + 1] : outside;
+                uint64_t left = (word << 1) | (previous >> 63);
+                uint64_t right = (word >> 1) | (next << 63);
+                bits[j] = erode ? (word & left & right) : (word | left | right);
+                previous = word;
+              }
+          }
+        bits[words_ - 1] &= last_word_;
+      }
+  }
+
+  // Each row ANDed (eroding) or ORed with the rows within radius above
+  // and below it that are inside the image
+  void PackedMask::combineRows(int radius, bool erode)
+  {
+    for (int y = 0; y < height_; ++y)
+      {
+        int first = std::max(y - radius, 0);
+        int last = std::min(y + radius, height_ - 1);
+        uint64_t* out = &scratch_[y*words_];
+        const uint64_t* in = &bits_[first*words_];
+        std::copy(in, in + words_, out);
+        for (int other = first + 1; other <= last; ++other)
+          {
+            in = &bits_[other*words_];
+            if (erode)
+              {
+                for (int j = 0; j < words_; ++j)
+                  {
+                    out[j] &= in[j];
+                  }
+              }
+            else
+              {
+                for (int j = 0; j < words_; ++j)
+                  {
+                    out[j] |= in[j];
+                  }
+              }
+          }
+      }
+    bits_.swap(scratch_);
+  }
+
+}
@@ -0,0 +1,97 @@
+// point_transform.cpp
+
+#include "track_image_contours/point_transform.h"
+
+#include <cmath>
+
+namespace track_image_contours
+{
+
+  PointTransform::PointTransform()
+  {
+    static const double identity[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+    setMatrix(identity);
+  }
+
+  void PointTransform::setMatrix(const double matrix[9])
+  {
+    for (int i = 0; i < 9; ++i)
+      {
+        matrix_[i] = matrix[i];
+      }
+  }
+
+  PointTransform PointTransform::operator*(const PointTransform& other) const
+  {
+    const double* a = matrix_;
+    const double* b = other.matrix_;
+    double product[9];
+    for (int row = 0; row < 3; ++row)
+      {
+        for (int col = 0; col < 3; ++col)
+          {
+            product[3*row + col] = a[3*row]*b[col] + a[3*row + 1]*b[3 + col] + a[3*row + 2]*b[6 + col];
+          }
+      }
+    PointTransform transform;
+    transform.setMatrix(product);
+    return transform;
+  }
+
+  bool PointTransform::invert()
+  {
+    const double* m = matrix_;
+    double cofactor[9] = {
+      m[4]*m[8] - m[5]*m[7], m[2]*m[7] - m[1]*m[8], m[1]*m[5] - m[2]*m[4],
+      m[5]*m[6] - m[3]*m[8], m[0]*m[8] - m[2]*m[6], m[2]*m[3] - m[0]*m[5],
+      m[3]*m[7] - m[4]*m[6], m[1]*m[6] - m[0]*m[7], m[0]*m[4] - m[1]*m[3]};
+    double determinant = m[0]*cofactor[0] + m[1]*cofactor[3] + m[2]*cofactor[6];
+    if (determinant == 0)
+      {
+        return false;
+      }
+    for (int i = 0; i < 9; ++i)
+      {
+        matrix_[i] = cofactor[i]/determinant;
+      }
+    return true;
+  }
+
+  void PointTransform::apply(size_t n, double* x, double* y, double* theta,
+                             double* xx, double* xy, double* yy) const
+  {
+    const double* m = matrix_;
+    for (size_t i = 0; i < n; ++i)
+      {
+        double w = 1/(m[6]*x[i] + m[7]*y[i] + m[8]);
+        double x_out = (m[0]*x[i] + m[1]*y[i] + m[2])*w;
+        double y_out = (m[3]*x[i] + m[4]*y[i] + m[5])*w;
+
+        // Jacobian at the point
+        double j00 = (m[0] - x_out*m[6])*w;
+        double j01 = (m[1] - x_out*m[7])*w;
+        double j10 = (m[3] - y_out*m[6])*w;
+        double j11 = (m[4] - y_out*m[7])*w;
+        if (theta)
+          {
+            double c = cos(theta[i]);
+            double s = sin(theta[i]);
+            theta[i] = atan2(j10*c + j11*s, j00*c + j01*s);
+          }
+        if (xx && xy && yy)
+          {
+            // J S J'
+            double a = j00*xx[i] + j01*xy[i];
+            double b = j00*xy[i] + j01*yy[i];
+            double c = j10*xx[i] + j11*xy[i];
+            double d = j10*xy[i] + j11*yy[i];
+            xx[i] = a*j00 + b*j01;
+            xy[i] = a*j10 + b*j11;
+            yy[i] = c*j10 + d*j11;
+          }
+        x[i] = x_out;
+        y[i] = y_out;
+      }
+  }
+
+}
@@ -0,0 +1,61 @@
+// pose_estimator.cpp
+
+#include "track_image_contours/pose_estimator.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace track_image_contours
+{
+
+  void estimatePose(const Blob& blob, double noise, BlobPose& pose)
+  {
+    double m00 = blob.area;
+    pose.x = blob.x;
+    pose.y = blob.y;
+
+    // Second moments per unit weight, and their eigenvalues
+    double a = blob.mu20/m00;
+    double b = blob.mu11/m00;
+    double c = blob.mu02/m00;
+    double half_difference = 0.5*(a - c);
+    double root = sqrt(half_difference*half_difference + b*b);
+    double major = 0.5*(a + c) + root;
+    double minor = 0.5*(a + c) - root;
+    pose.ecc = (minor > 0) ? major/minor : 0;
+
+    // Major axis in image coordinates, y down, turned to point along the
+    // positive third moment
+    double axis = 0.5*atan2(2*b, a - c);
+    double ca = cos(axis);
+    double sa = sin(axis);
+    double mu3 = (blob.mu30*ca*ca*ca + 3*blob.mu21*ca*ca*sa + 3*blob.mu12*ca*sa*sa + blob.mu03*sa*sa*sa)/m00;
+    double skew = (major > 0) ? mu3/(major*sqrt(major)) : 0;
+    if (skew < 0)
+      {
+        axis += M_PI;
+        skew = -skew;
+      }
+    pose.skew = skew;
+    double theta = fmod(-axis, 2*M_PI);
+    pose.theta = (theta < 0) ? theta + 2*M_PI : theta;
+
+    // The weighted centroid's variance is noise^2 sum (x - x0)^2/m00^2;
+    // the unweighted sum is taken as pixels times the weighted spread
+    double scale = noise*noise*blob.pixels/(m00*m00);
+    pose.x_variance = scale*a;
+    pose.y_variance = scale*c;
+    pose.xy_covariance = scale*b;
+    // The axis turns by the noise in b over the eigenvalue gap
+    double uniform = M_PI*M_PI/12;
+    if (root > 0)
+      {
+        pose.theta_variance = std::min(scale*major*minor/(4*root*root), uniform);
+      }
+    else
+      {
+        pose.theta_variance = uniform;
+      }
+  }
+
+}
@@ -0,0 +1,55 @@
+// test_multi_target_tracker.cpp
+//
+// A symmetric target, whose detections point either way along its axis
+// at random, should settle on facing the way it moves, in Plate
+// coordinates with y up as in image coordinates with y down.
+
+#include "track_image_contours/multi_target_tracker.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+
+using namespace track_image_contours;
+
+// Heading of one target moving at 50 units/s along +y for two seconds,
+// its detections' headings along the y axis, alternately either way
+static double settledHeading(bool y_up)
+{
+  MultiTargetTracker tracker;
+  tracker.setYUp(y_up);
+  V_Detection detections(1);
+  Detection& detection = detections[0];
+  detection.x = 0;
+  detection.position_variance = 0;
+  detection.theta_variance = 0.01;
+  detection.skew = 0;
+  detection.area = 100;
+  detection.ecc = 3;
+  for (int i = 0; i < 60; ++i)
+    {
+      double time = i/30.0;
+      detection.y = 50*time;
+      detection.theta = (i % 2) ? M_PI/2 : 3*M_PI/2;
+      tracker.update(time, detections);
+    }
+  const V_TrackState& tracks = tracker.getTracks();
+  EXPECT_EQ(1u, tracks.size());
+  return tracks.empty() ? -1 : tracks[0].theta;
+}
+
+TEST(MultiTargetTracker, headingFollowsMotionWithYUp)
+{
+  EXPECT_NEAR(M_PI/2, settledHeading(true), 1e-6);
+}
+
+TEST(MultiTargetTracker, headingFollowsMotionWithYDown)
+{
+  EXPECT_NEAR(3*M_PI/2, settledHeading(false), 1e-6);
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
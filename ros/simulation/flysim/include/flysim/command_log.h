@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2009, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FLYSIM_COMMAND_LOG_H
+#define FLYSIM_COMMAND_LOG_H
+
+#include <cstdio>
+#include <string>
+#include <stdint.h>
+
+#include <boost/shared_ptr.hpp>
+
+namespace flysim
+{
+
+  /**
+   * Binary log of the commands that drive the simulation, keyed by the
+   * simulation step they were applied on.  A log recorded with a given seed
+   * replays identically, since the simulation itself runs on a fixed dt.
+   *
+   * File layout: "FLYSIMCL", uint32 version, uint32 seed, then one record per
+   * command: uint32 step, uint8 type, uint8 name length, name, and the
+   * float32 arguments for that type (see argumentCount()).
+   */
+  class CommandLog
+  {
+  public:
+    enum Type
+      {
+        CMD_VELOCITY = 1,
+        CMD_TELEPORT_RELATIVE = 2,
+        CMD_TELEPORT_ABSOLUTE = 3,
+        CMD_SPAWN = 4,
+        CMD_KILL = 5,
+        CMD_RESET = 6,
+        CMD_SPAWN_LIGHTWEIGHT = 7,
+      };
+
+    struct Command
+    {
+      uint32_t step;
+      uint8_t type;
+      std::string name;
+      float args[3];
+    };
+
+    CommandLog();
+    ~CommandLog();
+
+    bool openRecord(const std::string& path, uint32_t seed);
+    bool openReplay(const std::string& path);
+
+    bool isRecording() const { return mode_ == Recording; }
+    bool isReplaying() const { return mode_ == Replaying; }
+    uint32_t getSeed() const { return seed_; }
+
+    void setStep(uint32_t step) { step_ = step; }
+    void record(Type type, const std::string& name, float a = 0.0f, float b = 0.0f, float c = 0.0f);
+
+    // Pops the next command scheduled for the given step, if there is one
+    bool nextCommand(uint32_t step, Command& cmd);
+    bool done() const { return mode_ == Replaying && !have_pending_; }
+
+    static size_t argumentCount(uint8_t type);
+
+  private:
+    enum Mode
+      {
+        Closed,
+        Recording,
+        Replaying,
+      };
+
+    bool readCommand(Command& cmd);
+    void close();
+
+    FILE* file_;
+    Mode mode_;
+    uint32_t seed_;
+    uint32_t step_;
+
+    Command pending_;
+    bool have_pending_;
+  };
+  typedef boost::shared_ptr<CommandLog> CommandLogPtr;
+
+}
+
+#endif
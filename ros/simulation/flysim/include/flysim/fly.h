@@ -40,8 +40,13 @@
 #include <flysim/TeleportAbsolute.h>
 #include <flysim/Color.h>
 
+#include "flysim/command_log.h"
+#include "flysim/fly_behavior.h"
+
 #include <wx/wx.h>
 
+#include <vector>
+
 #define PI 3.14159265
 
 namespace flysim
@@ -73,10 +78,45 @@ namespace flysim
     float y;
   };
 
+  /**
+   * Rotated copies of one fly image, one for each of BINS orientations,
+   * shared by every fly drawn with that image.  A copy is rendered the
+   * first time it is asked for, so flies turning on every step cost a
+   * table lookup rather than a rotation.
+   */
+  class FlySprites
+  {
+  public:
+    enum { BINS = 128 };
+
+    FlySprites(const wxImage& image);
+
+    // Nearest bin to an orientation in radians, of any sign
+    int getBin(float orient) const;
+    const wxBitmap& getBitmap(int bin);
+
+  private:
+    wxImage image_;
+    std::vector<wxBitmap> bitmaps_;
+    std::vector<bool> rendered_;
+  };
+  typedef boost::shared_ptr<FlySprites> FlySpritesPtr;
+
   class Fly
   {
   public:
-    Fly(const ros::NodeHandle& nh, const wxImage& fly_image, const Vector2& pos, float orient, wxColour pen_color);
+    // A lightweight fly has no topics or services of its own, and can only
+    // be driven through its behavior and the FlyFrame batch services
+    Fly(const ros::NodeHandle& nh, const std::string& name, const FlySpritesPtr& sprites, const Vector2& pos, float orient, wxColour pen_color, const CommandLogPtr& command_log, bool lightweight = false);
+
+    void setVelocity(float linear, float angular);
+    void teleportRelative(float linear, float angular);
+    void teleportAbsolute(float x, float y, float theta);
+    void setBehavior(const FlyBehaviorPtr& behavior);
+
+    // Canvas coordinates, in mm with y down
+    const Vector2& getPosition() const { return pos_; }
+    float getOrientation() const { return orient_; }
 
     void update(double dt, wxMemoryDC& path_dc, const wxImage& path_image, wxColour background_color, float canvas_width, float canvas_height);
     void paint(wxDC& dc);
@@ -87,9 +127,13 @@ namespace flysim
     bool teleportAbsoluteCallback(flysim::TeleportAbsolute::Request&, flysim::TeleportAbsolute::Response&);
 
     ros::NodeHandle nh_;
+    std::string name_;
+    CommandLogPtr command_log_;
+
+    FlySpritesPtr sprites_;
+    int sprite_bin_;
 
-    wxImage fly_image_;
-    wxBitmap fly_;
+    FlyBehaviorPtr behavior_;
 
     Vector2 pos_;
     float orient_;
@@ -106,7 +150,10 @@ namespace flysim
     ros::ServiceServer teleport_relative_srv_;
     ros::ServiceServer teleport_absolute_srv_;
 
-    ros::WallTime last_command_time_;
+    // Simulated time, advanced by dt on every update, so the command
+    // timeout does not depend on how fast the frame timer fires
+    double sim_time_;
+    double last_command_time_;
 
     float pixels_per_mm_;
 
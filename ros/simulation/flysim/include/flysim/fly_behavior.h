@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2009, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FLYSIM_FLY_BEHAVIOR_H
+#define FLYSIM_FLY_BEHAVIOR_H
+
+#include <ros/ros.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/random/linear_congruential.hpp>
+
+#include <string>
+
+namespace flysim
+{
+
+  /**
+   * Pose handed to a behavior on every step, in the same frame as the
+   * published Pose message: millimeters, y up, theta counterclockwise from +x.
+   */
+  struct BehaviorState
+  {
+    float x;
+    float y;
+    float theta;
+    float canvas_width;
+    float canvas_height;
+  };
+
+  /**
+   * Drives a fly when nothing is publishing command_velocity to it.  A
+   * behavior is created once at spawn time and then called from Fly::update
+   * with the fixed simulation dt, so implementations must stay allocation
+   * free and cheap enough to run for thousands of flies per step.
+   */
+  class FlyBehavior
+  {
+  public:
+    FlyBehavior(uint32_t seed);
+    virtual ~FlyBehavior() {}
+
+    virtual void update(double dt, const BehaviorState& state, float& linear, float& angular) = 0;
+
+    // Copy of this behavior, as freshly constructed, but with its own seed.
+    // Lets a batch of flies share one parameter lookup.
+    virtual boost::shared_ptr<FlyBehavior> clone(uint32_t seed) const = 0;
+
+  protected:
+    void reseed(uint32_t seed);
+
+    // Uniform in [0, 1)
+    float uniform();
+    // Zero mean, unit variance
+    float gaussian();
+    // Exponentially distributed with the given mean
+    float exponential(float mean);
+
+  private:
+    boost::minstd_rand rng_;
+    bool have_spare_;
+    float spare_;
+  };
+  typedef boost::shared_ptr<FlyBehavior> FlyBehaviorPtr;
+
+  /**
+   * Constant speed with a heading that diffuses as an Ornstein-Uhlenbeck
+   * process on the angular velocity.  Within wall_distance of a wall and
+   * heading into it, the fly turns away at turn_max instead.
+   *
+   * Parameters: speed (mm/s), turn_sigma (rad/s), turn_tau (s),
+   * wall_distance (mm), turn_max (rad/s)
+   */
+  class RandomWalkBehavior : public FlyBehavior
+  {
+  public:
+    RandomWalkBehavior(const ros::NodeHandle& nh, uint32_t seed);
+
+    void update(double dt, const BehaviorState& state, float& linear, float& angular);
+    FlyBehaviorPtr clone(uint32_t seed) const;
+
+  protected:
+    float speed_;
+    float turn_sigma_;
+    float turn_tau_;
+    float turn_rate_;
+    float wall_distance_;
+    float turn_max_;
+  };
+
+  /**
+   * Random walk bouts separated by pauses, each with exponentially
+   * distributed duration; the fly picks a new heading when it starts again.
+   *
+   * Parameters: speed, turn_sigma, turn_tau, walk_time (s), stop_time (s)
+   */
+  class StopAndGoBehavior : public RandomWalkBehavior
+  {
+  public:
+    StopAndGoBehavior(const ros::NodeHandle& nh, uint32_t seed);
+
+    void update(double dt, const BehaviorState& state, float& linear, float& angular);
+    FlyBehaviorPtr clone(uint32_t seed) const;
+
+  private:
+    float walk_time_;
+    float stop_time_;
+    float time_left_;
+    bool walking_;
+  };
+
+  /**
+   * Random walk that turns to run along the nearest wall once it comes
+   * within wall_distance of it.
+   *
+   * Parameters: speed, turn_sigma, turn_tau, wall_distance, turn_gain (1/s),
+   * turn_max
+   */
+  class WallFollowBehavior : public RandomWalkBehavior
+  {
+  public:
+    WallFollowBehavior(const ros::NodeHandle& nh, uint32_t seed);
+
+    void update(double dt, const BehaviorState& state, float& linear, float& angular);
+    FlyBehaviorPtr clone(uint32_t seed) const;
+
+  private:
+    float turn_gain_;
+  };
+
+  /**
+   * Creates the behavior named by type ("random_walk", "stop_and_go",
+   * "wall_following"), reading its parameters from nh.  Returns an empty
+   * pointer for "" or "none", and for unknown types.
+   */
+  FlyBehaviorPtr createFlyBehavior(const std::string& type, const ros::NodeHandle& nh, uint32_t seed);
+
+}
+
+#endif
@@ -36,9 +36,16 @@
 #include <std_srvs/Empty.h>
 #include <flysim/Spawn.h>
 #include <flysim/Kill.h>
+#include <flysim/SpawnBatch.h>
+#include <flysim/KillBatch.h>
+#include <flysim/TeleportAbsoluteBatch.h>
 #include <map>
+#include <set>
+
+#include <boost/random/mersenne_twister.hpp>
 
 #include "fly.h"
+#include "sim_camera.h"
 
 namespace flysim
 {
@@ -49,22 +56,29 @@ namespace flysim
     FlyFrame(wxWindow* parent);
     ~FlyFrame();
 
-    std::string spawnFly(const std::string& name, float x, float y, float angle);
+    std::string spawnFly(const std::string& name, float x, float y, float angle, bool lightweight = false);
 
   private:
     void onUpdate(wxTimerEvent& evt);
     void onPaint(wxPaintEvent& evt);
 
     void updateFlies();
+    void replayCommands();
     void clear();
+    void reset();
     bool hasFly(const std::string& name);
+    void loadDefaultBehavior();
 
     bool clearCallback(std_srvs::Empty::Request&, std_srvs::Empty::Response&);
     bool resetCallback(std_srvs::Empty::Request&, std_srvs::Empty::Response&);
     bool spawnCallback(flysim::Spawn::Request&, flysim::Spawn::Response&);
     bool killCallback(flysim::Kill::Request&, flysim::Kill::Response&);
+    bool spawnBatchCallback(flysim::SpawnBatch::Request&, flysim::SpawnBatch::Response&);
+    bool killBatchCallback(flysim::KillBatch::Request&, flysim::KillBatch::Response&);
+    bool teleportAbsoluteBatchCallback(flysim::TeleportAbsoluteBatch::Request&, flysim::TeleportAbsoluteBatch::Response&);
 
     ros::NodeHandle nh_;
+    ros::NodeHandle private_nh_;
     wxTimer* update_timer_;
     wxBitmap path_bitmap_;
     wxImage path_image_;
@@ -78,12 +92,31 @@ namespace flysim
     ros::ServiceServer reset_srv_;
     ros::ServiceServer spawn_srv_;
     ros::ServiceServer kill_srv_;
+    ros::ServiceServer spawn_batch_srv_;
+    ros::ServiceServer kill_batch_srv_;
+    ros::ServiceServer teleport_absolute_batch_srv_;
 
     typedef std::map<std::string, FlyPtr> M_Fly;
     M_Fly flies_;
     uint32_t id_counter_;
+    // Names claimed by the spawn batch in progress, which generated names
+    // must not take
+    std::set<std::string> reserved_names_;
+
+    // ~default_behavior, read once and cloned for lightweight flies
+    FlyBehaviorPtr default_behavior_;
+    bool default_behavior_loaded_;
+
+    uint32_t seed_;
+    boost::mt19937 rng_;
+    CommandLogPtr command_log_;
+
+    SimCameraPtr sim_camera_;
+    SimCamera::V_Blob camera_blobs_;
+    std::string robot_name_;
 
     wxImage fly_images_[2];
+    FlySpritesPtr fly_sprites_[2];
 
     float pixels_per_mm_;
     float width_in_mm_;
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2009, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FLYSIM_SIM_CAMERA_H
+#define FLYSIM_SIM_CAMERA_H
+
+#include <ros/ros.h>
+#include <sensor_msgs/Image.h>
+#include <sensor_msgs/CameraInfo.h>
+#include <image_transport/image_transport.h>
+
+#include <opencv/cv.h>
+
+#include <boost/shared_ptr.hpp>
+
+#include <string>
+#include <vector>
+
+namespace flysim
+{
+
+  /**
+   * Renders the simulated plate as a grayscale camera image and publishes it
+   * on the same topics as camera_firewire (UndistortedImage, OriginalImage
+   * and their CameraInfo), so the tracking pipeline can run against flysim.
+   *
+   * Each fly is drawn as a filled ellipse on a uniform background, then the
+   * image is blurred and noise is added.  OriginalImage additionally has the
+   * kc_* lens distortion applied, matching OriginalCameraInfo.
+   */
+  class SimCamera
+  {
+  public:
+    struct Blob
+    {
+      // Canvas coordinates in mm (y down), theta counterclockwise from +x
+      float x;
+      float y;
+      float theta;
+      bool robot;
+    };
+    typedef std::vector<Blob> V_Blob;
+
+    SimCamera(const ros::NodeHandle& nh, const ros::NodeHandle& private_nh, float canvas_width, float canvas_height, uint32_t seed);
+    ~SimCamera();
+
+    // Advances the camera clock by dt and renders a frame when one is due
+    void update(double dt, const V_Blob& blobs);
+
+  private:
+    void render(const V_Blob& blobs);
+    // Draws this frame's noise, which addNoise then adds to each output
+    void drawNoise();
+    void addNoise(const IplImage* src, IplImage* dst);
+    void initCameraInfo(sensor_msgs::CameraInfo& info, const double* K, const double* D);
+    void initDistortionMaps();
+
+    ros::NodeHandle nh_;
+    image_transport::ImageTransport it_;
+    image_transport::Publisher undistorted_pub_;
+    image_transport::Publisher original_pub_;
+    ros::Publisher undistorted_info_pub_;
+    ros::Publisher original_info_pub_;
+
+    sensor_msgs::Image image_msg_;
+    sensor_msgs::CameraInfo undistorted_info_;
+    sensor_msgs::CameraInfo original_info_;
+
+    int width_;
+    int height_;
+    double framerate_;
+    double time_to_frame_;
+
+    // Canvas mm to image pixels: u = offset_x + x * pixels_per_mm,
+    // v = offset_y + y * pixels_per_mm
+    float pixels_per_mm_;
+    float offset_x_;
+    float offset_y_;
+
+    float fly_length_;
+    float fly_width_;
+    float robot_length_;
+    float robot_width_;
+    int fly_intensity_;
+    int robot_intensity_;
+    int background_;
+    double noise_sigma_;
+    double blur_sigma_;
+
+    std::string frame_id_;
+    double K_[9];
+    double kc_original_[5];
+
+    CvRNG rng_;
+    IplImage* frame_;
+    IplImage* frame_distorted_;
+    IplImage* frame_noisy_;
+    IplImage* noise_;
+    IplImage* accumulator_;
+    IplImage* map_x_;
+    IplImage* map_y_;
+  };
+  typedef boost::shared_ptr<SimCamera> SimCameraPtr;
+
+}
+
+#endif
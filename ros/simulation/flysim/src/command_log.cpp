@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2009, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "flysim/command_log.h"
+
+#include <algorithm>
+#include <cstring>
+
+#define COMMAND_LOG_MAGIC "FLYSIMCL"
+#define COMMAND_LOG_MAGIC_SIZE 8
+#define COMMAND_LOG_VERSION 2
+
+namespace flysim
+{
+
+  CommandLog::CommandLog()
+    : file_(NULL)
+    , mode_(Closed)
+    , seed_(0)
+    , step_(0)
+    , have_pending_(false)
+  {
+  }
+
+  CommandLog::~CommandLog()
+  {
+    close();
+  }
+
+  void CommandLog::close()
+  {
+    if (file_ != NULL)
+      {
+        fclose(file_);
+        file_ = NULL;
+      }
+    mode_ = Closed;
+    have_pending_ = false;
+  }
+
+  size_t CommandLog::argumentCount(uint8_t type)
+  {
+    switch (type)
+      {
+      case CMD_VELOCITY:
+      case CMD_TELEPORT_RELATIVE:
+        return 2;
+      case CMD_TELEPORT_ABSOLUTE:
+      case CMD_SPAWN:
+      case CMD_SPAWN_LIGHTWEIGHT:
+        return 3;
+      default:
+        return 0;
+      }
+  }
+
+  bool CommandLog::openRecord(const std::string& path, uint32_t seed)
+  {
+    close();
+
+    file_ = fopen(path.c_str(), "wb");
+    if (file_ == NULL)
+      {
+        return false;
+      }
+
+    uint32_t version = COMMAND_LOG_VERSION;
+    fwrite(COMMAND_LOG_MAGIC, 1, COMMAND_LOG_MAGIC_SIZE, file_);
+    fwrite(&version, sizeof(version), 1, file_);
+    fwrite(&seed, sizeof(seed), 1, file_);
+
+    seed_ = seed;
+    mode_ = Recording;
+    return true;
+  }
+
+  bool CommandLog::openReplay(const std::string& path)
+  {
+    close();
+
+    file_ = fopen(path.c_str(), "rb");
+    if (file_ == NULL)
+      {
+        return false;
+      }
+
+    char magic[COMMAND_LOG_MAGIC_SIZE];
+    uint32_t version = 0;
+    if (fread(magic, 1, COMMAND_LOG_MAGIC_SIZE, file_) != COMMAND_LOG_MAGIC_SIZE
+        || memcmp(magic, COMMAND_LOG_MAGIC, COMMAND_LOG_MAGIC_SIZE) != 0
+        || fread(&version, sizeof(version), 1, file_) != 1
+        || version == 0 || version > COMMAND_LOG_VERSION
+        || fread(&seed_, sizeof(seed_), 1, file_) != 1)
+      {
+        close();
+        return false;
+      }
+
+    mode_ = Replaying;
+    have_pending_ = readCommand(pending_);
+    return true;
+  }
+
+  void CommandLog::record(Type type, const std::string& name, float a, float b, float c)
+  {
+    if (mode_ != Recording)
+      {
+        return;
+      }
+
+    uint8_t type_byte = type;
+    uint8_t name_size = std::min(name.size(), (size_t)255);
+    float args[3] = {a, b, c};
+
+    fwrite(&step_, sizeof(step_), 1, file_);
+    fwrite(&type_byte, sizeof(type_byte), 1, file_);
+    fwrite(&name_size, sizeof(name_size), 1, file_);
+    fwrite(name.data(), 1, name_size, file_);
+    fwrite(args, sizeof(float), argumentCount(type_byte), file_);
+  }
+
+  bool CommandLog::readCommand(Command& cmd)
+  {
+    uint8_t name_size = 0;
+    if (fread(&cmd.step, sizeof(cmd.step), 1, file_) != 1
+        || fread(&cmd.type, sizeof(cmd.type), 1, file_) != 1
+        || fread(&name_size, sizeof(name_size), 1, file_) != 1)
+      {
+        return false;
+      }
+
+    char name[256];
+    size_t arg_count = argumentCount(cmd.type);
+    if (fread(name, 1, name_size, file_) != name_size
+        || fread(cmd.args, sizeof(float), arg_count, file_) != arg_count)
+      {
+        return false;
+      }
+    cmd.name.assign(name, name_size);
+
+    for (size_t i = arg_count; i < 3; ++i)
+      {
+        cmd.args[i] = 0.0f;
+      }
+
+    return true;
+  }
+
+  bool CommandLog::nextCommand(uint32_t step, Command& cmd)
+  {
+    if (mode_ != Replaying || !have_pending_ || pending_.step > step)
+      {
+        return false;
+      }
+
+    cmd = pending_;
+    have_pending_ = readCommand(pending_);
+    return true;
+  }
+
+}
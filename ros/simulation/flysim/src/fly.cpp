@@ -31,6 +31,8 @@
 
 #include <wx/wx.h>
 
+#include <cmath>
+
 #define DEFAULT_PEN_R 0xb3
 #define DEFAULT_PEN_G 0xb8
 #define DEFAULT_PEN_B 0xff
@@ -38,26 +40,72 @@
 namespace flysim
 {
 
-  Fly::Fly(const ros::NodeHandle& nh, const wxImage& fly_image, const Vector2& pos, float orient, wxColour pen_color)
+  FlySprites::FlySprites(const wxImage& image)
+    : image_(image)
+    , bitmaps_(BINS)
+    , rendered_(BINS, false)
+  {
+  }
+
+  int FlySprites::getBin(float orient) const
+  {
+    int bin = (int)floor(orient / (2*PI) * BINS + 0.5) % BINS;
+    return bin < 0 ? bin + BINS : bin;
+  }
+
+  const wxBitmap& FlySprites::getBitmap(int bin)
+  {
+    if (!rendered_[bin])
+      {
+        float orient = bin * 2*PI / BINS;
+        wxImage rotated_image = image_.Rotate(orient - PI/2.0, wxPoint(image_.GetWidth() / 2, image_.GetHeight() / 2));
+
+        for (int y = 0; y < rotated_image.GetHeight(); ++y)
+          {
+            for (int x = 0; x < rotated_image.GetWidth(); ++x)
+              {
+                if (rotated_image.GetRed(x, y) == 255 && rotated_image.GetBlue(x, y) == 255 && rotated_image.GetGreen(x, y) == 255)
+                  {
+                    rotated_image.SetAlpha(x, y, 0);
+                  }
+              }
+          }
+
+        bitmaps_[bin] = wxBitmap(rotated_image);
+        rendered_[bin] = true;
+      }
+    return bitmaps_[bin];
+  }
+
+  Fly::Fly(const ros::NodeHandle& nh, const std::string& name, const FlySpritesPtr& sprites, const Vector2& pos, float orient, wxColour pen_color, const CommandLogPtr& command_log, bool lightweight)
     : nh_(nh)
-    , fly_image_(fly_image)
+    , name_(name)
+    , command_log_(command_log)
+    , sprites_(sprites)
+    , sprite_bin_(sprites->getBin(orient))
     , pos_(pos)
     , orient_(orient)
     , lin_vel_(0.0)
     , ang_vel_(0.0)
     , pen_on_(true)
     , pen_(pen_color)
+    , sim_time_(0.0)
+    , last_command_time_(0.0)
     // , pen_(wxColour(DEFAULT_PEN_R, DEFAULT_PEN_G, DEFAULT_PEN_B))
   {
     pen_.SetWidth(3);
-    fly_ = wxBitmap(fly_image_);
 
-    velocity_sub_ = nh_.subscribe("command_velocity", 1, &Fly::velocityCallback, this);
-    pose_pub_ = nh_.advertise<Pose>("pose", 1);
-    color_pub_ = nh_.advertise<Color>("color_sensor", 1);
-    set_pen_srv_ = nh_.advertiseService("set_pen", &Fly::setPenCallback, this);
-    teleport_relative_srv_ = nh_.advertiseService("teleport_relative", &Fly::teleportRelativeCallback, this);
-    teleport_absolute_srv_ = nh_.advertiseService("teleport_absolute", &Fly::teleportAbsoluteCallback, this);
+    // Each of these is a round trip to the master, which is most of the
+    // cost of spawning a fly
+    if (!lightweight)
+      {
+        velocity_sub_ = nh_.subscribe("command_velocity", 1, &Fly::velocityCallback, this);
+        pose_pub_ = nh_.advertise<Pose>("pose", 1);
+        color_pub_ = nh_.advertise<Color>("color_sensor", 1);
+        set_pen_srv_ = nh_.advertiseService("set_pen", &Fly::setPenCallback, this);
+        teleport_relative_srv_ = nh_.advertiseService("teleport_relative", &Fly::teleportRelativeCallback, this);
+        teleport_absolute_srv_ = nh_.advertiseService("teleport_absolute", &Fly::teleportAbsoluteCallback, this);
+      }
 
     // pixels_per_mm_ = fly_.GetHeight();
     // pixels_per_mm_ = fly_.GetHeight()/4;
@@ -67,9 +115,35 @@ namespace flysim
 
   void Fly::velocityCallback(const VelocityConstPtr& vel)
   {
-    last_command_time_ = ros::WallTime::now();
-    lin_vel_ = vel->linear;
-    ang_vel_ = vel->angular;
+    if (command_log_->isReplaying())
+      {
+        return;
+      }
+
+    command_log_->record(CommandLog::CMD_VELOCITY, name_, vel->linear, vel->angular);
+    setVelocity(vel->linear, vel->angular);
+  }
+
+  void Fly::setVelocity(float linear, float angular)
+  {
+    last_command_time_ = sim_time_;
+    lin_vel_ = linear;
+    ang_vel_ = angular;
+  }
+
+  void Fly::teleportRelative(float linear, float angular)
+  {
+    teleport_requests_.push_back(TeleportRequest(0, 0, angular, linear, true));
+  }
+
+  void Fly::teleportAbsolute(float x, float y, float theta)
+  {
+    teleport_requests_.push_back(TeleportRequest(x, y, theta, 0, false));
+  }
+
+  void Fly::setBehavior(const FlyBehaviorPtr& behavior)
+  {
+    behavior_ = behavior;
   }
 
   bool Fly::setPenCallback(flysim::SetPen::Request& req, flysim::SetPen::Response&)
@@ -92,13 +166,27 @@ namespace flysim
 
   bool Fly::teleportRelativeCallback(flysim::TeleportRelative::Request& req, flysim::TeleportRelative::Response&)
   {
-    teleport_requests_.push_back(TeleportRequest(0, 0, req.angular, req.linear, true));
+    if (command_log_->isReplaying())
+      {
+        ROS_WARN("Ignoring teleport of fly [%s] while replaying a command log", name_.c_str());
+        return false;
+      }
+
+    command_log_->record(CommandLog::CMD_TELEPORT_RELATIVE, name_, req.linear, req.angular);
+    teleportRelative(req.linear, req.angular);
     return true;
   }
 
   bool Fly::teleportAbsoluteCallback(flysim::TeleportAbsolute::Request& req, flysim::TeleportAbsolute::Response&)
   {
-    teleport_requests_.push_back(TeleportRequest(req.x, req.y, req.theta, 0, false));
+    if (command_log_->isReplaying())
+      {
+        ROS_WARN("Ignoring teleport of fly [%s] while replaying a command log", name_.c_str());
+        return false;
+      }
+
+    command_log_->record(CommandLog::CMD_TELEPORT_ABSOLUTE, name_, req.x, req.y, req.theta);
+    teleportAbsolute(req.x, req.y, req.theta);
     return true;
   }
 
@@ -131,10 +219,25 @@ namespace flysim
 
     teleport_requests_.clear();
 
-    if (ros::WallTime::now() - last_command_time_ > ros::WallDuration(1.0))
+    sim_time_ += dt;
+    bool behavior_driven = false;
+    if (sim_time_ - last_command_time_ > 1.0)
       {
         lin_vel_ = 0.0f;
         ang_vel_ = 0.0f;
+
+        // Without a live command, the behavior (if any) steers the fly
+        if (behavior_)
+          {
+            BehaviorState state;
+            state.x = pos_.x;
+            state.y = canvas_height - pos_.y;
+            state.theta = orient_;
+            state.canvas_width = canvas_width;
+            state.canvas_height = canvas_height;
+            behavior_->update(dt, state, lin_vel_, ang_vel_);
+            behavior_driven = true;
+          }
       }
 
     Vector2 old_pos = pos_;
@@ -143,9 +246,12 @@ namespace flysim
     pos_.x += sin(orient_ + PI/2.0) * lin_vel_ * dt;
     pos_.y += cos(orient_ + PI/2.0) * lin_vel_ * dt;
 
-    // Clamp to screen size
-    if (pos_.x < 0 || pos_.x >= canvas_width
-        || pos_.y < 0 || pos_.y >= canvas_height)
+    // Clamp to screen size.  Behaviors reach the walls as a matter of
+    // course, and a stopped fly sitting on one would warn every step, so
+    // only commanded flies complain
+    if (!behavior_driven
+        && (pos_.x < 0 || pos_.x >= canvas_width
+            || pos_.y < 0 || pos_.y >= canvas_height))
       {
         ROS_WARN("Oh no! I hit the wall! (Clamping from [x=%f, y=%f])", pos_.x, pos_.y);
       }
@@ -156,40 +262,30 @@ namespace flysim
     int canvas_x = pos_.x * pixels_per_mm_;
     int canvas_y = pos_.y * pixels_per_mm_;
 
-    {
-      wxImage rotated_image = fly_image_.Rotate(orient_ - PI/2.0, wxPoint(fly_image_.GetWidth() / 2, fly_image_.GetHeight() / 2));
-
-      for (int y = 0; y < rotated_image.GetHeight(); ++y)
-        {
-          for (int x = 0; x < rotated_image.GetWidth(); ++x)
-            {
-              if (rotated_image.GetRed(x, y) == 255 && rotated_image.GetBlue(x, y) == 255 && rotated_image.GetGreen(x, y) == 255)
-                {
-                  rotated_image.SetAlpha(x, y, 0);
-                }
-            }
-        }
-
-      fly_ = wxBitmap(rotated_image);
-    }
-
-    Pose p;
-    p.x = pos_.x;
-    p.y = canvas_height - pos_.y;
-    p.theta = orient_;
-    p.linear_velocity = lin_vel_;
-    p.angular_velocity = ang_vel_;
-    pose_pub_.publish(p);
+    // Rendering waits for paint, and then only the first time any fly
+    // with this image is drawn at this bin's orientation
+    sprite_bin_ = sprites_->getBin(orient_);
+
+    if (pose_pub_)
+      {
+        Pose p;
+        p.x = pos_.x;
+        p.y = canvas_height - pos_.y;
+        p.theta = orient_;
+        p.linear_velocity = lin_vel_;
+        p.angular_velocity = ang_vel_;
+        pose_pub_.publish(p);
+      }
 
     // Figure out (and publish) the color underneath the fly
-    {
-      wxSize fly_size = wxSize(fly_.GetWidth(), fly_.GetHeight());
-      Color color;
-      color.r = path_image.GetRed(canvas_x, canvas_y);
-      color.g = path_image.GetGreen(canvas_x, canvas_y);
-      color.b = path_image.GetBlue(canvas_x, canvas_y);
-      color_pub_.publish(color);
-    }
+    if (color_pub_)
+      {
+        Color color;
+        color.r = path_image.GetRed(canvas_x, canvas_y);
+        color.g = path_image.GetGreen(canvas_x, canvas_y);
+        color.b = path_image.GetBlue(canvas_x, canvas_y);
+        color_pub_.publish(color);
+      }
 
     ROS_DEBUG("[%s]: pos_x: %f pos_y: %f theta: %f", nh_.getNamespace().c_str(), pos_.x, pos_.y, orient_);
 
@@ -205,8 +301,9 @@ namespace flysim
 
   void Fly::paint(wxDC& dc)
   {
-    wxSize fly_size = wxSize(fly_.GetWidth(), fly_.GetHeight());
-    dc.DrawBitmap(fly_, pos_.x * pixels_per_mm_ - (fly_size.GetWidth() / 2), pos_.y * pixels_per_mm_ - (fly_size.GetHeight() / 2), true);
+    const wxBitmap& sprite = sprites_->getBitmap(sprite_bin_);
+    wxSize fly_size = wxSize(sprite.GetWidth(), sprite.GetHeight());
+    dc.DrawBitmap(sprite, pos_.x * pixels_per_mm_ - (fly_size.GetWidth() / 2), pos_.y * pixels_per_mm_ - (fly_size.GetHeight() / 2), true);
   }
 
 }
@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2009, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "flysim/fly_behavior.h"
+
+#include <cmath>
+#include <algorithm>
+
+#define PI 3.14159265
+
+namespace flysim
+{
+
+  static float floatParam(const ros::NodeHandle& nh, const std::string& name, double default_value)
+  {
+    double value;
+    nh.param(name, value, default_value);
+    return value;
+  }
+
+  static float wrapAngle(float angle)
+  {
+    while (angle > PI)
+      {
+        angle -= 2*PI;
+      }
+    while (angle < -PI)
+      {
+        angle += 2*PI;
+      }
+    return angle;
+  }
+
+  FlyBehavior::FlyBehavior(uint32_t seed)
+    : rng_(seed == 0 ? 1 : seed)
+    , have_spare_(false)
+    , spare_(0.0f)
+  {
+  }
+
+  void FlyBehavior::reseed(uint32_t seed)
+  {
+    rng_.seed(seed == 0 ? 1 : seed);
+    have_spare_ = false;
+  }
+
+  float FlyBehavior::uniform()
+  {
+    return (float)(rng_() - rng_.min()) / ((float)(rng_.max() - rng_.min()) + 1.0f);
+  }
+
+  float FlyBehavior::gaussian()
+  {
+    // Box-Muller, keeping the second variate for the next call
+    if (have_spare_)
+      {
+        have_spare_ = false;
+        return spare_;
+      }
+
+    float u1 = std::max(uniform(), 1e-7f);
+    float u2 = uniform();
+    float r = sqrt(-2.0f * log(u1));
+    spare_ = r * sin(2*PI * u2);
+    have_spare_ = true;
+    return r * cos(2*PI * u2);
+  }
+
+  float FlyBehavior::exponential(float mean)
+  {
+    return -mean * log(std::max(1.0f - uniform(), 1e-7f));
+  }
+
+  RandomWalkBehavior::RandomWalkBehavior(const ros::NodeHandle& nh, uint32_t seed)
+    : FlyBehavior(seed)
+    , turn_rate_(0.0f)
+  {
+    speed_ = floatParam(nh, "speed", 10.0);
+    turn_sigma_ = floatParam(nh, "turn_sigma", 2.0);
+    turn_tau_ = std::max(floatParam(nh, "turn_tau", 0.5), 1e-3f);
+    wall_distance_ = floatParam(nh, "wall_distance", 5.0);
+    turn_max_ = floatParam(nh, "turn_max", 2*PI);
+  }
+
+  void RandomWalkBehavior::update(double dt, const BehaviorState& state, float& linear, float& angular)
+  {
+    // Ornstein-Uhlenbeck turn rate: relaxes to zero with time constant
+    // turn_tau, stationary standard deviation turn_sigma
+    float decay = dt / turn_tau_;
+    turn_rate_ += -turn_rate_ * decay + turn_sigma_ * sqrt(2.0f * decay) * gaussian();
+
+    linear = speed_;
+    angular = turn_rate_;
+
+    // Turn away from a nearby wall the fly is heading into, rather than
+    // walking on into it and sticking there
+    float distance[4] =
+      {
+        state.x,
+        state.canvas_width - state.x,
+        state.y,
+        state.canvas_height - state.y
+      };
+    float outward[4] = { PI, 0.0, -PI/2.0, PI/2.0 };
+    int wall = std::min_element(distance, distance + 4) - distance;
+    if (distance[wall] > wall_distance_)
+      {
+        return;
+      }
+
+    float error = wrapAngle(state.theta - outward[wall]);
+    if (fabs(error) < PI/2.0)
+      {
+        turn_rate_ = (error < 0.0f) ? -turn_max_ : turn_max_;
+        angular = turn_rate_;
+      }
+  }
+
+  FlyBehaviorPtr RandomWalkBehavior::clone(uint32_t seed) const
+  {
+    RandomWalkBehavior* behavior = new RandomWalkBehavior(*this);
+    behavior->reseed(seed);
+    behavior->turn_rate_ = 0.0f;
+    return FlyBehaviorPtr(behavior);
+  }
+
+  StopAndGoBehavior::StopAndGoBehavior(const ros::NodeHandle& nh, uint32_t seed)
+    : RandomWalkBehavior(nh, seed)
+    , walking_(false)
+  {
+    walk_time_ = floatParam(nh, "walk_time", 2.0);
+    stop_time_ = floatParam(nh, "stop_time", 1.0);
+    time_left_ = exponential(stop_time_);
+  }
+
+  void StopAndGoBehavior::update(double dt, const BehaviorState& state, float& linear, float& angular)
+  {
+    time_left_ -= dt;
+    if (time_left_ <= 0.0f)
+      {
+        walking_ = !walking_;
+        time_left_ = exponential(walking_ ? walk_time_ : stop_time_);
+        if (walking_)
+          {
+            // Start each bout off in a fresh direction
+            turn_rate_ = turn_sigma_ * gaussian();
+          }
+      }
+
+    if (walking_)
+      {
+        RandomWalkBehavior::update(dt, state, linear, angular);
+      }
+    else
+      {
+        linear = 0.0f;
+        angular = 0.0f;
+      }
+  }
+
+  FlyBehaviorPtr StopAndGoBehavior::clone(uint32_t seed) const
+  {
+    StopAndGoBehavior* behavior = new StopAndGoBehavior(*this);
+    behavior->reseed(seed);
+    behavior->turn_rate_ = 0.0f;
+    behavior->walking_ = false;
+    behavior->time_left_ = behavior->exponential(stop_time_);
+    return FlyBehaviorPtr(behavior);
+  }
+
+  WallFollowBehavior::WallFollowBehavior(const ros::NodeHandle& nh, uint32_t seed)
+    : RandomWalkBehavior(nh, seed)
+  {
+    turn_gain_ = floatParam(nh, "turn_gain", 4.0);
+  }
+
+  void WallFollowBehavior::update(double dt, const BehaviorState& state, float& linear, float& angular)
+  {
+    RandomWalkBehavior::update(dt, state, linear, angular);
+
+    float distance[4] =
+      {
+        state.x,
+        state.canvas_width - state.x,
+        state.y,
+        state.canvas_height - state.y
+      };
+    int wall = std::min_element(distance, distance + 4) - distance;
+    if (distance[wall] > wall_distance_)
+      {
+        return;
+      }
+
+    // Run along the wall in whichever direction is closer to the current
+    // heading, steering back out if the fly has ended up facing into it
+    float tangent = (wall < 2) ? PI/2.0 : 0.0;
+    float error = wrapAngle(tangent - state.theta);
+    if (fabs(error) > PI/2.0)
+      {
+        error = wrapAngle(error + PI);
+      }
+
+    angular = std::min(std::max(turn_gain_ * error, -turn_max_), turn_max_);
+    turn_rate_ = 0.0f;
+  }
+
+  FlyBehaviorPtr WallFollowBehavior::clone(uint32_t seed) const
+  {
+    WallFollowBehavior* behavior = new WallFollowBehavior(*this);
+    behavior->reseed(seed);
+    behavior->turn_rate_ = 0.0f;
+    return FlyBehaviorPtr(behavior);
+  }
+
+  FlyBehaviorPtr createFlyBehavior(const std::string& type, const ros::NodeHandle& nh, uint32_t seed)
+  {
+    FlyBehaviorPtr behavior;
+    if (type == "random_walk")
+      {
+        behavior.reset(new RandomWalkBehavior(nh, seed));
+      }
+    else if (type == "stop_and_go")
+      {
+        behavior.reset(new StopAndGoBehavior(nh, seed));
+      }
+    else if (type == "wall_following")
+      {
+        behavior.reset(new WallFollowBehavior(nh, seed));
+      }
+    else if (!type.empty() && type != "none")
+      {
+        ROS_WARN("Unknown fly behavior [%s]", type.c_str());
+      }
+    return behavior;
+  }
+
+}
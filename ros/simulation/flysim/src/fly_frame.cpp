@@ -45,10 +45,46 @@ namespace flysim
 
   FlyFrame::FlyFrame(wxWindow* parent)
     : wxFrame(parent, wxID_ANY, wxT("FlySim"), wxDefaultPosition, wxSize(600, 600), wxDEFAULT_FRAME_STYLE & ~wxRESIZE_BORDER)
+    , private_nh_("~")
     , frame_count_(0)
     , id_counter_(0)
+    , default_behavior_loaded_(false)
+    , command_log_(new CommandLog())
   {
-    srand(time(NULL));
+    // Seed the simulation from ~seed if given, so runs can be repeated; a
+    // replayed command log brings its own seed
+    int seed;
+    private_nh_.param("seed", seed, (int)time(NULL));
+    seed_ = seed;
+
+    std::string replay_path;
+    std::string record_path;
+    if (private_nh_.getParam("replay_commands", replay_path))
+      {
+        if (command_log_->openReplay(replay_path))
+          {
+            seed_ = command_log_->getSeed();
+            ROS_INFO("Replaying commands from [%s] with seed %u", replay_path.c_str(), seed_);
+          }
+        else
+          {
+            ROS_ERROR("Could not open command log [%s] for replay", replay_path.c_str());
+          }
+      }
+    else if (private_nh_.getParam("record_commands", record_path))
+      {
+        if (command_log_->openRecord(record_path, seed_))
+          {
+            ROS_INFO("Recording commands to [%s] with seed %u", record_path.c_str(), seed_);
+          }
+        else
+          {
+            ROS_ERROR("Could not open command log [%s] for recording", record_path.c_str());
+          }
+      }
+
+    srand(seed_);
+    rng_.seed(seed_);
 
     update_timer_ = new wxTimer(this);
     update_timer_->Start(16);
@@ -72,6 +108,7 @@ namespace flysim
         fly_images_[i].LoadFile(wxString::FromAscii((images_path + flies[i]).c_str()));
         fly_images_[i].SetMask(true);
         fly_images_[i].SetMaskColour(255, 255, 255);
+        fly_sprites_[i].reset(new FlySprites(fly_images_[i]));
       }
 
     // pixels_per_mm_ = fly_images_[0].GetHeight();
@@ -86,11 +123,22 @@ namespace flysim
     reset_srv_ = nh_.advertiseService("reset", &FlyFrame::resetCallback, this);
     spawn_srv_ = nh_.advertiseService("spawn", &FlyFrame::spawnCallback, this);
     kill_srv_ = nh_.advertiseService("kill", &FlyFrame::killCallback, this);
+    spawn_batch_srv_ = nh_.advertiseService("spawn_batch", &FlyFrame::spawnBatchCallback, this);
+    kill_batch_srv_ = nh_.advertiseService("kill_batch", &FlyFrame::killBatchCallback, this);
+    teleport_absolute_batch_srv_ = nh_.advertiseService("teleport_absolute_batch", &FlyFrame::teleportAbsoluteBatchCallback, this);
 
     ROS_INFO("Starting flysim with node name %s", ros::this_node::getName().c_str()) ;
 
     width_in_mm_ = GetSize().GetWidth() / pixels_per_mm_;
     height_in_mm_ = GetSize().GetHeight() / pixels_per_mm_;
+
+    bool camera_enable;
+    private_nh_.param("camera/enable", camera_enable, false);
+    if (camera_enable)
+      {
+        sim_camera_.reset(new SimCamera(nh_, ros::NodeHandle(private_nh_, "camera"), width_in_mm_, height_in_mm_, seed_));
+      }
+
     spawnFly("robot", width_in_mm_ / 2.0, height_in_mm_ / 2.0, 0);
   }
 
@@ -101,6 +149,12 @@ namespace flysim
 
   bool FlyFrame::spawnCallback(flysim::Spawn::Request& req, flysim::Spawn::Response& res)
   {
+    if (command_log_->isReplaying())
+      {
+        ROS_WARN("Ignoring spawn request while replaying a command log");
+        return false;
+      }
+
     std::string name = spawnFly(req.name, req.x, req.y, req.theta);
     if (name.empty())
       {
@@ -108,6 +162,7 @@ namespace flysim
         return false;
       }
 
+    command_log_->record(CommandLog::CMD_SPAWN, name, req.x, req.y, req.theta);
     res.name = name;
 
     return true;
@@ -115,6 +170,12 @@ namespace flysim
 
   bool FlyFrame::killCallback(flysim::Kill::Request& req, flysim::Kill::Response&)
   {
+    if (command_log_->isReplaying())
+      {
+        ROS_WARN("Ignoring kill request while replaying a command log");
+        return false;
+      }
+
     M_Fly::iterator it = flies_.find(req.name);
     if (it == flies_.end())
       {
@@ -123,6 +184,130 @@ namespace flysim
       }
 
     flies_.erase(it);
+    command_log_->record(CommandLog::CMD_KILL, req.name);
+
+    return true;
+  }
+
+  bool FlyFrame::spawnBatchCallback(flysim::SpawnBatch::Request& req, flysim::SpawnBatch::Response& res)
+  {
+    if (command_log_->isReplaying())
+      {
+        ROS_WARN("Ignoring spawn_batch request while replaying a command log");
+        return false;
+      }
+
+    ros::WallTime start = ros::WallTime::now();
+
+    size_t count = req.x.size();
+    if (req.y.size() != count || req.theta.size() != count || req.name.size() > count)
+      {
+        ROS_ERROR("spawn_batch needs x, y and theta of equal length, and at most that many names");
+        return false;
+      }
+
+    // Check every name before spawning anything, so a bad batch changes nothing
+    std::set<std::string> names;
+    for (size_t i = 0; i < req.name.size(); ++i)
+      {
+        if (req.name[i].empty())
+          {
+            continue;
+          }
+        if (hasFly(req.name[i]) || !names.insert(req.name[i]).second)
+          {
+            ROS_ERROR("A fly named [%s] already exists", req.name[i].c_str());
+            return false;
+          }
+      }
+
+    reserved_names_.swap(names);
+    default_behavior_loaded_ = false;
+
+    res.name.resize(count);
+    for (size_t i = 0; i < count; ++i)
+      {
+        std::string name = (i < req.name.size()) ? req.name[i] : "";
+        res.name[i] = spawnFly(name, req.x[i], req.y[i], req.theta[i], req.lightweight);
+        command_log_->record(req.lightweight ? CommandLog::CMD_SPAWN_LIGHTWEIGHT : CommandLog::CMD_SPAWN, res.name[i], req.x[i], req.y[i], req.theta[i]);
+      }
+
+    reserved_names_.clear();
+
+    res.duration = (ros::WallTime::now() - start).toSec();
+    ROS_INFO("Spawned %u flies in %f seconds", (unsigned int)count, res.duration);
+
+    return true;
+  }
+
+  bool FlyFrame::killBatchCallback(flysim::KillBatch::Request& req, flysim::KillBatch::Response& res)
+  {
+    if (command_log_->isReplaying())
+      {
+        ROS_WARN("Ignoring kill_batch request while replaying a command log");
+        return false;
+      }
+
+    ros::WallTime start = ros::WallTime::now();
+
+    std::set<std::string> names;
+    for (size_t i = 0; i < req.name.size(); ++i)
+      {
+        if (!hasFly(req.name[i]) || !names.insert(req.name[i]).second)
+          {
+            ROS_ERROR("Tried to kill fly [%s], which does not exist", req.name[i].c_str());
+            return false;
+          }
+      }
+
+    for (size_t i = 0; i < req.name.size(); ++i)
+      {
+        flies_.erase(req.name[i]);
+        command_log_->record(CommandLog::CMD_KILL, req.name[i]);
+      }
+
+    res.duration = (ros::WallTime::now() - start).toSec();
+
+    return true;
+  }
+
+  bool FlyFrame::teleportAbsoluteBatchCallback(flysim::TeleportAbsoluteBatch::Request& req, flysim::TeleportAbsoluteBatch::Response& res)
+  {
+    if (command_log_->isReplaying())
+      {
+        ROS_WARN("Ignoring teleport_absolute_batch request while replaying a command log");
+        return false;
+      }
+
+    ros::WallTime start = ros::WallTime::now();
+
+    size_t count = req.name.size();
+    if (req.x.size() != count || req.y.size() != count || req.theta.size() != count)
+      {
+        ROS_ERROR("teleport_absolute_batch needs name, x, y and theta of equal length");
+        return false;
+      }
+
+    std::vector<Fly*> flies(count);
+    for (size_t i = 0; i < count; ++i)
+      {
+        M_Fly::iterator it = flies_.find(req.name[i]);
+        if (it == flies_.end())
+          {
+            ROS_ERROR("Tried to teleport fly [%s], which does not exist", req.name[i].c_str());
+            return false;
+          }
+        flies[i] = it->second.get();
+      }
+
+    // Queued like single teleports, so they all land on the coming step
+    for (size_t i = 0; i < count; ++i)
+      {
+        flies[i]->teleportAbsolute(req.x[i], req.y[i], req.theta[i]);
+        command_log_->record(CommandLog::CMD_TELEPORT_ABSOLUTE, req.name[i], req.x[i], req.y[i], req.theta[i]);
+      }
+
+    res.duration = (ros::WallTime::now() - start).toSec();
 
     return true;
   }
@@ -132,7 +317,16 @@ namespace flysim
     return flies_.find(name) != flies_.end();
   }
 
-  std::string FlyFrame::spawnFly(const std::string& name, float x, float y, float angle)
+  void FlyFrame::loadDefaultBehavior()
+  {
+    std::string behavior_type;
+    ros::NodeHandle behavior_nh(private_nh_, "default_behavior");
+    behavior_nh.param("type", behavior_type, std::string("none"));
+    default_behavior_ = createFlyBehavior(behavior_type, behavior_nh, 0);
+    default_behavior_loaded_ = true;
+  }
+
+  std::string FlyFrame::spawnFly(const std::string& name, float x, float y, float angle, bool lightweight)
   {
     std::string real_name = name;
     if (real_name.empty())
@@ -150,7 +344,7 @@ namespace flysim
                 ss << "fly" << ++id_counter_;
               }
             real_name = ss.str();
-          } while (hasFly(real_name));
+          } while (hasFly(real_name) || reserved_names_.count(real_name));
       }
     else
       {
@@ -166,13 +360,52 @@ namespace flysim
       {
         image_n = 0;
         pen_color = wxColour(0x00,0x00,0xff);
+        robot_name_ = real_name;
       }
 
     // FlyPtr t(new Fly(ros::NodeHandle(real_name), fly_images_[rand() % 2], Vector2(x, y), angle));
-    FlyPtr t(new Fly(ros::NodeHandle(real_name), fly_images_[image_n], Vector2(x, y), angle, pen_color));
+    FlyPtr t(new Fly(ros::NodeHandle(real_name), real_name, fly_sprites_[image_n], Vector2(x, y), angle, pen_color, command_log_, lightweight));
+
+    if (lightweight)
+      {
+        // Skip the per-fly parameter lookups too, and clone ~default_behavior
+        if (!default_behavior_loaded_)
+          {
+            loadDefaultBehavior();
+          }
+        uint32_t behavior_seed = rng_();
+        if (default_behavior_ && !flies_.empty())
+          {
+            t->setBehavior(default_behavior_->clone(behavior_seed));
+          }
+      }
+    else
+      {
+        // Behavior comes from <name>/behavior/type, falling back to
+        // ~default_behavior/type for every fly but the robot
+        std::string behavior_type;
+        ros::NodeHandle behavior_nh(real_name + "/behavior");
+        if (!behavior_nh.getParam("type", behavior_type) && !flies_.empty())
+          {
+            behavior_nh = ros::NodeHandle(private_nh_, "default_behavior");
+            behavior_nh.param("type", behavior_type, std::string("none"));
+          }
+        // Draw the seed even when there is no behavior, so the random sequence
+        // seen by later flies does not depend on parameters of earlier ones
+        uint32_t behavior_seed = rng_();
+        t->setBehavior(createFlyBehavior(behavior_type, behavior_nh, behavior_seed));
+      }
+
     flies_[real_name] = t;
 
-    ROS_INFO("Spawning fly [%s] at x=[%f], y=[%f], theta=[%f]", real_name.c_str(), x, y, angle);
+    if (lightweight)
+      {
+        ROS_DEBUG("Spawning lightweight fly [%s] at x=[%f], y=[%f], theta=[%f]", real_name.c_str(), x, y, angle);
+      }
+    else
+      {
+        ROS_INFO("Spawning fly [%s] at x=[%f], y=[%f], theta=[%f]", real_name.c_str(), x, y, angle);
+      }
 
     return real_name;
   }
@@ -193,8 +426,15 @@ namespace flysim
 
   void FlyFrame::onUpdate(wxTimerEvent& evt)
   {
+    // Commands that arrive during spinOnce are applied on this step
+    command_log_->setStep(frame_count_);
     ros::spinOnce();
 
+    if (command_log_->isReplaying())
+      {
+        replayCommands();
+      }
+
     updateFlies();
 
     if (!ros::ok())
@@ -217,6 +457,54 @@ namespace flysim
       }
   }
 
+  void FlyFrame::replayCommands()
+  {
+    CommandLog::Command cmd;
+    while (command_log_->nextCommand(frame_count_, cmd))
+      {
+        if (cmd.type == CommandLog::CMD_SPAWN || cmd.type == CommandLog::CMD_SPAWN_LIGHTWEIGHT)
+          {
+            spawnFly(cmd.name, cmd.args[0], cmd.args[1], cmd.args[2], cmd.type == CommandLog::CMD_SPAWN_LIGHTWEIGHT);
+            continue;
+          }
+        else if (cmd.type == CommandLog::CMD_RESET)
+          {
+            reset();
+            continue;
+          }
+
+        M_Fly::iterator it = flies_.find(cmd.name);
+        if (it == flies_.end())
+          {
+            ROS_WARN("Command log refers to fly [%s], which does not exist", cmd.name.c_str());
+            continue;
+          }
+
+        switch (cmd.type)
+          {
+          case CommandLog::CMD_VELOCITY:
+            it->second->setVelocity(cmd.args[0], cmd.args[1]);
+            break;
+          case CommandLog::CMD_TELEPORT_RELATIVE:
+            it->second->teleportRelative(cmd.args[0], cmd.args[1]);
+            break;
+          case CommandLog::CMD_TELEPORT_ABSOLUTE:
+            it->second->teleportAbsolute(cmd.args[0], cmd.args[1], cmd.args[2]);
+            break;
+          case CommandLog::CMD_KILL:
+            flies_.erase(it);
+            break;
+          default:
+            ROS_WARN("Unknown command type %d in command log", cmd.type);
+          }
+      }
+
+    if (command_log_->done())
+      {
+        ROS_INFO_ONCE("Command log replay finished at step %llu", (unsigned long long)frame_count_);
+      }
+  }
+
   void FlyFrame::updateFlies()
   {
     if (last_fly_update_.isZero())
@@ -238,6 +526,21 @@ namespace flysim
         it->second->update(0.016, path_dc_, path_image_, path_dc_.GetBackground().GetColour(), width_in_mm_, height_in_mm_);
       }
 
+    if (sim_camera_)
+      {
+        camera_blobs_.clear();
+        for (it = flies_.begin(); it != end; ++it)
+          {
+            SimCamera::Blob blob;
+            blob.x = it->second->getPosition().x;
+            blob.y = it->second->getPosition().y;
+            blob.theta = it->second->getOrientation();
+            blob.robot = (it->first == robot_name_);
+            camera_blobs_.push_back(blob);
+          }
+        sim_camera_->update(0.016, camera_blobs_);
+      }
+
     ++frame_count_;
   }
 
@@ -250,13 +553,26 @@ namespace flysim
   }
 
   bool FlyFrame::resetCallback(std_srvs::Empty::Request&, std_srvs::Empty::Response&)
+  {
+    if (command_log_->isReplaying())
+      {
+        ROS_WARN("Ignoring reset request while replaying a command log");
+        return false;
+      }
+
+    command_log_->record(CommandLog::CMD_RESET, "");
+    reset();
+    return true;
+  }
+
+  void FlyFrame::reset()
   {
     ROS_INFO("Resetting flysim.");
     flies_.clear();
     id_counter_ = 0;
+    default_behavior_loaded_ = false;
     spawnFly("robot", width_in_mm_ / 2.0, height_in_mm_ / 2.0, 0);
     clear();
-    return true;
   }
 
 }
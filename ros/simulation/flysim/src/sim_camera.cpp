@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2009, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "flysim/sim_camera.h"
+
+#include <cv_bridge/CvBridge.h>
+
+#include <algorithm>
+#include <cmath>
+
+#define PI 3.14159265
+
+// Ellipse centers and axes are drawn with this many fractional bits
+#define DRAW_SHIFT 4
+
+namespace flysim
+{
+
+  SimCamera::SimCamera(const ros::NodeHandle& nh, const ros::NodeHandle& private_nh, float canvas_width, float canvas_height, uint32_t seed)
+    : nh_(nh)
+    , it_(nh_)
+    , time_to_frame_(0.0)
+    , rng_(cvRNG(seed == 0 ? 1 : seed))
+    , frame_(NULL)
+    , frame_distorted_(NULL)
+    , frame_noisy_(NULL)
+    , noise_(NULL)
+    , accumulator_(NULL)
+    , map_x_(NULL)
+    , map_y_(NULL)
+  {
+    private_nh.param("width", width_, 480);
+    private_nh.param("height", height_, 480);
+    private_nh.param("framerate", framerate_, 25.0);
+    private_nh.param("frame_id", frame_id_, std::string(""));
+
+    // By default the whole canvas fills the image, centered
+    double pixels_per_mm;
+    double offset_x;
+    double offset_y;
+    private_nh.param("pixels_per_mm", pixels_per_mm, (double)std::min(width_ / canvas_width, height_ / canvas_height));
+    private_nh.param("offset_x", offset_x, (width_ - canvas_width * pixels_per_mm) / 2.0);
+    private_nh.param("offset_y", offset_y, (height_ - canvas_height * pixels_per_mm) / 2.0);
+    pixels_per_mm_ = pixels_per_mm;
+    offset_x_ = offset_x;
+    offset_y_ = offset_y;
+
+    double value;
+    private_nh.param("fly_length", value, 2.5);
+    fly_length_ = value;
+    private_nh.param("fly_width", value, 1.0);
+    fly_width_ = value;
+    private_nh.param("robot_length", value, 6.0);
+    robot_length_ = value;
+    private_nh.param("robot_width", value, 4.0);
+    robot_width_ = value;
+    private_nh.param("fly_intensity", fly_intensity_, 40);
+    private_nh.param("robot_intensity", robot_intensity_, 20);
+    private_nh.param("background", background_, 200);
+    private_nh.param("noise_sigma", noise_sigma_, 3.0);
+    private_nh.param("blur_sigma", blur_sigma_, 1.0);
+
+    // Same parameter names as camera_firewire, without the _original suffix
+    private_nh.param("KK_fx", K_[0], (double)width_);
+    private_nh.param("KK_fy", K_[4], (double)height_);
+    private_nh.param("KK_cx", K_[2], width_ / 2.0);
+    private_nh.param("KK_cy", K_[5], height_ / 2.0);
+    K_[1] = 0; K_[3] = 0; K_[6] = 0; K_[7] = 0; K_[8] = 1;
+    private_nh.param("kc_k1", kc_original_[0], 0.0);
+    private_nh.param("kc_k2", kc_original_[1], 0.0);
+    private_nh.param("kc_p1", kc_original_[2], 0.0);
+    private_nh.param("kc_p2", kc_original_[3], 0.0);
+    kc_original_[4] = 0;
+
+    double kc_undistorted[5] = {0, 0, 0, 0, 0};
+    initCameraInfo(undistorted_info_, K_, kc_undistorted);
+    initCameraInfo(original_info_, K_, kc_original_);
+
+    CvSize size = cvSize(width_, height_);
+    frame_ = cvCreateImage(size, IPL_DEPTH_8U, 1);
+    frame_distorted_ = cvCreateImage(size, IPL_DEPTH_8U, 1);
+    frame_noisy_ = cvCreateImage(size, IPL_DEPTH_8U, 1);
+    noise_ = cvCreateImage(size, IPL_DEPTH_16S, 1);
+    accumulator_ = cvCreateImage(size, IPL_DEPTH_16S, 1);
+    initDistortionMaps();
+
+    undistorted_pub_ = it_.advertise("UndistortedImage", 1);
+    original_pub_ = it_.advertise("OriginalImage", 1);
+    undistorted_info_pub_ = nh_.advertise<sensor_msgs::CameraInfo>("UndistortedCameraInfo", 4);
+    original_info_pub_ = nh_.advertise<sensor_msgs::CameraInfo>("OriginalCameraInfo", 4);
+
+    ROS_INFO("Simulated camera: %dx%d at %.1f fps, %.2f pixels/mm", width_, height_, framerate_, pixels_per_mm_);
+  }
+
+  SimCamera::~SimCamera()
+  {
+    cvReleaseImage(&frame_);
+    cvReleaseImage(&frame_distorted_);
+    cvReleaseImage(&frame_noisy_);
+    cvReleaseImage(&noise_);
+    cvReleaseImage(&accumulator_);
+    if (map_x_ != NULL)
+      {
+        cvReleaseImage(&map_x_);
+        cvReleaseImage(&map_y_);
+      }
+  }
+
+  void SimCamera::initCameraInfo(sensor_msgs::CameraInfo& info, const double* K, const double* D)
+  {
+    info.header.frame_id = frame_id_;
+    info.width = width_;
+    info.height = height_;
+    for (int i = 0; i < 5; ++i)
+      {
+        info.D[i] = D[i];
+      }
+    for (int i = 0; i < 9; ++i)
+      {
+        info.K[i] = K[i];
+        info.R[i] = (i % 4 == 0) ? 1 : 0;
+      }
+    for (int i = 0; i < 3; ++i)
+      {
+        info.P[4*i+0] = K[3*i+0];
+        info.P[4*i+1] = K[3*i+1];
+        info.P[4*i+2] = K[3*i+2];
+        info.P[4*i+3] = 0;
+      }
+  }
+
+  void SimCamera::initDistortionMaps()
+  {
+    bool distorted = false;
+    for (int i = 0; i < 5; ++i)
+      {
+        distorted = distorted || kc_original_[i] != 0.0;
+      }
+    if (!distorted)
+      {
+        return;
+      }
+
+    // camera_firewire undistorts with cvInitUndistortMap, which maps every
+    // undistorted pixel to where it lands in the original image.  Going the
+    // other way needs, for every original pixel, the undistorted pixel it
+    // came from, which is what cvUndistortPoints computes.
+    int count = width_ * height_;
+    CvMat* points = cvCreateMat(1, count, CV_32FC2);
+    float* p = points->data.fl;
+    for (int v = 0; v < height_; ++v)
+      {
+        for (int u = 0; u < width_; ++u)
+          {
+            *p++ = u;
+            *p++ = v;
+          }
+      }
+
+    CvMat K = cvMat(3, 3, CV_64FC1, K_);
+    CvMat D = cvMat(4, 1, CV_64FC1, kc_original_);
+    CvMat* undistorted = cvCreateMat(1, count, CV_32FC2);
+    cvUndistortPoints(points, undistorted, &K, &D, NULL, &K);
+
+    map_x_ = cvCreateImage(cvSize(width_, height_), IPL_DEPTH_32F, 1);
+    map_y_ = cvCreateImage(cvSize(width_, height_), IPL_DEPTH_32F, 1);
+    p = undistorted->data.fl;
+    for (int v = 0; v < height_; ++v)
+      {
+        float* map_x = (float*)(map_x_->imageData + v * map_x_->widthStep);
+        float* map_y = (float*)(map_y_->imageData + v * map_y_->widthStep);
+        for (int u = 0; u < width_; ++u)
+          {
+            map_x[u] = *p++;
+            map_y[u] = *p++;
+          }
+      }
+
+    cvReleaseMat(&points);
+    cvReleaseMat(&undistorted);
+  }
+
+  void SimCamera::update(double dt, const V_Blob& blobs)
+  {
+    time_to_frame_ -= dt;
+    if (time_to_frame_ > 0.0)
+      {
+        return;
+      }
+    // Keep the long run frame rate exact even though dt does not divide
+    // the frame period
+    time_to_frame_ = std::max(time_to_frame_ + 1.0 / framerate_, 0.0);
+
+    undistorted_info_.header.stamp = ros::Time::now();
+    original_info_.header.stamp = undistorted_info_.header.stamp;
+    undistorted_info_pub_.publish(undistorted_info_);
+    original_info_pub_.publish(original_info_);
+
+    // Drawn every frame, whoever is listening, so that a seed always gives
+    // the same sequence of images on both topics
+    drawNoise();
+
+    bool publish_undistorted = undistorted_pub_.getNumSubscribers() > 0;
+    bool publish_original = original_pub_.getNumSubscribers() > 0;
+    if (!publish_undistorted && !publish_original)
+      {
+        return;
+      }
+
+    render(blobs);
+
+    if (publish_original)
+      {
+        if (map_x_ != NULL)
+          {
+            cvRemap(frame_, frame_distorted_, map_x_, map_y_, CV_INTER_LINEAR + CV_WARP_FILL_OUTLIERS, cvScalarAll(background_));
+            addNoise(frame_distorted_, frame_noisy_);
+          }
+        else
+          {
+            addNoise(frame_, frame_noisy_);
+          }
+
+        if (sensor_msgs::CvBridge::fromIpltoRosImage(frame_noisy_, image_msg_, "passthrough"))
+          {
+            image_msg_.header = original_info_.header;
+            original_pub_.publish(image_msg_);
+          }
+        else
+          {
+            ROS_ERROR("error publishing simulated original image");
+          }
+      }
+
+    if (publish_undistorted)
+      {
+        addNoise(frame_, frame_noisy_);
+        if (sensor_msgs::CvBridge::fromIpltoRosImage(frame_noisy_, image_msg_, "passthrough"))
+          {
+            image_msg_.header = undistorted_info_.header;
+            undistorted_pub_.publish(image_msg_);
+          }
+        else
+          {
+            ROS_ERROR("error publishing simulated undistorted image");
+          }
+      }
+  }
+
+  void SimCamera::render(const V_Blob& blobs)
+  {
+    cvSet(frame_, cvScalarAll(background_));
+
+    float scale = pixels_per_mm_ * (1 << DRAW_SHIFT);
+    V_Blob::const_iterator it = blobs.begin();
+    V_Blob::const_iterator end = blobs.end();
+    for (; it != end; ++it)
+      {
+        float length = it->robot ? robot_length_ : fly_length_;
+        float width = it->robot ? robot_width_ : fly_width_;
+        int intensity = it->robot ? robot_intensity_ : fly_intensity_;
+
+        CvPoint center = cvPoint(cvRound(offset_x_ * (1 << DRAW_SHIFT) + it->x * scale),
+                                 cvRound(offset_y_ * (1 << DRAW_SHIFT) + it->y * scale));
+        CvSize axes = cvSize(cvRound(length * scale / 2.0), cvRound(width * scale / 2.0));
+        // Image y points down, so a counterclockwise theta is a negative
+        // (clockwise) angle for cvEllipse
+        cvEllipse(frame_, center, axes, -it->theta * 180.0 / PI, 0, 360, cvScalarAll(intensity), CV_FILLED, CV_AA, DRAW_SHIFT);
+      }
+
+    if (blur_sigma_ > 0.0)
+      {
+        cvSmooth(frame_, frame_, CV_GAUSSIAN, 0, 0, blur_sigma_);
+      }
+  }
+
+  void SimCamera::drawNoise()
+  {
+    if (noise_sigma_ > 0.0)
+      {
+        cvRandArr(&rng_, noise_, CV_RAND_NORMAL, cvScalarAll(0), cvScalarAll(noise_sigma_));
+      }
+  }
+
+  void SimCamera::addNoise(const IplImage* src, IplImage* dst)
+  {
+    if (noise_sigma_ <= 0.0)
+      {
+        cvCopy(src, dst);
+        return;
+      }
+
+    // Sum in 16 bits so the conversion back saturates instead of wrapping
+    cvConvert(src, accumulator_);
+    cvAdd(accumulator_, noise_, accumulator_);
+    cvConvert(accumulator_, dst);
+  }
+
+}